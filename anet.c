@@ -98,7 +98,9 @@ int anetResolve(char *err, char *host, char *ipbuf)
     return ANET_OK;
 }
 
-int anetTcpConnect(char *err, char *addr, int port)
+#define ANET_CONNECT_NONE 0
+#define ANET_CONNECT_NONBLOCK 1
+static int anetTcpGenericConnect(char *err, char *addr, int port, int flags)
 {
     int s;
     struct sockaddr_in sa;
@@ -120,14 +122,52 @@ int anetTcpConnect(char *err, char *addr, int port)
         }
         memcpy(&sa.sin_addr, he->h_addr, sizeof(struct in_addr));
     }
+    if (flags & ANET_CONNECT_NONBLOCK) {
+        if (anetNonBlock(err,s) != ANET_OK) {
+            close(s);
+            return ANET_ERR;
+        }
+    }
     if (connect(s, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+        int saved_errno = errno;
+
+        if (errno == EINPROGRESS && flags & ANET_CONNECT_NONBLOCK)
+            return s;
         anetSetError(err, "connect: %s\n", strerror(errno));
         close(s);
+        errno = saved_errno; /* the caller may want to know the cause */
         return ANET_ERR;
     }
     return s;
 }
 
+int anetTcpConnect(char *err, char *addr, int port)
+{
+    return anetTcpGenericConnect(err,addr,port,ANET_CONNECT_NONE);
+}
+
+/* Like anetTcpConnect() but the socket is non blocking and the function
+ * returns without waiting for the connection to be established. */
+int anetTcpNonBlockConnect(char *err, char *addr, int port)
+{
+    return anetTcpGenericConnect(err,addr,port,ANET_CONNECT_NONBLOCK);
+}
+
+/* Make close(2) send a RST instead of the usual FIN handshake, so that the
+ * socket does not stay in TIME_WAIT state on our side. */
+int anetRstOnClose(char *err, int fd)
+{
+    struct linger l;
+
+    l.l_onoff = 1;
+    l.l_linger = 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l)) == -1) {
+        anetSetError(err, "setsockopt SO_LINGER: %s\n", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+}
+
 /* Like read(2) but make sure 'count' is read before to return
  * (unless error or EOF condition is encountered) */
 int anetRead(int fd, void *buf, int count)
@@ -158,7 +198,9 @@ int anetWrite(int fd, void *buf, int count)
     return totlen;
 }
 
-int anetTcpServer(char *err, int port, char *bindaddr)
+#define ANET_SERVER_NONE 0
+#define ANET_SERVER_REUSEPORT 1
+static int anetGenericTcpServer(char *err, int port, char *bindaddr, int flags)
 {
     int s, on = 1;
     struct sockaddr_in sa;
@@ -172,6 +214,20 @@ int anetTcpServer(char *err, int port, char *bindaddr)
         close(s);
         return ANET_ERR;
     }
+    if (flags & ANET_SERVER_REUSEPORT) {
+#ifdef SO_REUSEPORT
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+            anetSetError(err, "setsockopt SO_REUSEPORT: %s\n",
+                strerror(errno));
+            close(s);
+            return ANET_ERR;
+        }
+#else
+        anetSetError(err, "SO_REUSEPORT not supported on this system\n");
+        close(s);
+        return ANET_ERR;
+#endif
+    }
     sa.sin_family = AF_INET;
     sa.sin_port = htons(port);
     sa.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -182,7 +238,7 @@ int anetTcpServer(char *err, int port, char *bindaddr)
         close(s);
         return ANET_ERR;
     }
-    if (listen(s, 5) == -1) {
+    if (listen(s, 511) == -1) {
         anetSetError(err, "listen: %s\n", strerror(errno));
         close(s);
         return ANET_ERR;
@@ -190,6 +246,19 @@ int anetTcpServer(char *err, int port, char *bindaddr)
     return s;
 }
 
+int anetTcpServer(char *err, int port, char *bindaddr)
+{
+    return anetGenericTcpServer(err,port,bindaddr,ANET_SERVER_NONE);
+}
+
+/* Like anetTcpServer() but SO_REUSEPORT is set, so that many sockets can
+ * listen on the same port, and the kernel will balance the incoming
+ * connections among them. */
+int anetTcpReusePortServer(char *err, int port, char *bindaddr)
+{
+    return anetGenericTcpServer(err,port,bindaddr,ANET_SERVER_REUSEPORT);
+}
+
 int anetAccept(char *err, int serversock, char *ip, int *port)
 {
     int fd;
@@ -213,3 +282,18 @@ int anetAccept(char *err, int serversock, char *ip, int *port)
     if (port) *port = ntohs(sa.sin_port);
     return fd;
 }
+
+int anetPeerToString(int fd, char *ip, int *port)
+{
+    struct sockaddr_in sa;
+    unsigned int saLen = sizeof(sa);
+
+    if (getpeername(fd, (struct sockaddr*)&sa, &saLen) == -1) {
+        if (port) *port = 0;
+        if (ip) strcpy(ip,"?");
+        return -1;
+    }
+    if (ip) strcpy(ip,inet_ntoa(sa.sin_addr));
+    if (port) *port = ntohs(sa.sin_port);
+    return 0;
+}
@@ -34,10 +34,14 @@
 int anetNonBlock(char *err, int fd);
 int anetTcpNoDelay(char *err, int fd);
 int anetTcpConnect(char *err, char *addr, int port);
+int anetTcpNonBlockConnect(char *err, char *addr, int port);
+int anetRstOnClose(char *err, int fd);
 int anetRead(int fd, void *buf, int count);
 int anetResolve(char *err, char *host, char *ipbuf);
 int anetTcpServer(char *err, int port, char *bindaddr);
+int anetTcpReusePortServer(char *err, int port, char *bindaddr);
 int anetAccept(char *err, int serversock, char *ip, int *port);
+int anetPeerToString(int fd, char *ip, int *port);
 int anetWrite(int fd, void *buf, int count);
 
 #endif
@@ -71,6 +71,13 @@ size_t sdsavail(char *s) {
     return sh->free;
 }
 
+void sdsclear(char *s) {
+    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
+    sh->free += sh->len;
+    sh->len = 0;
+    sh->buf[0] = '\0';
+}
+
 void sdsupdatelen(char *s) {
     struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
     int reallen = strlen(s);
@@ -134,15 +141,21 @@ char *sdscpy(char *s, char *t) {
 }
 
 char *sdscatprintf(char *s, const char *fmt, ...) {
-    va_list ap;
+    va_list ap, cpy;
     char *buf, *t;
     size_t buflen = 128;
     int nout;
 
     va_start(ap, fmt);
     while(1) {
-        if ((buf = malloc(buflen)) == NULL) return NULL;
-        nout = vsnprintf(buf, buflen, fmt, ap);
+        if ((buf = malloc(buflen)) == NULL) {
+            va_end(ap);
+            return NULL;
+        }
+        /* vsnprintf() consumes the arguments, use a copy every time */
+        va_copy(cpy, ap);
+        nout = vsnprintf(buf, buflen, fmt, cpy);
+        va_end(cpy);
         if (buflen <= nout) {
             free(buf);
             buflen *= 2;
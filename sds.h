@@ -53,5 +53,6 @@ char *sdscatprintf(char *s, const char *fmt, ...);
 char *sdstrim(char *s, const char *cset);
 char *sdsrange(char *s, long start, long end);
 void sdsupdatelen(char *s);
+void sdsclear(char *s);
 
 #endif
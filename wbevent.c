@@ -0,0 +1,847 @@
+/* wbevent.c -- minimal event loop, epoll(7) or poll(2) based
+ * Copyright (C) 2007 Salvatore Sanfilippo, antirez@gmail.com
+ * This softare is released under the following BSD license:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may 
+ *    be used to endorse or promote products derived from this software 
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "wbevent.h"
+
+#if defined(WBOX_URING) && !defined(__linux__)
+#undef WBOX_URING
+#endif
+
+static int evuseuring; /* try io_uring first, see evUseUring() */
+static char *evapiname; /* API used by the last loop created */
+
+#ifdef __linux__
+/* ---------------------------- io_uring backend ---------------------------- */
+#ifdef WBOX_URING
+#include <stdint.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* The ring is used in two ways. The file events use it as a readiness
+ * API, like epoll: a one shot IORING_OP_POLL_ADD is armed for every fd
+ * with events, and armed again after it fires if the fd is still
+ * interesting. Besides that the caller can perform the I/O itself in the
+ * ring with the ops, see evAcceptOp() and the following functions: the
+ * accepts and the receives are multishot, so they are submitted once and
+ * then complete again and again, the receives into buffers provided to
+ * the kernel in advance. The op handlers are called as the completions
+ * are reaped. Either way all the changes of an iteration and the wait for
+ * the next events take a single io_uring_enter() call. The raw system
+ * calls are used, so liburing is not needed. */
+#define EV_URING_ENTRIES 4096
+#define EV_URING_INTERNAL (1ULL<<63) /* user_data of removals and cancels */
+#define EV_URING_OP (1ULL<<62) /* user_data of the ops, with the op id */
+#define EV_URING_RECVBUFS 512 /* buffers provided for the receives */
+#define EV_URING_RECVBUF 4096 /* size of every receive buffer */
+#define EV_URING_BGID 0 /* buffer group of the receive buffers */
+
+/* The timeout of the wait (IORING_ENTER_EXT_ARG), multishot accept and
+ * receive, and the provided buffer rings were all added before Linux 6.3,
+ * the first one with this feature. */
+#ifndef IORING_FEAT_REG_REG_RING
+#define IORING_FEAT_REG_REG_RING (1U << 13)
+#endif
+
+typedef struct evOp {
+    evOpProc *proc;
+    void *clientData;
+    int next; /* next free op, -1 if none */
+    struct msghdr msg; /* send ops: kept here until the completion */
+    struct iovec iov[EV_OP_MAXIOV];
+} evOp;
+
+typedef struct evUring {
+    int fd;
+    void *sqring, *cqring; /* same memory if IORING_FEAT_SINGLE_MMAP */
+    size_t sqringlen, cqringlen, sqeslen;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray, sqentries;
+    struct io_uring_sqe *sqes;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+    int *armed; /* events armed for every fd, EV_NONE if none */
+    unsigned *gen; /* bumped when a poll is removed, stale CQEs are ignored */
+    int *rearm; /* fds whose poll fired, to arm again */
+    int nrearm;
+    evOp *ops; /* op slots, the id of an op is its index */
+    int numops, freeop; /* number of slots, first free one (-1 if none) */
+    struct io_uring_buf_ring *br; /* receive buffers provided to the kernel */
+    size_t brlen;
+    char *recvbufs;
+    unsigned short brtail;
+} evUring;
+
+static int evUringEnter(evUring *r, unsigned tosubmit, unsigned mincomplete,
+                        unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter,r->fd,tosubmit,mincomplete,flags,
+        arg,argsz);
+}
+
+static void evUringFree(evUring *r) {
+    if (r->sqes) munmap(r->sqes,r->sqeslen);
+    if (r->cqring && r->cqring != r->sqring) munmap(r->cqring,r->cqringlen);
+    if (r->sqring) munmap(r->sqring,r->sqringlen);
+    if (r->fd != -1) close(r->fd);
+    free(r->armed);
+    free(r->gen);
+    free(r->rearm);
+    if (r->br) munmap(r->br,r->brlen);
+    free(r->recvbufs);
+    free(r->ops);
+    free(r);
+}
+
+/* Give back to the kernel the receive buffer 'bid' */
+static void evUringProvide(evUring *r, int bid) {
+    struct io_uring_buf *b;
+
+    b = &r->br->bufs[r->brtail & (EV_URING_RECVBUFS-1)];
+    b->addr = (unsigned long long)(uintptr_t)
+        (r->recvbufs+(size_t)bid*EV_URING_RECVBUF);
+    b->len = EV_URING_RECVBUF;
+    b->bid = bid;
+    r->brtail++;
+    __atomic_store_n(&r->br->tail,r->brtail,__ATOMIC_RELEASE);
+}
+
+/* Set up the op slots and register the receive buffers. */
+static int evUringCreateOps(evUring *r, int setsize) {
+    struct io_uring_buf_reg reg;
+    int j;
+
+    /* A receive and a send for every client, plus the accepts */
+    r->numops = setsize*2;
+    r->ops = malloc(sizeof(evOp)*r->numops);
+    r->recvbufs = malloc((size_t)EV_URING_RECVBUFS*EV_URING_RECVBUF);
+    r->brlen = sizeof(struct io_uring_buf)*EV_URING_RECVBUFS;
+    r->br = mmap(NULL,r->brlen,PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (r->br == MAP_FAILED) r->br = NULL;
+    if (!r->ops || !r->recvbufs || !r->br) return -1;
+    for (j = 0; j < r->numops; j++)
+        r->ops[j].next = (j == r->numops-1) ? -1 : j+1;
+    r->freeop = 0;
+    memset(&reg,0,sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)r->br;
+    reg.ring_entries = EV_URING_RECVBUFS;
+    reg.bgid = EV_URING_BGID;
+    if (syscall(__NR_io_uring_register,r->fd,IORING_REGISTER_PBUF_RING,
+        &reg,1) == -1) return -1;
+    for (j = 0; j < EV_URING_RECVBUFS; j++) evUringProvide(r,j);
+    return 0;
+}
+
+static evUring *evUringCreate(int setsize) {
+    struct io_uring_params p;
+    evUring *r = calloc(1,sizeof(*r));
+    char *sq, *cq;
+
+    if (!r) return NULL;
+    r->armed = calloc(setsize,sizeof(int));
+    r->gen = calloc(setsize,sizeof(unsigned));
+    r->rearm = malloc(sizeof(int)*setsize);
+    memset(&p,0,sizeof(p));
+    /* The loop is only used by the thread that created it, so the
+     * completions can be left to be run when we wait for them. */
+    p.flags = IORING_SETUP_CQSIZE|IORING_SETUP_SINGLE_ISSUER|
+              IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = EV_URING_ENTRIES*4;
+    r->fd = syscall(__NR_io_uring_setup,EV_URING_ENTRIES,&p);
+    if (!r->armed || !r->gen || !r->rearm || r->fd == -1 ||
+        !(p.features & IORING_FEAT_REG_REG_RING)) goto err;
+    r->sqringlen = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+    r->cqringlen = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqringlen > r->sqringlen) r->sqringlen = r->cqringlen;
+        r->cqringlen = r->sqringlen;
+    }
+    r->sqring = mmap(NULL,r->sqringlen,PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQ_RING);
+    if (r->sqring == MAP_FAILED) {
+        r->sqring = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cqring = r->sqring;
+    } else {
+        r->cqring = mmap(NULL,r->cqringlen,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_CQ_RING);
+        if (r->cqring == MAP_FAILED) {
+            r->cqring = NULL;
+            goto err;
+        }
+    }
+    r->sqeslen = p.sq_entries*sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL,r->sqeslen,PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto err;
+    }
+    sq = r->sqring;
+    cq = r->cqring;
+    r->sqhead = (unsigned*)(sq+p.sq_off.head);
+    r->sqtail = (unsigned*)(sq+p.sq_off.tail);
+    r->sqmask = (unsigned*)(sq+p.sq_off.ring_mask);
+    r->sqarray = (unsigned*)(sq+p.sq_off.array);
+    r->sqentries = p.sq_entries;
+    r->cqhead = (unsigned*)(cq+p.cq_off.head);
+    r->cqtail = (unsigned*)(cq+p.cq_off.tail);
+    r->cqmask = (unsigned*)(cq+p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq+p.cq_off.cqes);
+    if (evUringCreateOps(r,setsize) == -1) goto err;
+    return r;
+
+err:
+    evUringFree(r);
+    return NULL;
+}
+
+/* Make sure there are 'n' free submission queue entries, submitting the
+ * queued ones if needed. Returns -1 if there is no room anyway. */
+static int evUringReserve(evUring *r, unsigned n) {
+    unsigned tail = *r->sqtail, head;
+
+    head = __atomic_load_n(r->sqhead,__ATOMIC_ACQUIRE);
+    if (r->sqentries-(tail-head) >= n) return 0;
+    evUringEnter(r,tail-head,0,0,NULL,0);
+    head = __atomic_load_n(r->sqhead,__ATOMIC_ACQUIRE);
+    return (r->sqentries-(tail-head) >= n) ? 0 : -1;
+}
+
+/* Return a cleared submission queue entry, submitting the queued ones
+ * first if the queue is full. */
+static struct io_uring_sqe *evUringGetSqe(evUring *r) {
+    unsigned tail = *r->sqtail;
+    struct io_uring_sqe *sqe;
+
+    if (evUringReserve(r,1) == -1) return NULL;
+    sqe = &r->sqes[tail & *r->sqmask];
+    memset(sqe,0,sizeof(*sqe));
+    r->sqarray[tail & *r->sqmask] = tail & *r->sqmask;
+    return sqe;
+}
+
+static void evUringQueue(evUring *r) {
+    __atomic_store_n(r->sqtail,*r->sqtail+1,__ATOMIC_RELEASE);
+}
+
+static int evUringArm(evUring *r, int fd, int mask) {
+    struct io_uring_sqe *sqe = evUringGetSqe(r);
+
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    if (mask & EV_READABLE) sqe->poll32_events |= POLLIN;
+    if (mask & EV_WRITABLE) sqe->poll32_events |= POLLOUT;
+    sqe->user_data = ((unsigned long long)r->gen[fd] << 32) | fd;
+    evUringQueue(r);
+    r->armed[fd] = mask;
+    return 0;
+}
+
+static int evUringUpdate(evLoop *el, evUring *r, int fd, int newmask) {
+    if (r->armed[fd] != EV_NONE && r->armed[fd] != newmask) {
+        struct io_uring_sqe *sqe = evUringGetSqe(r);
+
+        if (!sqe) return -1;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = ((unsigned long long)r->gen[fd] << 32) | fd;
+        sqe->user_data = EV_URING_INTERNAL;
+        evUringQueue(r);
+        r->gen[fd] = (r->gen[fd]+1) & 0x7fffffff;
+        r->armed[fd] = EV_NONE;
+    }
+    if (newmask != EV_NONE && r->armed[fd] == EV_NONE)
+        return evUringArm(r,fd,newmask);
+    (void) el;
+    return 0;
+}
+
+/* Take a free op slot, -1 if there are none */
+static int evUringNewOp(evUring *r, evOpProc *proc, void *clientData) {
+    int id = r->freeop;
+
+    if (id == -1) return -1;
+    r->freeop = r->ops[id].next;
+    r->ops[id].proc = proc;
+    r->ops[id].clientData = clientData;
+    return id;
+}
+
+static int evUringAccept(evUring *r, int fd, evOpProc *proc,
+                         void *clientData)
+{
+    struct io_uring_sqe *sqe;
+    int id;
+
+    if (evUringReserve(r,1) == -1 ||
+        (id = evUringNewOp(r,proc,clientData)) == -1) return -1;
+    sqe = evUringGetSqe(r);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK|SOCK_CLOEXEC;
+    sqe->user_data = EV_URING_OP|id;
+    evUringQueue(r);
+    return id;
+}
+
+static int evUringRecv(evUring *r, int fd, evOpProc *proc, void *clientData) {
+    struct io_uring_sqe *sqe;
+    int id;
+
+    if (evUringReserve(r,1) == -1 ||
+        (id = evUringNewOp(r,proc,clientData)) == -1) return -1;
+    sqe = evUringGetSqe(r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = EV_URING_BGID;
+    sqe->user_data = EV_URING_OP|id;
+    evUringQueue(r);
+    return id;
+}
+
+/* Send the buffers 'iov'. If 'filefd' is not -1 the last buffer is first
+ * filled reading the file from 'offset', by a read linked to the send:
+ * if the read fails or is short the send completes with -ECANCELED. */
+static int evUringSend(evUring *r, int fd, struct iovec *iov, int iovcnt,
+                       int filefd, long long offset, evOpProc *proc,
+                       void *clientData)
+{
+    struct io_uring_sqe *sqe;
+    evOp *op;
+    int id, j;
+
+    /* The linked entries must be submitted together */
+    if (iovcnt < 1 || iovcnt > EV_OP_MAXIOV || evUringReserve(r,2) == -1 ||
+        (id = evUringNewOp(r,proc,clientData)) == -1) return -1;
+    op = &r->ops[id];
+    for (j = 0; j < iovcnt; j++) op->iov[j] = iov[j];
+    memset(&op->msg,0,sizeof(op->msg));
+    op->msg.msg_iov = op->iov;
+    op->msg.msg_iovlen = iovcnt;
+    if (filefd != -1) {
+        sqe = evUringGetSqe(r);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = filefd;
+        sqe->off = offset;
+        sqe->addr = (unsigned long long)(uintptr_t)iov[iovcnt-1].iov_base;
+        sqe->len = iov[iovcnt-1].iov_len;
+        sqe->flags = IOSQE_IO_LINK|IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = EV_URING_INTERNAL;
+        evUringQueue(r);
+    }
+    sqe = evUringGetSqe(r);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)&op->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_WAITALL|MSG_NOSIGNAL;
+    sqe->user_data = EV_URING_OP|id;
+    evUringQueue(r);
+    return id;
+}
+
+static void evUringCancel(evUring *r, int id) {
+    struct io_uring_sqe *sqe = evUringGetSqe(r);
+
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = EV_URING_OP|id;
+    sqe->user_data = EV_URING_INTERNAL;
+    evUringQueue(r);
+}
+
+/* Call the handler of the op 'id' for a completion. The slot is free
+ * again once the op will not complete anymore, and the receive buffer
+ * is given back to the kernel when the handler returns. */
+static void evUringOpDone(evLoop *el, evUring *r, int id, int res,
+                          unsigned cflags)
+{
+    evOpProc *proc = r->ops[id].proc;
+    void *clientData = r->ops[id].clientData;
+    int bid = -1, flags = 0;
+    char *buf = NULL;
+
+    if (cflags & IORING_CQE_F_BUFFER) {
+        bid = cflags >> IORING_CQE_BUFFER_SHIFT;
+        buf = r->recvbufs+(size_t)bid*EV_URING_RECVBUF;
+    }
+    if (cflags & IORING_CQE_F_MORE) {
+        flags |= EV_OP_MORE;
+    } else {
+        r->ops[id].next = r->freeop;
+        r->freeop = id;
+    }
+    proc(el,clientData,res,buf,flags);
+    if (bid != -1) evUringProvide(r,bid);
+}
+
+static int evUringPoll(evLoop *el, evUring *r, int timeout) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned head, tail;
+    int j, numevents = 0;
+
+    /* Arm again the polls that fired, unless the handlers removed the
+     * events (or changed them, arming a new poll). */
+    for (j = 0; j < r->nrearm; j++) {
+        int fd = r->rearm[j], mask = el->events[fd].mask;
+
+        if (mask != EV_NONE && r->armed[fd] == EV_NONE)
+            evUringArm(r,fd,mask);
+    }
+    r->nrearm = 0;
+    memset(&arg,0,sizeof(arg));
+    arg.sigmask_sz = _NSIG/8;
+    if (timeout >= 0) {
+        ts.tv_sec = timeout/1000;
+        ts.tv_nsec = (long long)(timeout%1000)*1000000;
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+    }
+    evUringEnter(r,*r->sqtail-__atomic_load_n(r->sqhead,__ATOMIC_ACQUIRE),
+        timeout == 0 ? 0 : 1,IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+        &arg,sizeof(arg));
+    /* Errors (timeout, signals) just mean there are no completions */
+    head = *r->cqhead;
+    tail = __atomic_load_n(r->cqtail,__ATOMIC_ACQUIRE);
+    while(head != tail && numevents < el->setsize) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cqmask];
+        unsigned long long ud = cqe->user_data;
+        int fd = ud & 0xffffffff, mask = 0, res = cqe->res;
+        unsigned cflags = cqe->flags;
+
+        head++;
+        if (ud & EV_URING_INTERNAL) continue;
+        if (ud & EV_URING_OP) {
+            /* The handler may submit, so the entry is consumed first */
+            __atomic_store_n(r->cqhead,head,__ATOMIC_RELEASE);
+            evUringOpDone(el,r,fd,res,cflags);
+            continue;
+        }
+        if (fd >= el->setsize || (ud >> 32) != r->gen[fd] ||
+            r->armed[fd] == EV_NONE) continue;
+        if (res < 0) {
+            /* Report errors to the handlers, like hangups */
+            mask = r->armed[fd];
+        } else {
+            if (res & (POLLIN|POLLERR|POLLHUP)) mask |= EV_READABLE;
+            if (res & (POLLOUT|POLLERR|POLLHUP)) mask |= EV_WRITABLE;
+        }
+        r->armed[fd] = EV_NONE;
+        r->rearm[r->nrearm++] = fd;
+        el->fired[numevents].fd = fd;
+        el->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(r->cqhead,head,__ATOMIC_RELEASE);
+    return numevents;
+}
+#endif
+
+/* ----------------------------- epoll backend ------------------------------ */
+#include <sys/epoll.h>
+
+typedef struct evApiState {
+    int epfd;
+    struct epoll_event *events;
+#ifdef WBOX_URING
+    evUring *ring; /* io_uring is used instead of epoll if not NULL */
+#endif
+} evApiState;
+
+static int evApiCreate(evLoop *el) {
+    evApiState *state = malloc(sizeof(evApiState));
+
+    if (!state) return -1;
+#ifdef WBOX_URING
+    state->ring = NULL;
+    if (evuseuring && (state->ring = evUringCreate(el->setsize)) != NULL) {
+        state->epfd = -1;
+        state->events = NULL;
+        el->apidata = state;
+        evapiname = "io_uring";
+        return 0;
+    }
+#endif
+    state->events = malloc(sizeof(struct epoll_event)*el->setsize);
+    if (!state->events) {
+        free(state);
+        return -1;
+    }
+    state->epfd = epoll_create(1024); /* 1024 is just an hint for the kernel */
+    if (state->epfd == -1) {
+        free(state->events);
+        free(state);
+        return -1;
+    }
+    el->apidata = state;
+    evapiname = "epoll";
+    return 0;
+}
+
+static void evApiFree(evLoop *el) {
+    evApiState *state = el->apidata;
+
+#ifdef WBOX_URING
+    if (state->ring) evUringFree(state->ring);
+#endif
+    if (state->epfd != -1) close(state->epfd);
+    free(state->events);
+    free(state);
+}
+
+static int evApiUpdate(evLoop *el, int fd, int oldmask, int newmask) {
+    evApiState *state = el->apidata;
+    struct epoll_event ee;
+    int op;
+
+#ifdef WBOX_URING
+    if (state->ring) return evUringUpdate(el,state->ring,fd,newmask);
+#endif
+    if (newmask == EV_NONE) {
+        /* Note: kernels < 2.6.9 require a non null event pointer even
+         * for EPOLL_CTL_DEL. */
+        memset(&ee,0,sizeof(ee));
+        return epoll_ctl(state->epfd,EPOLL_CTL_DEL,fd,&ee);
+    }
+    op = (oldmask == EV_NONE) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    ee.events = 0;
+    if (newmask & EV_READABLE) ee.events |= EPOLLIN;
+    if (newmask & EV_WRITABLE) ee.events |= EPOLLOUT;
+    ee.data.u64 = 0; /* avoid valgrind warning */
+    ee.data.fd = fd;
+    return epoll_ctl(state->epfd,op,fd,&ee);
+}
+
+static int evApiPoll(evLoop *el, int timeout) {
+    evApiState *state = el->apidata;
+    int retval, j, numevents = 0;
+
+#ifdef WBOX_URING
+    if (state->ring) return evUringPoll(el,state->ring,timeout);
+#endif
+    retval = epoll_wait(state->epfd,state->events,el->setsize,timeout);
+    if (retval > 0) {
+        numevents = retval;
+        for (j = 0; j < numevents; j++) {
+            int mask = 0;
+            struct epoll_event *e = state->events+j;
+
+            /* Errors and hangups are reported to the handlers, that will
+             * notice the condition on the next read() or write(). */
+            if (e->events & (EPOLLIN|EPOLLERR|EPOLLHUP)) mask |= EV_READABLE;
+            if (e->events & (EPOLLOUT|EPOLLERR|EPOLLHUP)) mask |= EV_WRITABLE;
+            el->fired[j].fd = e->data.fd;
+            el->fired[j].mask = mask;
+        }
+    }
+    return numevents;
+}
+
+/* ------------------------------ poll backend ------------------------------ */
+#else
+#include <poll.h>
+
+typedef struct evApiState {
+    struct pollfd *pfd;
+} evApiState;
+
+static int evApiCreate(evLoop *el) {
+    evApiState *state = malloc(sizeof(evApiState));
+
+    if (!state) return -1;
+    state->pfd = malloc(sizeof(struct pollfd)*el->setsize);
+    if (!state->pfd) {
+        free(state);
+        return -1;
+    }
+    el->apidata = state;
+    evapiname = "poll";
+    return 0;
+}
+
+static void evApiFree(evLoop *el) {
+    evApiState *state = el->apidata;
+
+    free(state->pfd);
+    free(state);
+}
+
+static int evApiUpdate(evLoop *el, int fd, int oldmask, int newmask) {
+    /* Nothing to do, the pollfd array is rebuilt at every iteration */
+    (void) el; (void) fd; (void) oldmask; (void) newmask;
+    return 0;
+}
+
+static int evApiPoll(evLoop *el, int timeout) {
+    evApiState *state = el->apidata;
+    int j, n = 0, numevents = 0;
+
+    for (j = 0; j <= el->maxfd; j++) {
+        int mask = el->events[j].mask;
+
+        if (mask == EV_NONE) continue;
+        state->pfd[n].fd = j;
+        state->pfd[n].events = 0;
+        state->pfd[n].revents = 0;
+        if (mask & EV_READABLE) state->pfd[n].events |= POLLIN;
+        if (mask & EV_WRITABLE) state->pfd[n].events |= POLLOUT;
+        n++;
+    }
+    if (poll(state->pfd,n,timeout) <= 0) return 0;
+    for (j = 0; j < n; j++) {
+        int mask = 0, re = state->pfd[j].revents;
+
+        if (re == 0) continue;
+        if (re & (POLLIN|POLLERR|POLLHUP)) mask |= EV_READABLE;
+        if (re & (POLLOUT|POLLERR|POLLHUP)) mask |= EV_WRITABLE;
+        el->fired[numevents].fd = state->pfd[j].fd;
+        el->fired[numevents].mask = mask;
+        numevents++;
+    }
+    return numevents;
+}
+
+#endif
+
+/* ------------------------------- Event loop ------------------------------- */
+
+/* Use io_uring, when available, for the loops created from now on. If
+ * the kernel does not support it (or it was not compiled in) the default
+ * API is used. Returns 0 if io_uring support is not compiled in. */
+int evUseUring(int enable) {
+    evuseuring = enable;
+#ifdef WBOX_URING
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* Return true if the ops are supported by the loop 'el', that is if it
+ * uses io_uring. Without ops the caller uses the file events. */
+int evHasOps(evLoop *el) {
+#ifdef WBOX_URING
+    return ((evApiState*)el->apidata)->ring != NULL;
+#else
+    (void) el;
+    return 0;
+#endif
+}
+
+#ifdef WBOX_URING
+#define evRing(el) (((evApiState*)(el)->apidata)->ring)
+#endif
+
+/* Accept the connections of the listening socket 'fd' until the op is
+ * canceled or fails. For every connection 'proc' is called with the new
+ * non blocking socket as 'res' (or -errno), and the EV_OP_MORE flag set
+ * if the op is still active. Returns the op id, or EV_ERR. */
+int evAcceptOp(evLoop *el, int fd, evOpProc *proc, void *clientData) {
+#ifdef WBOX_URING
+    if (evRing(el)) return evUringAccept(evRing(el),fd,proc,clientData);
+#else
+    (void) el; (void) fd; (void) proc; (void) clientData;
+#endif
+    errno = ENOSYS;
+    return EV_ERR;
+}
+
+/* Receive from 'fd' until the op is canceled or fails: 'proc' is called
+ * with the data in 'buf' and its length in 'res', 0 on EOF, or -errno.
+ * The buffer is only valid until 'proc' returns. When the flag
+ * EV_OP_MORE is not set the op is over, and -ENOBUFS means that the
+ * receive buffers were all in use, so it should just be started again. */
+int evRecvOp(evLoop *el, int fd, evOpProc *proc, void *clientData) {
+#ifdef WBOX_URING
+    if (evRing(el)) return evUringRecv(evRing(el),fd,proc,clientData);
+#else
+    (void) el; (void) fd; (void) proc; (void) clientData;
+#endif
+    errno = ENOSYS;
+    return EV_ERR;
+}
+
+/* Send all the 'iovcnt' buffers (at most EV_OP_MAXIOV) to 'fd', calling
+ * 'proc' with the bytes sent or -errno. If 'filefd' is not -1 the last
+ * buffer is first filled with the file content at 'offset', and a short
+ * read completes the op with -ECANCELED. The buffers must be valid until
+ * the completion. Returns the op id, or EV_ERR. */
+int evSendOp(evLoop *el, int fd, struct iovec *iov, int iovcnt, int filefd,
+             long long offset, evOpProc *proc, void *clientData)
+{
+#ifdef WBOX_URING
+    if (evRing(el))
+        return evUringSend(evRing(el),fd,iov,iovcnt,filefd,offset,proc,
+            clientData);
+#else
+    (void) el; (void) fd; (void) iov; (void) iovcnt; (void) filefd;
+    (void) offset; (void) proc; (void) clientData;
+#endif
+    errno = ENOSYS;
+    return EV_ERR;
+}
+
+/* Cancel the op 'id'. The handler is still called for its completions,
+ * the last one usually with -ECANCELED. */
+void evCancelOp(evLoop *el, int id) {
+#ifdef WBOX_URING
+    if (evRing(el)) evUringCancel(evRing(el),id);
+#else
+    (void) el; (void) id;
+#endif
+}
+
+/* Return the name of the API used by the last loop created */
+char *evGetApiName(void) {
+    return evapiname;
+}
+
+evLoop *evCreateLoop(int setsize) {
+    evLoop *el;
+    int j;
+
+    if ((el = malloc(sizeof(*el))) == NULL) return NULL;
+    el->events = malloc(sizeof(evFileEvent)*setsize);
+    el->fired = malloc(sizeof(evFiredEvent)*setsize);
+    if (el->events == NULL || el->fired == NULL) goto err;
+    el->setsize = setsize;
+    el->maxfd = -1;
+    el->stop = 0;
+    if (evApiCreate(el) == -1) goto err;
+    /* Events with mask == EV_NONE are not set. */
+    for (j = 0; j < setsize; j++)
+        el->events[j].mask = EV_NONE;
+    return el;
+
+err:
+    free(el->events);
+    free(el->fired);
+    free(el);
+    return NULL;
+}
+
+void evDeleteLoop(evLoop *el) {
+    evApiFree(el);
+    free(el->events);
+    free(el->fired);
+    free(el);
+}
+
+void evStop(evLoop *el) {
+    el->stop = 1;
+}
+
+int evCreateFileEvent(evLoop *el, int fd, int mask,
+        evFileProc *proc, void *clientData)
+{
+    evFileEvent *fe;
+
+    if (fd < 0 || fd >= el->setsize) {
+        errno = ERANGE;
+        return EV_ERR;
+    }
+    fe = &el->events[fd];
+    if (evApiUpdate(el,fd,fe->mask,fe->mask|mask) == -1)
+        return EV_ERR;
+    fe->mask |= mask;
+    if (mask & EV_READABLE) fe->rfileProc = proc;
+    if (mask & EV_WRITABLE) fe->wfileProc = proc;
+    fe->clientData = clientData;
+    if (fd > el->maxfd) el->maxfd = fd;
+    return EV_OK;
+}
+
+void evDeleteFileEvent(evLoop *el, int fd, int mask)
+{
+    evFileEvent *fe;
+
+    if (fd < 0 || fd >= el->setsize) return;
+    fe = &el->events[fd];
+    if (fe->mask == EV_NONE || (fe->mask & mask) == 0) return;
+    evApiUpdate(el,fd,fe->mask,fe->mask & (~mask));
+    fe->mask = fe->mask & (~mask);
+    if (fd == el->maxfd && fe->mask == EV_NONE) {
+        /* Update the max fd */
+        int j;
+
+        for (j = el->maxfd-1; j >= 0; j--)
+            if (el->events[j].mask != EV_NONE) break;
+        el->maxfd = j;
+    }
+}
+
+int evGetFileEvents(evLoop *el, int fd) {
+    if (fd < 0 || fd >= el->setsize) return EV_NONE;
+    return el->events[fd].mask;
+}
+
+/* Wait at max 'timeout' milliseconds (-1 = forever) for events, and call
+ * the handlers of the fired events. Returns the number of events
+ * processed. */
+int evProcessEvents(evLoop *el, int timeout)
+{
+    int j, numevents;
+
+    numevents = evApiPoll(el,timeout);
+    for (j = 0; j < numevents; j++) {
+        int fd = el->fired[j].fd;
+        int mask = el->fired[j].mask;
+        evFileEvent *fe = &el->events[fd];
+        int rfired = 0;
+
+        /* Note the fe->mask & mask & ... code: maybe an already processed
+         * event removed an element that fired and we still didn't
+         * processed, so we check if the event is still valid. */
+        if (fe->mask & mask & EV_READABLE) {
+            rfired = 1;
+            fe->rfileProc(el,fd,fe->clientData,mask);
+        }
+        if (fe->mask & mask & EV_WRITABLE) {
+            if (!rfired || fe->wfileProc != fe->rfileProc)
+                fe->wfileProc(el,fd,fe->clientData,mask);
+        }
+    }
+    return numevents;
+}
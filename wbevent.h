@@ -0,0 +1,86 @@
+/* Copyright (C) 2007 Salvatore Sanfilippo, antirez@gmail.com
+ * This softare is released under the following BSD license:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may 
+ *    be used to endorse or promote products derived from this software 
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef WBOX_EVENT_H
+#define WBOX_EVENT_H
+
+#define EV_OK 0
+#define EV_ERR -1
+
+#define EV_NONE 0
+#define EV_READABLE 1
+#define EV_WRITABLE 2
+
+#define EV_OP_MORE 1 /* more completions will follow for the same op */
+#define EV_OP_MAXIOV 2 /* max buffers of a send op */
+
+struct evLoop;
+struct iovec;
+
+typedef void evFileProc(struct evLoop *el, int fd, void *clientData, int mask);
+typedef void evOpProc(struct evLoop *el, void *clientData, int res, char *buf,
+        int flags);
+
+typedef struct evFileEvent {
+    int mask; /* one of EV_(READABLE|WRITABLE) */
+    evFileProc *rfileProc;
+    evFileProc *wfileProc;
+    void *clientData;
+} evFileEvent;
+
+typedef struct evFiredEvent {
+    int fd;
+    int mask;
+} evFiredEvent;
+
+typedef struct evLoop {
+    int setsize; /* max number of file descriptors tracked */
+    int maxfd;   /* highest file descriptor currently registered */
+    evFileEvent *events; /* registered events, indexed by fd */
+    evFiredEvent *fired; /* fired events */
+    int stop;
+    void *apidata; /* polling API specific data */
+} evLoop;
+
+evLoop *evCreateLoop(int setsize);
+void evDeleteLoop(evLoop *el);
+void evStop(evLoop *el);
+int evCreateFileEvent(evLoop *el, int fd, int mask,
+        evFileProc *proc, void *clientData);
+void evDeleteFileEvent(evLoop *el, int fd, int mask);
+int evGetFileEvents(evLoop *el, int fd);
+int evProcessEvents(evLoop *el, int timeout);
+char *evGetApiName(void);
+int evUseUring(int enable);
+int evHasOps(evLoop *el);
+int evAcceptOp(evLoop *el, int fd, evOpProc *proc, void *clientData);
+int evRecvOp(evLoop *el, int fd, evOpProc *proc, void *clientData);
+int evSendOp(evLoop *el, int fd, struct iovec *iov, int iovcnt, int filefd,
+        long long offset, evOpProc *proc, void *clientData);
+void evCancelOp(evLoop *el, int id);
+
+#endif
@@ -0,0 +1,176 @@
+/* Copyright (C) 2007 Salvatore Sanfilippo, antirez@gmail.com
+ * This softare is released under the following BSD license:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may 
+ *    be used to endorse or promote products derived from this software 
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "wblog.h"
+
+/* Return how many of the 'len' bytes at 'tail' to write at once: all of
+ * them, or if there is a 'maxwrite' limit as many whole lines as fit. A
+ * single line longer than the limit is written in pieces. */
+static size_t alogBatchLen(alog *l, unsigned long long tail, size_t len) {
+    size_t j;
+
+    if (l->maxwrite == 0 || len <= l->maxwrite) return len;
+    for (j = l->maxwrite; j > 0; j--)
+        if (l->buf[(tail+j-1) & (l->size-1)] == '\n') return j;
+    return l->maxwrite;
+}
+
+/* Write everything in the ring. Data that can't be written because of
+ * an error is discarded, the producer must not wait for it. */
+static void alogFlush(alog *l) {
+    unsigned long long head = __atomic_load_n(&l->head,__ATOMIC_ACQUIRE);
+    unsigned long long tail = l->tail;
+
+    while(tail < head) {
+        size_t off = tail & (l->size-1);
+        size_t len = alogBatchLen(l,tail,head-tail);
+        struct iovec iov[2];
+        int n = 1;
+        ssize_t nwritten;
+
+        iov[0].iov_base = l->buf+off;
+        iov[0].iov_len = len;
+        if (off+len > l->size) {
+            iov[0].iov_len = l->size-off;
+            iov[1].iov_base = l->buf;
+            iov[1].iov_len = len-iov[0].iov_len;
+            n = 2;
+        }
+        nwritten = writev(l->fd,iov,n);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            nwritten = len;
+        }
+        tail += nwritten;
+        __atomic_store_n(&l->tail,tail,__ATOMIC_RELEASE);
+    }
+}
+
+static void *alogThread(void *arg) {
+    alog *l = arg;
+    int stop = 0;
+
+    while(!stop) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME,&ts);
+        ts.tv_sec += l->flushms/1000;
+        ts.tv_nsec += (long)(l->flushms%1000)*1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&l->lock);
+        if (!l->stop && !l->wakeup)
+            pthread_cond_timedwait(&l->cond,&l->lock,&ts);
+        l->wakeup = 0;
+        stop = l->stop;
+        pthread_mutex_unlock(&l->lock);
+        alogFlush(l);
+    }
+    return NULL;
+}
+
+/* Create a log writing to 'fd' with a ring of 'size' bytes (rounded up
+ * to a power of two). Returns NULL on error. */
+alog *alogCreate(int fd, size_t size, int flushms) {
+    alog *l;
+    size_t sz = 1024;
+    struct stat st;
+
+    while(sz < size) sz *= 2;
+    if ((l = malloc(sizeof(*l))) == NULL) return NULL;
+    if ((l->buf = malloc(sz)) == NULL) {
+        free(l);
+        return NULL;
+    }
+    l->fd = fd;
+    /* Writes to pipes are atomic only up to PIPE_BUF bytes, larger ones
+     * may be mixed with the ones of other processes writing the same
+     * pipe. Appends to regular files are not split. */
+    l->maxwrite = (fstat(fd,&st) == 0 && S_ISREG(st.st_mode)) ? 0 : PIPE_BUF;
+    l->size = sz;
+    l->head = l->tail = 0;
+    l->flushms = flushms;
+    l->stop = l->wakeup = 0;
+    pthread_mutex_init(&l->lock,NULL);
+    pthread_cond_init(&l->cond,NULL);
+    if (pthread_create(&l->thread,NULL,alogThread,l) != 0) {
+        pthread_mutex_destroy(&l->lock);
+        pthread_cond_destroy(&l->cond);
+        free(l->buf);
+        free(l);
+        return NULL;
+    }
+    return l;
+}
+
+/* Append a line to the ring. Returns 0 on success, or -1 if there is not
+ * enough free space and the line was dropped. The writer is woken up
+ * early when the ring is half full. */
+int alogWrite(alog *l, const char *line, size_t len) {
+    unsigned long long head = l->head;
+    unsigned long long tail = __atomic_load_n(&l->tail,__ATOMIC_ACQUIRE);
+    size_t off = head & (l->size-1), first;
+
+    if (len > l->size-(head-tail)) return -1;
+    first = (off+len > l->size) ? l->size-off : len;
+    memcpy(l->buf+off,line,first);
+    memcpy(l->buf,line+first,len-first);
+    __atomic_store_n(&l->head,head+len,__ATOMIC_RELEASE);
+    if (head+len-tail > l->size/2 && head-tail <= l->size/2) {
+        pthread_mutex_lock(&l->lock);
+        l->wakeup = 1;
+        pthread_cond_signal(&l->cond);
+        pthread_mutex_unlock(&l->lock);
+    }
+    return 0;
+}
+
+/* Write what is left in the ring, stop the writer and free the log. The
+ * file descriptor is not closed. */
+void alogClose(alog *l) {
+    pthread_mutex_lock(&l->lock);
+    l->stop = 1;
+    pthread_cond_signal(&l->cond);
+    pthread_mutex_unlock(&l->lock);
+    pthread_join(l->thread,NULL);
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->cond);
+    free(l->buf);
+    free(l);
+}
@@ -0,0 +1,57 @@
+/* Copyright (C) 2007 Salvatore Sanfilippo, antirez@gmail.com
+ * This softare is released under the following BSD license:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may 
+ *    be used to endorse or promote products derived from this software 
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef WBOX_LOG_H
+#define WBOX_LOG_H
+
+#include <pthread.h>
+
+/* Asynchronous log writer. Lines are copied in a ring buffer by a single
+ * producer thread, and written to the file in batches by a background
+ * thread, so the producer never blocks on disk or pipe writes. When the
+ * ring is full the line is dropped instead. */
+typedef struct alog {
+    int fd;
+    char *buf;
+    size_t size; /* ring size, a power of two */
+    size_t maxwrite; /* max bytes per write (pipes), 0 = no limit */
+    unsigned long long head; /* bytes appended, only set by the producer */
+    unsigned long long tail; /* bytes written, only set by the writer */
+    int flushms; /* max time a line waits in the ring */
+    int stop;
+    int wakeup; /* the producer asked for a flush */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} alog;
+
+alog *alogCreate(int fd, size_t size, int flushms);
+int alogWrite(alog *l, const char *line, size_t len);
+void alogClose(alog *l);
+
+#endif
@@ -26,8 +26,14 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* sched_setaffinity(), splice() */
+#include <sched.h>
+#endif
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
@@ -37,11 +43,33 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 #include <locale.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef WBOX_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#ifdef WBOX_ZLIB
+#include <zlib.h>
+#endif
 
 #include "wbsignal.h"
+#include "wbevent.h"
+#include "wbtimer.h"
+#include "wblog.h"
 #include "anet.h"
 #include "sds.h"
 
@@ -50,6 +78,8 @@
 #define WBOX_ACCEPT_COMPR 1
 #define WBOX_USE_HEAD 2
 #define WBOX_USE_HTTP10 4
+#define WBOX_USE_POST 8
+#define WBOX_USE_PUT 16
 
 /* Exit codes */
 #define WBOX_EXIT_SUCCESS 0
@@ -59,17 +89,68 @@
 #define WBOX_EXIT_IO 4
 #define WBOX_EXIT_EOF 5
 #define WBOX_EXIT_PROTO 6
+#define WBOX_EXIT_TLS 7
 
 /* Useful defines */
 #define WBOX_NOTUSED(V) ((void) V)
 
 /* Hardcoded stuff */
-#define WBOX_VERSION 5
+#define WBOX_VERSION 6
+#define WBOX_XSTR(x) #x
+#define WBOX_STR(x) WBOX_XSTR(x)
 #define WBOX_DEFAULT_SERVER_PORT 8081
-#define WBOX_DEFAULT_MAX_CLIENTS 20
+#define WBOX_DEFAULT_ALPN "http/1.1"
+#define WBOX_DEFAULT_CPS_CONNS 100
+#define WBOX_CPS_MAXERR 256 /* failure causes are counted by errno */
+#define WBOX_CPS_BACKOFF_MIN 10 /* ms to wait after an immediate failure */
+#define WBOX_CPS_BACKOFF_MAX 1000 /* doubling up to this value */
+#define WBOX_CRON_MS 100
+#define WBOX_TIMER_MS 10 /* server mode timer wheel tick */
+#define WBOX_HOLD_MAXCONNECTING 512 /* max connections in progress in hold mode */
+#define WBOX_DEFAULT_MAX_CLIENTS 10000
+#define WBOX_DEFAULT_KEEPALIVE 5 /* idle seconds before closing a client */
+#define WBOX_DEFAULT_KEEPALIVE_MAX 100 /* requests per connection */
+#define WBOX_DEFAULT_HEADER_TIMEOUT 10 /* seconds to send a request header */
+#define WBOX_DEFAULT_IO_TIMEOUT 30 /* seconds without reading a body or
+                                      accepting reply data */
+#define WBOX_REPLY_BUF 1024 /* preallocated reply header buffer */
+#define WBOX_DEFAULT_FCACHE_MAX 1024 /* max files in the server file cache */
+#define WBOX_DEFAULT_GZCACHE_MB 64 /* memory used by compressed variants */
+#define WBOX_GZIP_MAX (1024*128) /* larger files are not compressed on the
+                                    fly, it would block the worker */
+#define WBOX_DEFAULT_DIRCACHE_MB 64 /* memory used by directory listings */
+#define WBOX_DEFAULT_PAGESIZE 1024 /* servertest page size */
+#define WBOX_MAX_PAGES 64 /* max page sizes in the servertest distribution */
+#define WBOX_BINDS_MAX 16 /* max bindurl commands */
+#define WBOX_DEFAULT_BINDTTL 1 /* seconds the command output is cached */
+#define WBOX_DEFAULT_BINDMAX 4 /* max commands running at the same time */
+#define WBOX_BIND_MAX_OUTPUT (1024*1024) /* longer outputs are truncated */
+#define WBOX_BIND_TIMEOUT 30 /* seconds before killing a command */
+#define WBOX_DEFAULT_STATSURL "/__wbox/stats" /* live server statistics */
+#define WBOX_SRV_STATUS 9 /* status codes counted, see srvstatus[] */
+#define WBOX_ALOG_BUF (1024*1024) /* access log ring buffer per worker */
+#define WBOX_ALOG_FLUSH_MS 100 /* max delay of access log lines */
+#define WBOX_ALOG_LINE 1024 /* longer access log lines are truncated */
+#define WBOX_DELAYS_MAX 16 /* max "delay" path prefixes */
+#define WBOX_SHAPE_BURST_MS 50 /* bandwidth shaping bucket size */
+#define WBOX_IPTABLE_SIZE 4096 /* client IPs tracked per worker */
+#define WBOX_IPTABLE_PROBES 16 /* slots examined to find an IP */
+#define WBOX_IP_AGE_MS 60000 /* idle IPs are forgotten after this time */
+#define WBOX_RCACHE_BUCKETS 1024
+#define WBOX_MAX_REQUEST_LEN (1024*64) /* max size of a request header */
+#define WBOX_MAX_RANGES 64 /* requests with more ranges get the whole file */
+#define WBOX_BOUNDARY "wbox-byteranges-9f2c41d7e08b"
+#define WBOX_SEND_CHUNK (1024*1024*4) /* max file bytes sent per event */
+#define WBOX_COPY_CHUNK (1024*64) /* same, when we can't avoid copying */
 #define WBOX_RECV_BUF (1024*4)
-#define WBOX_TIMESPLIT_SAMPLES 40
+#define WBOX_RING_BUF (1024*64) /* io_uring send buffer, see srvRingReply() */
+#define WBOX_RING_BUFS 256 /* max io_uring send buffers per worker */
+#define WBOX_RING_PENDING (1024*64) /* max bytes received while replying */
+#define WBOX_TIMESPLIT_SAMPLES 40 /* initial size of the samples buffer */
+#define WBOX_DEFAULT_STALL_MS 200
 #define WBOX_COOKIES_MAX 20
+#define WBOX_BODY_MMAP_MAX (1024*64) /* bigger bodies are sent via sendfile() */
+#define WBOX_DEFAULT_BODY_CTYPE "application/octet-stream"
 /* the ANSI sequence to clear the current line
  * and move the curosr on the left */
 #define WBOX_ANSI_CLEARLINE "\033[1K\033[G"
@@ -92,6 +173,90 @@ typedef struct cookie {
     char *value;
 } cookie;
 
+typedef struct timesplit {
+    int firstbyte;
+    int lastbyte;
+    long long time;     /* microseconds needed to receive the segment */
+    long long maxgap;   /* longest wait for data inside the segment (us) */
+} timesplit;
+
+/* Latency histogram, values are in microseconds. Buckets are log-linear:
+ * values up to 15 have their own bucket, then every power of two is
+ * split into WBOX_HIST_SUB buckets, so the error is always < 6.25%. */
+#define WBOX_HIST_SUB 16
+#define WBOX_HIST_BUCKETS (WBOX_HIST_SUB*40)
+typedef struct histogram {
+    long long count;
+    long long sum;
+    long long min, max;
+    unsigned int bucket[WBOX_HIST_BUCKETS];
+} histogram;
+
+/* Token bucket: 'tokens' are bytes that can be sent now, refilled at
+ * 'rate' bytes per second up to 'burst'. */
+typedef struct tokenbucket {
+    long long rate; /* 0 means unlimited */
+    long long burst;
+    long long tokens;
+    long long last; /* last refill time in milliseconds */
+} tokenbucket;
+
+/* Server statistics. Every worker only updates its own slot, the slots
+ * live in memory shared with the parent process that merges them. */
+typedef struct srvstats {
+    long long connections; /* accepted connections */
+    long long rejected; /* connections closed because of maxclients */
+    long long requests;
+    long long bytes; /* bytes sent */
+    long long active; /* connections currently open */
+    long long timedout; /* connections closed because of timeouts */
+    long long tohdr, tobody, tosend; /* the same, by kind, the rest idle */
+    long long notmodified; /* 304 replies */
+    long long fchits, fcmisses; /* file cache lookups */
+    long long fcinvalidated; /* entries dropped because of inotify events */
+    long long gzhits, gzcompressed; /* on the fly compression cache */
+    long long dirhits, dirrendered; /* directory listings cache */
+    long long bindhits, bindexecs; /* bindurl cached replies and commands */
+    long long status[WBOX_SRV_STATUS]; /* replies by status code */
+    histogram svctime; /* from request parsed to last byte sent (us) */
+    long long loglines, logdropped; /* access log lines written, dropped */
+    long long iprejected; /* connections over 'ipconnmax' */
+    long long iplimited; /* requests over 'iprate', got a 429 */
+} srvstats;
+
+/* First byte delay of the URLs starting with 'prefix', see "delay" */
+typedef struct srvdelay {
+    char *prefix;
+    int ms; /* delay */
+    int jitter; /* random extra delay up to 'jitter' milliseconds */
+} srvdelay;
+
+/* URL bound to a command in server mode, see "bindurl". The output of the
+ * command is cached for a few seconds, and streamed to all the clients
+ * requesting the URL while it runs. */
+typedef struct srvbind {
+    char *url;
+    char *cmd;
+    /* Runtime state, every worker has its own */
+    char *out; /* output of the last or of the running execution */
+    time_t outtime; /* when 'out' was complete, 0 if not valid */
+    pid_t pid; /* running command process group, or -1 */
+    int fd; /* read side of the command output pipe, or -1 */
+    time_t started; /* when the running command was started */
+    int pending; /* waiting for a free slot to run */
+    int truncated; /* output longer than WBOX_BIND_MAX_OUTPUT */
+    struct srvclient *waiters; /* clients waiting for the output */
+} srvbind;
+
+/* Request body, used by the POST and PUT methods. The file is opened
+ * (and mapped in memory if small) only once, then the same body is
+ * sent again and again without copying it in user space. */
+typedef struct reqbody {
+    int fd;
+    off_t len;
+    char *map;  /* mmap()ed body, or NULL if we use sendfile() */
+} reqbody;
+
 typedef struct wconfig {
     /* Configuration */
     char *url;
@@ -106,29 +271,101 @@ typedef struct wconfig {
     int clients;
     int silent;
     int timesplit;
+    int segsize; /* timesplit segment size in bytes, 0 = one per read() */
+    int stallms; /* timesplit: flag waits for data longer than this */
     int maxreq;
     int http10;
     int close;
     int cookies; /* number of set cookies */
     cookie cookie[WBOX_COOKIES_MAX];
+    char *bodyfile; /* POST/PUT body file */
+    char *bodyctype; /* POST/PUT body content type */
+    int bodyflags; /* WBOX_USE_POST or WBOX_USE_PUT */
+    int noresume; /* TLS: always perform a full handshake */
+    int noticket; /* TLS: resume via session ID instead of tickets */
+    char *alpn; /* TLS: comma separated ALPN protocols, "none" to disable */
+    /* Connection rate mode configuration */
+    int cps;
+    int cpsreq; /* send a minimal request and wait for the reply */
+    int rst; /* close connections with a RST to avoid TIME_WAIT */
+    int conns; /* number of parallel connections */
+    /* Connection holding configuration */
+    int hold; /* number of idle connections to hold open */
+    int holdrate; /* max new held connections per second, 0 = no limit */
+    int trickle; /* send a request every <trickle> seconds on held conns */
     /* Server mode configuration */
     int servermode;
     int serverport;
     int maxclients;
+    int workers; /* number of server processes */
+    int nopin; /* don't pin workers to CPUs */
+    int uring; /* use io_uring instead of epoll if available */
+    int keepalive; /* close connections idle for more than N seconds */
+    int keepalivemax; /* max requests per connection, 1 = no keep alive */
+    int headertimeout; /* seconds to send the request header */
+    int iotimeout; /* seconds without progress reading a body or writing */
+    int fcachemax; /* max entries in the file cache, 0 = disabled */
+    int gzip; /* compress files on the fly for clients accepting gzip */
+    long long gzcachemax; /* max bytes used by compressed variants */
+    long long dircachemax; /* max bytes used by directory listings */
+    int servertest; /* serve generated pages from memory, no webroot */
+    char *pagesize; /* servertest page sizes, "<bytes>[:<weight>],..." */
+    int nbinds; /* number of bound URLs */
+    srvbind bind[WBOX_BINDS_MAX];
+    int bindttl; /* seconds the output of bound commands is cached */
+    int bindmax; /* max bound commands running at the same time */
+    char *statsurl; /* URL of the live statistics, NULL if disabled */
+    char *accesslog; /* access log file name, or NULL */
+    long long bwconn; /* max bytes/s per connection, 0 = unlimited */
+    long long bwtotal; /* max bytes/s of the whole server, 0 = unlimited */
+    int shaping; /* bwconn or bwtotal set */
+    int ipconnmax; /* max connections per client IP, 0 = unlimited */
+    int iprate; /* max requests/s per client IP, 0 = unlimited */
+    int ipburst; /* requests allowed in a burst over 'iprate' */
+    int ndelays;
+    srvdelay delay[WBOX_DELAYS_MAX];
     /* Runtime state (client mode) */
+    char *reqtemplate; /* HTTP request header, created only once */
+    reqbody body;
     int mintime, maxtime;
     double timesum; /* average = timesum/timesum_samples */
     int timesum_samples;
+    timesplit *tsbuf; /* timesplit samples buffer */
+    int tsalloc; /* number of samples allocated in tsbuf */
+    long long starttime; /* milliseconds, used to report rates (also in
+                            server mode) */
+    int tlsfull, tlsresumed; /* number of full and resumed handshakes */
+    long long tlsfulltime, tlsresumedtime; /* total handshake time (us) */
+#ifdef WBOX_TLS
+    SSL_CTX *sslctx;
+    SSL_SESSION *sslsession; /* last session, to resume the next handshake */
+#endif
+    /* Runtime state (connection rate mode) */
+    long long cpsok, cpsfail;
+    long long cpserr[WBOX_CPS_MAXERR]; /* failures by errno, 0 = no reply */
+    histogram cpshist; /* connect time */
+    /* Runtime state (connection holding) */
+    struct holdstats *holdstats; /* shared with the holding process */
+    pid_t holdpid;
     /* Runtime state (server mode) */
-    volatile sig_atomic_t activeclients;
+    evLoop *el;
+    int serverfd;
+    int activeclients;
+    int workerid;
+    pid_t *workerpids; /* only set in the parent process */
+    srvstats *stats; /* one slot per worker, shared memory */
+    srvstats *wstats; /* this worker slot */
+    int bindrunning; /* bound commands running */
+    twWheel timers; /* client timers, ticks of WBOX_TIMER_MS */
+    twWheel wakes; /* end of client pauses, same ticks */
+    int paused; /* clients waiting for their 'wake' timer */
+    int ring; /* the I/O is performed by io_uring ops, see evHasOps() */
+    int acceptop; /* io_uring accept op, -1 if not active */
+    tokenbucket bwall; /* this worker share of 'bwtotal' */
+    int alogfd; /* access log file, opened before forking the workers */
+    alog *alog; /* this worker access log writer, or NULL */
 } wconfig;
 
-typedef struct timesplit {
-    int time;
-    int firstbyte;
-    int lastbyte;
-} timesplit;
-
 /* Reply info describes the HTTP reply we get from server */
 typedef struct replyinfo {
     int code;
@@ -136,8 +373,10 @@ typedef struct replyinfo {
     int replylen;
     int time;
     int compr;
+    long long tlstime; /* TLS handshake time (us), 0 for plain HTTP */
+    int tlsresumed; /* true if the TLS session was resumed */
     int tsamples; /* timesplit samples used */
-    timesplit tsample[WBOX_TIMESPLIT_SAMPLES];
+    timesplit *tsample; /* points to wconfig.tsbuf, reused across requests */
 } replyinfo;
 
 /* Url info describes an URL */
@@ -145,10 +384,20 @@ typedef struct urlinfo {
     char *proto;
     char *domain;
     int port;
+    int tls; /* https:// */
     char *req;
 } urlinfo;
 
-/* Request info describes an HTTP request (for server mode) */
+/* A client connection, plain TCP or TLS */
+typedef struct wconn {
+    int fd;
+#ifdef WBOX_TLS
+    SSL *ssl;
+#endif
+} wconn;
+
+/* Request info describes an HTTP request (for server mode). The strings
+ * point inside the buffer holding the request, see parseRequest(). */
 #define WBOX_REQ_METHOD_GET 0
 #define WBOX_REQ_METHOD_POST 1
 #define WBOX_REQ_METHOD_HEAD 2
@@ -157,12 +406,28 @@ typedef struct reqinfo {
     int method;
     int protover;
     char *file;
+    char *host; /* Host field value, or NULL */
+    int acceptgzip; /* Accept-Encoding allows gzip */
+    int keepalive; /* keep the connection open after the reply */
+    int hasbody; /* body of unknown length (Transfer-Encoding) */
+    long long bodylen; /* Content-Length of the request body */
+    char *range; /* Range field value, or NULL */
+    char *ifrange; /* If-Range field value, or NULL */
+    char *ifnonematch; /* If-None-Match field value, or NULL */
+    time_t ifmodsince; /* If-Modified-Since, or -1 */
 } reqinfo;
 
+/* Byte range of a Range request, both ends included */
+typedef struct srvrange {
+    off_t start, end;
+} srvrange;
+
 
 /* Global vars */
 wconfig conf;
 
+static void sigHandler(int signum);
+
 /* ---------------------------- support functions --------------------------- */
 long long milliseconds(void)
 {
@@ -172,16 +437,146 @@ long long milliseconds(void)
     return ((long long)tmptv.tv_sec*1000)+(tmptv.tv_usec/1000);
 }
 
-int strisnumber(char *s) {
-    while(*s == ' ' || (*s >= '0' && *s <= '9')) s++;
-    return *s == '\0';
+long long microseconds(void)
+{
+    struct timeval tmptv;
+
+    gettimeofday(&tmptv, NULL);
+    return ((long long)tmptv.tv_sec*1000000)+tmptv.tv_usec;
 }
 
-static void setlowercase(char *p) {
-    while(*p) {
-        *p = tolower(*p);
-        p++;
+/* Try to make sure we can open at least 'needed' file descriptors, raising
+ * the soft limit up to the hard limit if required. Returns the number of
+ * file descriptors we can use. */
+int adjustOpenFilesLimit(int needed) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE,&limit) == -1) return needed;
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < (rlim_t)needed) {
+        rlim_t old = limit.rlim_cur;
+
+        limit.rlim_cur = needed;
+        if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < (rlim_t)needed)
+            limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE,&limit) == -1) limit.rlim_cur = old;
+    }
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > (rlim_t)needed)
+        return needed;
+    return (int) limit.rlim_cur;
+}
+
+static int histIndex(long long v) {
+    int e;
+
+    if (v < 0) v = 0;
+    if (v < WBOX_HIST_SUB) return v;
+    e = (63-__builtin_clzll(v))-4; /* log2(v)-log2(WBOX_HIST_SUB) */
+    v = WBOX_HIST_SUB+e*WBOX_HIST_SUB+((v >> e)-WBOX_HIST_SUB);
+    return (v >= WBOX_HIST_BUCKETS) ? WBOX_HIST_BUCKETS-1 : v;
+}
+
+/* Return the lower bound of the values accounted to the bucket 'idx' */
+static long long histBucketValue(int idx) {
+    int e;
+
+    if (idx < WBOX_HIST_SUB) return idx;
+    e = (idx-WBOX_HIST_SUB)/WBOX_HIST_SUB;
+    return (long long)((idx-WBOX_HIST_SUB)%WBOX_HIST_SUB+WBOX_HIST_SUB) << e;
+}
+
+void histAdd(histogram *h, long long v) {
+    if (h->count == 0 || v < h->min) h->min = v;
+    if (h->count == 0 || v > h->max) h->max = v;
+    h->count++;
+    h->sum += v;
+    h->bucket[histIndex(v)]++;
+}
+
+void histMerge(histogram *dst, histogram *src) {
+    int j;
+
+    if (src->count == 0) return;
+    if (dst->count == 0 || src->min < dst->min) dst->min = src->min;
+    if (dst->count == 0 || src->max > dst->max) dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+    for (j = 0; j < WBOX_HIST_BUCKETS; j++) dst->bucket[j] += src->bucket[j];
+}
+
+/* Return the value at percentile 'p' (0-100) */
+long long histPercentile(histogram *h, double p) {
+    long long target = (long long)((p/100)*h->count), seen = 0;
+    int j;
+
+    if (h->count == 0) return 0;
+    if (target >= h->count) return h->max;
+    for (j = 0; j < WBOX_HIST_BUCKETS; j++) {
+        seen += h->bucket[j];
+        if (seen > target) break;
+    }
+    if (histBucketValue(j) < h->min) return h->min;
+    return histBucketValue(j);
+}
+
+void tbInit(tokenbucket *tb, long long rate, long long burstms) {
+    tb->rate = rate;
+    tb->burst = rate*burstms/1000;
+    if (tb->burst < 1) tb->burst = 1;
+    tb->tokens = tb->burst;
+    tb->last = milliseconds();
+}
+
+void tbRefill(tokenbucket *tb, long long now) {
+    long long add;
+
+    if (now <= tb->last) return;
+    if (tb->tokens >= tb->burst) {
+        tb->last = now;
+        return;
     }
+    /* With low rates a few milliseconds may not be worth a token: only
+     * the time accounted is consumed, so it is not lost. */
+    if ((add = (now-tb->last)*tb->rate/1000) == 0) return;
+    tb->tokens += add;
+    tb->last += add*1000/tb->rate;
+    if (tb->tokens >= tb->burst) {
+        tb->tokens = tb->burst;
+        tb->last = now;
+    }
+}
+
+/* Return the milliseconds needed to have half of the bucket full again */
+long long tbWait(tokenbucket *tb) {
+    long long need = tb->burst/2+1-tb->tokens;
+
+    if (need <= 0) return 0;
+    return (need*1000+tb->rate-1)/tb->rate;
+}
+
+/* Parse a size with an optional k or m suffix, -1 on error */
+static long long parseSize(char *s, char **end) {
+    long long n = strtoll(s,end,10);
+
+    if (*end == s || n < 0) return -1;
+    if (**end == 'k' || **end == 'K') n *= 1024, (*end)++;
+    else if (**end == 'm' || **end == 'M') n *= 1024*1024, (*end)++;
+    return n;
+}
+
+/* Modification time of 'st' in nanoseconds where available, so that
+ * changes within the same second are detected. */
+static unsigned long long statMtime(struct stat *st) {
+    unsigned long long mtime = st->st_mtime;
+
+#ifdef __linux__
+    mtime = mtime*1000000000ULL+st->st_mtim.tv_nsec;
+#endif
+    return mtime;
+}
+
+int strisnumber(char *s) {
+    while(*s == ' ' || (*s >= '0' && *s <= '9')) s++;
+    return *s == '\0';
 }
 
 /* string compare, case insensitive */
@@ -255,13 +650,14 @@ void parseUrl(char *url, urlinfo *ui)
         if (*d == '/') d++; /* skip "/" */
     }
     /* port */
+    ui->tls = !strcmpNC(ui->proto,"https");
     p = strchr(ui->domain,':');
     if (!p) {
-        ui->port = 80;
+        ui->port = ui->tls ? 443 : 80;
     } else {
         *p = '\0';
         ui->port = atoi(p+1);
-        if (ui->port == 0) ui->port = 80;
+        if (ui->port == 0) ui->port = ui->tls ? 443 : 80;
     }
     /* request */
     ui->req = sdsnew("/");
@@ -276,17 +672,22 @@ void freeUrl(urlinfo *ui) {
 }
 
 /* --------------------------------- HTTP client ---------------------------- */
-static char *createHttpReq(urlinfo *ui, int flags, cookie *cookie, int numcookies, char *referer)
+static char *createHttpReq(urlinfo *ui, int flags, cookie *cookie, int numcookies, char *referer, reqbody *body, char *ctype)
 {
-    char *r = sdsnew((flags&WBOX_USE_HEAD) ? "HEAD ":"GET ");
+    char *r;
     int j;
 
+    if (flags & WBOX_USE_POST) r = sdsnew("POST ");
+    else if (flags & WBOX_USE_PUT) r = sdsnew("PUT ");
+    else if (flags & WBOX_USE_HEAD) r = sdsnew("HEAD ");
+    else r = sdsnew("GET ");
+
     r = sdscat(r, ui->req);
     r = sdscat(r, " HTTP/1.");
     r = sdscat(r, (flags & WBOX_USE_HTTP10) ? "0" : "1");
     r = sdscat(r, "\r\nHost: ");
     r = sdscat(r, ui->domain);
-    if (ui->port != 80) {
+    if (ui->port != (ui->tls ? 443 : 80)) {
         r = sdscatprintf(r,":%d",ui->port);
     }
     r = sdscat(r,"\r\n"
@@ -313,10 +714,272 @@ static char *createHttpReq(urlinfo *ui, int flags, cookie *cookie, int numcookie
         r = sdscat(r,referer);
         r = sdscatlen(r,"\r\n",2);
     }
+    if (flags & (WBOX_USE_POST|WBOX_USE_PUT)) {
+        r = sdscatprintf(r,"Content-Type: %s\r\nContent-Length: %lld\r\n",
+            ctype, (long long) body->len);
+    }
     r = sdscat(r,"\r\n");
     return r;
 }
 
+/* Open the POST/PUT body file. Small bodies are mapped in memory and sent
+ * with writev() together with the header, big ones are sent directly
+ * from the file with sendfile(). If 'forcemap' is true the file is always
+ * mapped, this is needed with TLS where sendfile() can't be used.
+ * Returns 0 on success, -1 on error. */
+static int openReqBody(reqbody *body, char *filename, int forcemap)
+{
+    struct stat sbuf;
+
+    body->map = NULL;
+    if ((body->fd = open(filename,O_RDONLY)) == -1) return -1;
+    if (fstat(body->fd,&sbuf) == -1 || !S_ISREG(sbuf.st_mode)) {
+        close(body->fd);
+        body->fd = -1;
+        return -1;
+    }
+    body->len = sbuf.st_size;
+#ifdef __linux__
+    if (body->len == 0) return 0;
+    if (body->len > WBOX_BODY_MMAP_MAX && !forcemap) return 0;
+#else
+    if (body->len == 0) return 0; /* no sendfile(), always map the file */
+#endif
+    body->map = mmap(NULL,body->len,PROT_READ,MAP_SHARED,body->fd,0);
+    if (body->map == MAP_FAILED) {
+        body->map = NULL;
+        close(body->fd);
+        body->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef WBOX_TLS
+static void tlsPrintError(char *msg) {
+    unsigned long e = ERR_get_error();
+
+    fprintf(stderr,"%s: %s\n", msg,
+        e ? ERR_error_string(e,NULL) : strerror(errno));
+}
+
+/* Create the TLS context shared by all the requests. Certificates are not
+ * verified: wbox is a testing tool, and it is often used against servers
+ * with self signed certificates. */
+static void tlsInit(wconfig *conf) {
+    SSL_CTX *ctx;
+
+    ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx == NULL) {
+        tlsPrintError("Creating the TLS context");
+        exit(WBOX_EXIT_TLS);
+    }
+    SSL_CTX_set_verify(ctx,SSL_VERIFY_NONE,NULL);
+    SSL_CTX_set_session_cache_mode(ctx,SSL_SESS_CACHE_CLIENT);
+    if (conf->noticket) SSL_CTX_set_options(ctx,SSL_OP_NO_TICKET);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* Many servers just close the connection without close_notify */
+    SSL_CTX_set_options(ctx,SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    if (strcmp(conf->alpn,"none")) {
+        /* Convert "h2,http/1.1" into the ALPN wire format */
+        unsigned char wire[256];
+        char *p = conf->alpn;
+        int len = 0;
+
+        while(*p) {
+            char *end = strchr(p,',');
+            int plen = end ? end-p : (int)strlen(p);
+
+            if (plen > 0 && plen < 256 && len+plen+1 <= (int)sizeof(wire)) {
+                wire[len++] = plen;
+                memcpy(wire+len,p,plen);
+                len += plen;
+            }
+            p += plen;
+            if (*p == ',') p++;
+        }
+        if (len && SSL_CTX_set_alpn_protos(ctx,wire,len) != 0) {
+            tlsPrintError("Setting ALPN protocols");
+            exit(WBOX_EXIT_TLS);
+        }
+    }
+    conf->sslctx = ctx;
+}
+
+/* Perform the TLS handshake on an already connected socket, trying to
+ * resume the previous session. Handshake time and resumption are stored
+ * in the reply info. */
+static void tlsConnect(wconn *c, urlinfo *ui, replyinfo *ri, wconfig *conf) {
+    long long start = microseconds();
+
+    c->ssl = SSL_new(conf->sslctx);
+    if (c->ssl == NULL || SSL_set_fd(c->ssl,c->fd) != 1) {
+        tlsPrintError("Creating the TLS connection");
+        exit(WBOX_EXIT_TLS);
+    }
+    SSL_set_tlsext_host_name(c->ssl,ui->domain);
+    if (conf->sslsession && !conf->noresume)
+        SSL_set_session(c->ssl,conf->sslsession);
+    if (SSL_connect(c->ssl) != 1) {
+        tlsPrintError("TLS handshake");
+        exit(WBOX_EXIT_TLS);
+    }
+    ri->tlstime = microseconds()-start;
+    if (ri->tlstime == 0) ri->tlstime = 1; /* zero means plain HTTP */
+    ri->tlsresumed = SSL_session_reused(c->ssl);
+}
+
+/* Remember the session for the next handshake. This is done after the
+ * reply is received since TLS 1.3 tickets are sent after the handshake. */
+static void tlsClose(wconn *c, wconfig *conf) {
+    if (!conf->noresume) {
+        SSL_SESSION *sess = SSL_get1_session(c->ssl);
+
+        if (sess) {
+            if (conf->sslsession) SSL_SESSION_free(conf->sslsession);
+            conf->sslsession = sess;
+        }
+    }
+    SSL_shutdown(c->ssl);
+    SSL_free(c->ssl);
+    c->ssl = NULL;
+}
+#endif
+
+/* Like anetWrite() but works for both plain and TLS connections. The
+ * buffer is written in chunks of at most INT_MAX bytes, as a mapped body
+ * may be bigger. Returns 0 on success, -1 on error. */
+static int connWrite(wconn *c, void *buf, size_t count)
+{
+    char *p = buf;
+
+    while(count) {
+        int chunk = (count > INT_MAX) ? INT_MAX : (int)count;
+        int nwritten;
+
+#ifdef WBOX_TLS
+        if (c->ssl)
+            nwritten = SSL_write(c->ssl,p,chunk);
+        else
+#endif
+        nwritten = anetWrite(c->fd,p,chunk);
+        if (nwritten <= 0) return -1;
+        p += nwritten;
+        count -= nwritten;
+    }
+    return 0;
+}
+
+/* Read from a plain or TLS connection. If 'full' is true it works like
+ * anetRead(), otherwise returns as soon as some data is available.
+ * Returns the number of bytes read, 0 on EOF, -1 on error. */
+static int connRead(wconn *c, char *buf, int count, int full)
+{
+    int nread, totlen = 0;
+
+    while(totlen != count) {
+#ifdef WBOX_TLS
+        if (c->ssl) {
+            nread = SSL_read(c->ssl,buf+totlen,count-totlen);
+            if (nread <= 0) {
+                int e = SSL_get_error(c->ssl,nread);
+                if (e == SSL_ERROR_ZERO_RETURN) nread = 0;
+                else if (e == SSL_ERROR_SYSCALL && errno == EINTR) continue;
+                else nread = -1;
+            }
+        } else
+#endif
+        nread = read(c->fd,buf+totlen,count-totlen);
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread == -1) return totlen ? totlen : -1;
+        if (nread == 0) return totlen;
+        totlen += nread;
+        if (!full) break;
+    }
+    return totlen;
+}
+
+/* Send the request header and, if any, the request body.
+ * Returns 0 on success, -1 on I/O error. */
+static int sendHttpReq(wconn *c, char *req, reqbody *body)
+{
+    int s = c->fd;
+    size_t reqlen = sdslen(req);
+
+#ifdef WBOX_TLS
+    if (c->ssl) {
+        /* No zero copy here, the body is always mapped in TLS mode */
+        if (connWrite(c,req,reqlen) == -1) return -1;
+        if (body != NULL && body->fd != -1 && body->len &&
+            connWrite(c,body->map,body->len) == -1) return -1;
+        return 0;
+    }
+#endif
+
+    if (body == NULL || body->fd == -1)
+        return (connWrite(c,req,reqlen) == -1) ? -1 : 0;
+
+    if (body->map || body->len == 0) {
+        struct iovec iov[2];
+        int iovcnt = 2;
+
+        iov[0].iov_base = req;
+        iov[0].iov_len = reqlen;
+        iov[1].iov_base = body->map;
+        iov[1].iov_len = body->len;
+        while(iovcnt) {
+            ssize_t nwritten = writev(s,iov+(2-iovcnt),iovcnt);
+            struct iovec *cur = iov+(2-iovcnt);
+
+            if (nwritten == -1) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            /* Handle partial writes */
+            while(iovcnt && (size_t)nwritten >= cur->iov_len) {
+                nwritten -= cur->iov_len;
+                cur++;
+                iovcnt--;
+            }
+            if (iovcnt) {
+                cur->iov_base = (char*)cur->iov_base+nwritten;
+                cur->iov_len -= nwritten;
+            }
+        }
+        return 0;
+    }
+#ifdef __linux__
+    {
+        off_t off = 0;
+
+        /* MSG_MORE avoids sending the header in a segment alone */
+        while(reqlen) {
+            ssize_t nwritten = send(s,req,reqlen,MSG_MORE);
+            if (nwritten == -1) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            req += nwritten;
+            reqlen -= nwritten;
+        }
+        while(off < body->len) {
+            ssize_t nwritten = sendfile(s,body->fd,&off,body->len-off);
+            if (nwritten == -1) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            if (nwritten == 0) {
+                /* File truncated while we were running */
+                errno = EIO;
+                return -1;
+            }
+        }
+    }
+#endif
+    return 0;
+}
+
 static int extractReplyInfo(replyinfo *ri, char *buf, int buflen, wconfig *wc)
 {
     char *hdr = sdsnewlen(buf,buflen); /* make a copy to play with it */
@@ -362,7 +1025,10 @@ void initReplyInfo(replyinfo *ri)
     ri->replylen = 0;
     ri->time = 0;
     ri->compr = 0;
+    ri->tlstime = 0;
+    ri->tlsresumed = 0;
     ri->tsamples = 0;
+    ri->tsample = NULL;
     ri->reason = NULL;
 }
 
@@ -375,32 +1041,117 @@ void copyReplyInfo(replyinfo *d, replyinfo *s)
 {
     *d = *s;
     if (d->reason) d->reason = sdsdup(s->reason);
+    /* The samples buffer is shared, and will be reused by the next request */
+    d->tsample = NULL;
+    d->tsamples = 0;
+}
+
+/* Return a new timesplit sample, growing the samples buffer if needed.
+ * The buffer is owned by the configuration so that after the first few
+ * requests no allocation is needed at all. */
+static timesplit *newTimesplitSample(replyinfo *ri, wconfig *conf) {
+    timesplit *ts;
+
+    if (ri->tsamples == conf->tsalloc) {
+        int newalloc = conf->tsalloc ? conf->tsalloc*2 :
+                                       WBOX_TIMESPLIT_SAMPLES;
+        timesplit *newbuf = realloc(conf->tsbuf,sizeof(timesplit)*newalloc);
+
+        if (newbuf == NULL) {
+            fprintf(stderr,"Out of memory allocating timesplit samples\n");
+            exit(WBOX_EXIT_IO);
+        }
+        conf->tsbuf = newbuf;
+        conf->tsalloc = newalloc;
+    }
+    ri->tsample = conf->tsbuf;
+    ts = &ri->tsample[ri->tsamples++];
+    ts->firstbyte = 0;
+    ts->lastbyte = -1;
+    ts->time = 0;
+    ts->maxgap = 0;
+    return ts;
+}
+
+/* Account 'nread' bytes received at time 'now' (microseconds) after
+ * 'totlen' bytes, 'gap' microseconds after the previous data.
+ * '*segstart' is the time the current segment started, it is updated
+ * every time a segment is completed.
+ *
+ * With a segment size of zero every read() is a segment. Otherwise data
+ * is split in segments of exactly conf->segsize bytes, so that the same
+ * byte ranges can be compared across different requests. The gap is
+ * accounted to the segment that was waiting for the data. */
+static void sampleTimesplit(replyinfo *ri, wconfig *conf, int totlen,
+                            int nread, long long now, long long gap,
+                            long long *segstart)
+{
+    timesplit *ts;
+    int pos = totlen, end = totlen+nread;
+
+    if (conf->segsize == 0) {
+        ts = newTimesplitSample(ri,conf);
+        ts->firstbyte = totlen;
+        ts->lastbyte = end-1;
+        ts->time = now-*segstart;
+        ts->maxgap = gap;
+        *segstart = now;
+        return;
+    }
+    while(pos < end) {
+        int seg = pos/conf->segsize;
+        int segend = (seg+1)*conf->segsize;
+
+        if (seg == ri->tsamples) {
+            ts = newTimesplitSample(ri,conf);
+            ts->firstbyte = seg*conf->segsize;
+        } else {
+            ts = &ri->tsample[seg];
+        }
+        if (pos == totlen && gap > ts->maxgap) ts->maxgap = gap;
+        if (segend > end) segend = end;
+        ts->lastbyte = segend-1;
+        ts->time = now-*segstart;
+        if (segend == (seg+1)*conf->segsize) *segstart = now;
+        pos = segend;
+    }
+}
+
+static void printTimesplitSample(timesplit *ts, int idx, wconfig *conf) {
+    int len = ts->lastbyte-ts->firstbyte+1;
+
+    printf("       [%d] %d-%d -> %.3f ms", idx, ts->firstbyte, ts->lastbyte,
+        (float)ts->time/1000);
+    if (ts->time)
+        printf(" (%.2f kbytes/s)", ((double)len*1000000/ts->time)/1024);
+    if (ts->maxgap >= (long long)conf->stallms*1000)
+        printf(" STALL (%.3f ms without data)", (float)ts->maxgap/1000);
+    printf("\n");
 }
 
 static int httpRequest(replyinfo *ri, char *ip, urlinfo *ui, wconfig *conf) {
     char err[ANET_ERR_LEN];
-    char *req;
-    int s, nwritten, totlen, reqflags = WBOX_NONE;
+    wconn c;
+    int totlen, tsprinted = 0;
     long long stime = milliseconds();
-    long long tsample_stime = milliseconds();
+    long long tsample_stime = microseconds();
+    long long lastread = tsample_stime;
     long long stime_bps = 0; /* used for accurate bandwidth measuring */
 
     initReplyInfo(ri);
     /* Connect */
-    s = anetTcpConnect(err, ip, ui->port);
-    if (s == ANET_ERR) {
+    c.fd = anetTcpConnect(err, ip, ui->port);
+    if (c.fd == ANET_ERR) {
         fprintf(stderr, "Opening the connection: %s\n", err);
         exit(WBOX_EXIT_CONN);
     }
+#ifdef WBOX_TLS
+    c.ssl = NULL;
+    if (ui->tls) tlsConnect(&c,ui,ri,conf);
+#endif
     /* Write the HTTP request */
-    if (conf->compr) reqflags |= WBOX_ACCEPT_COMPR;
-    if (conf->head) reqflags |= WBOX_USE_HEAD;
-    if (conf->http10) reqflags |= WBOX_USE_HTTP10;
-    req = createHttpReq(ui,reqflags,conf->cookie,conf->cookies,conf->referer);
-    nwritten = write(s, req, sdslen(req));
-    if (nwritten == -1) {
+    if (sendHttpReq(&c,conf->reqtemplate,&conf->body) == -1) {
         perror("Sending the HTTP request");
-        sdsfree(req);
         exit(WBOX_EXIT_IO);
     }
     /* Read the request */
@@ -409,42 +1160,41 @@ static int httpRequest(replyinfo *ri, char *ip, urlinfo *ui, wconfig *conf) {
         char buf[WBOX_RECV_BUF];
         int nread;
 
-        nread = anetRead(s, buf, WBOX_RECV_BUF);
+        /* In timesplit mode we want to see every single read(), otherwise
+         * a stall in the middle of a buffer would not be visible. */
+        nread = connRead(&c, buf, WBOX_RECV_BUF, !conf->timesplit);
         if (nread == 0) break;
         if (nread == -1) {
             perror("Reading from socket");
-            sdsfree(req);
             exit(WBOX_EXIT_IO);
         }
-        /* Populare tsamples */
+        /* Populate tsamples */
         if (conf->timesplit) {
-            int lastsample = ri->tsamples == WBOX_TIMESPLIT_SAMPLES;
-            timesplit *ts;
-            if (lastsample)
-                ts = &ri->tsample[WBOX_TIMESPLIT_SAMPLES-1];
-            else
-                ts = &ri->tsample[ri->tsamples];
-            ts->time = (lastsample ? ts->time : 0) +
-                        (int) (milliseconds()-tsample_stime);
-            if (!lastsample) ts->firstbyte = totlen;
-            ts->lastbyte = totlen+nread-1;
-            if (!lastsample) ri->tsamples++;
-            tsample_stime = milliseconds();
+            long long now = microseconds();
+
+            sampleTimesplit(ri,conf,totlen,nread,now,now-lastread,
+                &tsample_stime);
+            lastread = now;
         }
         /* Get HTTP reply header information from the first chunk of data */
         if (totlen == 0) extractReplyInfo(ri,buf,nread,conf);
 
         if (conf->dump) {
-            int lastsample = ri->tsamples == WBOX_TIMESPLIT_SAMPLES;
             fwrite(buf,nread,1,stdout);
-            if (!lastsample && conf->timesplit) {
-                int idx = ri->tsamples-1;
-                printf("\n\n-----------------------------------------------\n");
-                printf("CHUNK TIME INFORMATION: %d-%d -> %d ms\n",
-                    ri->tsample[idx].firstbyte,
-                    ri->tsample[idx].lastbyte,
-                    ri->tsample[idx].time);
-                printf("-----------------------------------------------\n\n");
+            if (conf->timesplit) {
+                /* Show only the segments completed by this read */
+                int completed = conf->segsize ?
+                    (totlen+nread)/conf->segsize : ri->tsamples;
+                if (tsprinted < completed) {
+                    printf("\n\n-----------------------------------------------\n");
+                    printf("CHUNK TIME INFORMATION:\n");
+                    while(tsprinted < completed) {
+                        printTimesplitSample(&ri->tsample[tsprinted],
+                            tsprinted,conf);
+                        tsprinted++;
+                    }
+                    printf("-----------------------------------------------\n\n");
+                }
             }
             fflush(stdout);
         }
@@ -464,9 +1214,18 @@ static int httpRequest(replyinfo *ri, char *ip, urlinfo *ui, wconfig *conf) {
         }
         if (conf->close && totlen == nread) break;
     }
+    /* Show the last, incomplete, segment in dump mode */
+    if (conf->dump && conf->timesplit && tsprinted < ri->tsamples) {
+        printf("\n\n-----------------------------------------------\n");
+        printf("CHUNK TIME INFORMATION:\n");
+        printTimesplitSample(&ri->tsample[tsprinted],tsprinted,conf);
+        printf("-----------------------------------------------\n\n");
+    }
     /* Done, close the socket and calculate timings */
-    close(s);
-    sdsfree(req);
+#ifdef WBOX_TLS
+    if (c.ssl) tlsClose(&c,conf);
+#endif
+    close(c.fd);
     ri->time = (int) (milliseconds()-stime);
     ri->replylen = totlen;
     return 0;
@@ -487,160 +1246,753 @@ static int spawnChilds(int count)
     return 0;
 }
 
-static void printTimesplit(replyinfo *ri) {
-    int j;
+static void printTimesplit(replyinfo *ri, wconfig *conf) {
+    int j, stalls = 0;
+    long long maxgap = 0;
 
     for (j = 0; j < ri->tsamples; j++) {
-        printf("       [%d] %d-%d -> %d ms\n", j,
-            ri->tsample[j].firstbyte,
-            ri->tsample[j].lastbyte,
-            ri->tsample[j].time);
+        timesplit *ts = &ri->tsample[j];
+
+        printTimesplitSample(ts,j,conf);
+        if (ts->maxgap >= (long long)conf->stallms*1000) stalls++;
+        if (ts->maxgap > maxgap) maxgap = ts->maxgap;
     }
+    if (ri->tsamples)
+        printf("       %d segments, %d stalls, longest wait %.3f ms\n",
+            ri->tsamples, stalls, (float)maxgap/1000);
 }
 
-/* --------------------------------- HTTP server ---------------------------- */
-static int parseRequest(char *req, reqinfo *ri) {
-    char *copy, *r;
-    char *p;
-    int noproto = 0;
+/* ------------------------------ Connection rate --------------------------- */
+#define WBOX_CPS_IDLE 0
+#define WBOX_CPS_CONNECTING 1
+#define WBOX_CPS_WAITREPLY 2
 
-    ri->file = NULL; /* Make it safe to free later */
-    copy = r = sdsdup(req); /* work with a copy */
+struct cpsinfo;
 
-    p = strchr(r,' ');
-    if (!p) goto fmterr;
-    *p = '\0';
-    setlowercase(r);
-    if (!strcmp(r,"get")) ri->method = WBOX_REQ_METHOD_GET;
-    else if (!strcmp(r,"post")) ri->method = WBOX_REQ_METHOD_POST;
-    else if (!strcmp(r,"head")) ri->method = WBOX_REQ_METHOD_HEAD;
-    else ri->method = WBOX_REQ_METHOD_OTHER;
+typedef struct cpsconn {
+    int fd;
+    int state;
+    long long start; /* microseconds */
+    struct cpsinfo *ci;
+} cpsconn;
 
-    r = p+1;
-    while(*r == ' ') r++;
-    p = NULL;
-    (p = strchr(r,' ')) || (p = strchr(r,'\r')) || (p = strchr(r,'\n'));
-    if (p)
-        *p = '\0';
-    else
-        noproto = 1;
-    if (r[0] != '/') goto fmterr;
-    ri->file = sdsnew(r);
+typedef struct cpsinfo {
+    evLoop *el;
+    char *ip;
+    int port;
+    char *req; /* minimal request, if cpsreq is used */
+    cpsconn *conn;
+    long long started; /* connections started so far */
+    long long finished; /* started connections closed, ok or failed */
+    long long retryat; /* don't start connections before this time (ms) */
+    int backoff; /* ms to wait after the next immediate failure */
+} cpsinfo;
 
-    ri->protover = 10;
-    if (!noproto) {
-        r = p+1;
-        if ((p = strchr(r,'\n')) != NULL) {
-            *p = '\0';
-            if (strstr(r, "HTTP/1.1")) ri->protover = 11;
-        }
-    }
-    sdsfree(copy);
-    return 0;
+static void cpsStartConn(cpsconn *cc);
 
-fmterr:
-    sdsfree(copy);
-    return 1;
+static void cpsFailure(int err) {
+    if (err < 0 || err >= WBOX_CPS_MAXERR) err = WBOX_CPS_MAXERR-1;
+    conf.cpserr[err]++;
+    conf.cpsfail++;
 }
 
-static void freeReqInfo(reqinfo *ri) {
-    if (ri->file) sdsfree(ri->file);
+/* Close the connection, account it, and start a new one in the same slot.
+ * 'err' is zero on success, otherwise an errno value. */
+static void cpsDoneConn(cpsconn *cc, int err, int failed) {
+    cpsinfo *ci = cc->ci;
+
+    evDeleteFileEvent(ci->el,cc->fd,EV_READABLE|EV_WRITABLE);
+    if (conf.rst) anetRstOnClose(NULL,cc->fd);
+    close(cc->fd);
+    cc->fd = -1;
+    cc->state = WBOX_CPS_IDLE;
+    ci->finished++;
+    if (failed) cpsFailure(err);
+    else conf.cpsok++;
+    cpsStartConn(cc);
 }
 
-static void urldecode(char *d, char *s, int n)
-{
-    char *start = d;
-    if (n < 1) return;
-    while(*s && n > 1) {
-        int c = *s;
-        switch(c) {
-        case '+': c = ' '; break;
-        case '%':
-            if (*(s+1) && *(s+2)) {
-                int high = toupper(*(s+1));
-                int low = toupper(*(s+2));
+static void cpsReplyHandler(evLoop *el, int fd, void *privdata, int mask) {
+    cpsconn *cc = privdata;
+    char buf[WBOX_RECV_BUF];
+    int nread;
+    WBOX_NOTUSED(el);
+    WBOX_NOTUSED(mask);
 
-                if (high <= '9') high -= '0';
-                else high = (high - 'A') + 10;
-                if (low <= '9') low -= '0';
-                else low = (low - 'A') + 10;
-                c = (high << 4)+low;
-                s += 2;
-            }
-            break;
-        }
-        if (c != ' ' || d != start) {
-                *d++ = c;
-                n--;
-        }
-        s++;
+    nread = read(fd,buf,sizeof(buf));
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread > 0) cpsDoneConn(cc,0,0);
+    else cpsDoneConn(cc,nread == 0 ? 0 : errno,1);
+}
+
+static void cpsConnectHandler(evLoop *el, int fd, void *privdata, int mask) {
+    cpsconn *cc = privdata;
+    char *req = cc->ci->req;
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    WBOX_NOTUSED(mask);
+
+    if (getsockopt(fd,SOL_SOCKET,SO_ERROR,&err,&errlen) == -1) err = errno;
+    if (err) {
+        cpsDoneConn(cc,err,1);
+        return;
     }
-    /* Right trim */
-    *d = '\0';
-    d--;
-    while (d >= start && *d == ' ') {
-            *d = '\0';
-            d--;
+    histAdd(&conf.cpshist,microseconds()-cc->start);
+    if (!conf.cpsreq) {
+        cpsDoneConn(cc,0,0);
+        return;
+    }
+    /* The request is small and the socket buffer is empty, a single
+     * write is enough. */
+    evDeleteFileEvent(el,fd,EV_WRITABLE);
+    if (write(fd,req,sdslen(req)) != (ssize_t)sdslen(req)) {
+        cpsDoneConn(cc,errno,1);
+        return;
     }
+    cc->state = WBOX_CPS_WAITREPLY;
+    evCreateFileEvent(el,fd,EV_READABLE,cpsReplyHandler,privdata);
 }
 
-static char *createFullPath(char *root, char *file) {
-    char *uefile, *fp, *p;
-    int len;
-    
-    uefile = sdsnewlen(NULL,sdslen(file)+1);
-    urldecode(uefile,file,sdslen(uefile)); /* url decode the original name */
-    sdsupdatelen(uefile);
-    fp = sdsnew(root);
-    fp = sdscat(fp,uefile);
-    sdsfree(uefile);
-    while((p=strstr(fp,".."))) {
-        *p = '_';
-        *(p+1) = '_';
+static void cpsStartConn(cpsconn *cc) {
+    cpsinfo *ci = cc->ci;
+
+    if (conf.maxreq > 0 && ci->started == conf.maxreq) return;
+    if (ci->retryat && milliseconds() < ci->retryat) return;
+    cc->start = microseconds();
+    cc->fd = anetTcpNonBlockConnect(NULL,ci->ip,ci->port);
+    if (cc->fd == ANET_ERR) {
+        /* Immediate failure (no local ports, too many open files, ...).
+         * It is counted but does not use one of the requested
+         * connections: the slot will be retried by the cron, waiting
+         * more and more if the failures continue, so that we don't
+         * spin. */
+        cc->fd = -1;
+        cpsFailure(errno);
+        ci->backoff = ci->backoff ? ci->backoff*2 :
+                                    WBOX_CPS_BACKOFF_MIN;
+        if (ci->backoff > WBOX_CPS_BACKOFF_MAX)
+            ci->backoff = WBOX_CPS_BACKOFF_MAX;
+        ci->retryat = milliseconds()+ci->backoff;
+        return;
     }
-    /* Make sure there aren't trailing slashes */
-    len = sdslen(fp)-1;
-    while(len >= 1 && fp[len] == '/') fp[len] = '\0';
-    sdsupdatelen(fp);
-    return fp;
+    ci->started++;
+    ci->backoff = 0;
+    ci->retryat = 0;
+    cc->state = WBOX_CPS_CONNECTING;
+    if (evCreateFileEvent(ci->el,cc->fd,EV_WRITABLE,cpsConnectHandler,cc)
+        == EV_ERR) cpsDoneConn(cc,errno,1);
 }
 
-static char *createHttpReply(reqinfo *ri, char *code, char *reason, char *ctype, int len)
-{
-    char date[128];
-    struct tm *tm;
-    time_t t;
-    char *r;
+static void printCpsStats(void) {
+    float elapsed = (float)(milliseconds()-conf.starttime)/1000;
+    histogram *h = &conf.cpshist;
+    int j;
 
-    r = sdsnew("HTTP/1.");
-    r = sdscat(r,ri->protover == 11 ? "1 " :"0 ");
-    r = sdscat(r,code);
-    r = sdscat(r," ");
-    r = sdscat(r,reason);
-    r = sdscat(r,"\r\n");
-    t = time(NULL);
-    tm = gmtime(&t);
-    strftime(date, 128, "%a, %d %b %Y %H:%M:%S GMT", tm);
-    r = sdscat(r,"Date: ");
-    r = sdscat(r,date);
-    r = sdscatprintf(r, "\r\nServer: WBox %d (http://hping.org/wbox)\r\n",
-        WBOX_VERSION);
-    r = sdscat(r,"Content-type: ");
-    r = sdscat(r,ctype);
-    if (len != -1)
-        r = sdscatprintf(r,"\r\nContent-Length: %d",len);
-    r = sdscat(r,"\r\n\r\n");
-    return r;
+    printf("--- %lld connections, %lld failed",
+        conf.cpsok+conf.cpsfail, conf.cpsfail);
+    if (elapsed > 0)
+        printf(", %.2f conn/s", (float)conf.cpsok/elapsed);
+    printf(" ---\n");
+    if (h->count) {
+        printf("--- connect time min/avg/max = %.3f/%.3f/%.3f ms ---\n",
+            (float)h->min/1000, (float)h->sum/h->count/1000,
+            (float)h->max/1000);
+        printf("--- connect time p50/p90/p99/p99.9 = "
+               "%.3f/%.3f/%.3f/%.3f ms ---\n",
+            (float)histPercentile(h,50)/1000,
+            (float)histPercentile(h,90)/1000,
+            (float)histPercentile(h,99)/1000,
+            (float)histPercentile(h,99.9)/1000);
+    }
+    for (j = 0; j < WBOX_CPS_MAXERR; j++) {
+        if (conf.cpserr[j] == 0) continue;
+        printf("--- %lld failures: %s ---\n", conf.cpserr[j],
+            j == 0 ? "connection closed without reply" :
+            (j == WBOX_CPS_MAXERR-1 ? "other errors" : strerror(j)));
+    }
 }
+/* Connection rate mode: open and close connections as fast as possible
+ * using conf->conns parallel non blocking connections. */
+static void cpsMode(char *ip, urlinfo *ui, wconfig *conf) {
+    cpsinfo ci;
+    long long lastreport = milliseconds(), lastok = 0;
+    int j, maxfd;
 
-static char *sdscatentities(char *d, char *s) {
-    int len = strlen(s);
-    int i;
-
-    for(i = 0; i < len; i++) {
-        switch(s[i]) {
-        case '<': d=sdscatlen(d,"&lt;",4); break;
-        case '>': d=sdscatlen(d,"&gt;",4); break;
+    maxfd = adjustOpenFilesLimit(conf->conns+32);
+    if (maxfd < conf->conns+32) {
+        fprintf(stderr,"Warning: only %d file descriptors available, "
+                       "using %d connections.\n", maxfd, maxfd-32);
+        conf->conns = maxfd-32;
+        if (conf->conns < 1) exit(WBOX_EXIT_BADARGS);
+    }
+    ci.el = evCreateLoop(maxfd);
+    if (ci.el == NULL) {
+        fprintf(stderr,"Creating the event loop: %s\n", strerror(errno));
+        exit(WBOX_EXIT_IO);
+    }
+    ci.ip = ip;
+    ci.port = ui->port;
+    ci.started = ci.finished = ci.retryat = 0;
+    ci.backoff = 0;
+    ci.req = sdscatprintf(sdsnew(""),"HEAD %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+        ui->req, ui->domain);
+    ci.conn = malloc(sizeof(cpsconn)*conf->conns);
+    if (ci.conn == NULL) {
+        fprintf(stderr,"Out of memory allocating connections\n");
+        exit(WBOX_EXIT_IO);
+    }
+    for (j = 0; j < conf->conns; j++) {
+        ci.conn[j].fd = -1;
+        ci.conn[j].state = WBOX_CPS_IDLE;
+        ci.conn[j].ci = &ci;
+        cpsStartConn(&ci.conn[j]);
+    }
+    while(1) {
+        long long now;
+
+        evProcessEvents(ci.el,WBOX_CRON_MS);
+        /* Restart slots that failed immediately, and check if we are
+         * done. */
+        if (conf->maxreq > 0 && ci.finished == conf->maxreq) break;
+        for (j = 0; j < conf->conns; j++)
+            if (ci.conn[j].state == WBOX_CPS_IDLE) cpsStartConn(&ci.conn[j]);
+        now = milliseconds();
+        if (now-lastreport >= 1000) {
+            if (!conf->silent) {
+                printf("%lld conn/s, %lld total, %lld failed\n",
+                    (conf->cpsok-lastok)*1000/(now-lastreport),
+                    conf->cpsok+conf->cpsfail, conf->cpsfail);
+                fflush(stdout);
+            }
+            lastreport = now;
+            lastok = conf->cpsok;
+        }
+    }
+    if (!conf->silent) printCpsStats();
+    exit(WBOX_EXIT_SUCCESS);
+}
+
+/* ---------------------------- Connection holding -------------------------- */
+/* In hold mode a child process opens and holds conf->hold idle (or slowly
+ * trickling) connections, while the parent performs the usual measured
+ * requests, so that it's possible to see how the latency changes as the
+ * number of connections of the server grows. Since we want to hold
+ * hundreds of thousands of connections, the per connection state is
+ * minimal and no buffer is allocated per connection. */
+#define WBOX_HOLD_IDLE 0
+#define WBOX_HOLD_CONNECTING 1
+#define WBOX_HOLD_HELD 2
+
+typedef struct holdstats {
+    volatile long held; /* connections currently established */
+    volatile long connecting;
+    volatile long failed; /* total failed connection attempts */
+    volatile long localfail; /* failed at once: no local ports, fds, ... */
+    volatile long closed; /* total connections closed by the server */
+} holdstats;
+
+typedef struct holdconn {
+    int fd;
+    unsigned int next; /* next trickle request, seconds from start */
+    unsigned char state;
+} holdconn;
+
+typedef struct holdinfo {
+    evLoop *el;
+    char *ip;
+    int port;
+    char *req; /* trickle request */
+    holdconn *conn;
+    int *idle; /* stack of idle slots */
+    int numidle;
+    long long start; /* milliseconds */
+} holdinfo;
+
+static holdinfo hi;
+
+static void holdCloseConn(holdconn *hc) {
+    evDeleteFileEvent(hi.el,hc->fd,EV_READABLE|EV_WRITABLE);
+    close(hc->fd);
+    if (hc->state == WBOX_HOLD_HELD) conf.holdstats->held--;
+    else if (hc->state == WBOX_HOLD_CONNECTING) conf.holdstats->connecting--;
+    hc->fd = -1;
+    hc->state = WBOX_HOLD_IDLE;
+    hi.idle[hi.numidle++] = hc-hi.conn;
+}
+
+/* Replies to trickle requests are just discarded, using a single buffer
+ * for all the connections. */
+static void holdReadHandler(evLoop *el, int fd, void *privdata, int mask) {
+    static char buf[WBOX_RECV_BUF];
+    holdconn *hc = privdata;
+    int nread;
+    WBOX_NOTUSED(el);
+    WBOX_NOTUSED(mask);
+
+    nread = read(fd,buf,sizeof(buf));
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0) {
+        conf.holdstats->closed++;
+        holdCloseConn(hc);
+    }
+}
+
+static void holdConnectHandler(evLoop *el, int fd, void *privdata, int mask) {
+    holdconn *hc = privdata;
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    WBOX_NOTUSED(mask);
+
+    if (getsockopt(fd,SOL_SOCKET,SO_ERROR,&err,&errlen) == -1 || err) {
+        conf.holdstats->failed++;
+        holdCloseConn(hc);
+        return;
+    }
+    evDeleteFileEvent(el,fd,EV_WRITABLE);
+    if (evCreateFileEvent(el,fd,EV_READABLE,holdReadHandler,hc) == EV_ERR) {
+        conf.holdstats->failed++;
+        holdCloseConn(hc);
+        return;
+    }
+    hc->state = WBOX_HOLD_HELD;
+    hc->next = (milliseconds()-hi.start)/1000+conf.trickle;
+    conf.holdstats->connecting--;
+    conf.holdstats->held++;
+}
+
+/* Start a connection in an idle slot. Returns 0 if it failed at once,
+ * in that case it is not retried before the next cron. */
+static int holdStartConn(void) {
+    holdconn *hc = &hi.conn[hi.idle[--hi.numidle]];
+
+    hc->fd = anetTcpNonBlockConnect(NULL,hi.ip,hi.port);
+    if (hc->fd == ANET_ERR ||
+        evCreateFileEvent(hi.el,hc->fd,EV_WRITABLE,holdConnectHandler,hc)
+        == EV_ERR)
+    {
+        if (hc->fd != ANET_ERR) close(hc->fd);
+        hc->fd = -1;
+        hi.numidle++;
+        conf.holdstats->failed++;
+        conf.holdstats->localfail++;
+        return 0;
+    }
+    hc->state = WBOX_HOLD_CONNECTING;
+    conf.holdstats->connecting++;
+    return 1;
+}
+
+static void holdMode(char *ip, urlinfo *ui, wconfig *conf) {
+    long long lastcron = 0;
+    int j, opened = 0, stalled = 0;
+
+    hi.el = evCreateLoop(conf->hold+64);
+    hi.ip = ip;
+    hi.port = ui->port;
+    hi.req = sdscatprintf(sdsnew(""),"HEAD %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+        ui->req, ui->domain);
+    hi.conn = malloc(sizeof(holdconn)*conf->hold);
+    hi.idle = malloc(sizeof(int)*conf->hold);
+    if (hi.el == NULL || hi.conn == NULL || hi.idle == NULL) {
+        fprintf(stderr,"Out of memory allocating the connections pool\n");
+        exit(WBOX_EXIT_IO);
+    }
+    for (j = 0; j < conf->hold; j++) {
+        hi.conn[j].fd = -1;
+        hi.conn[j].state = WBOX_HOLD_IDLE;
+        hi.idle[j] = conf->hold-j-1;
+    }
+    hi.numidle = conf->hold;
+    hi.start = milliseconds();
+    while(1) {
+        long long now = milliseconds();
+        unsigned int secs = (now-hi.start)/1000;
+
+        /* Open new connections, without too many connects in progress.
+         * Stop at the first immediate failure: we reached some local
+         * limit, and retrying at once would just spin. */
+        while(hi.numidle && !stalled &&
+              conf->holdstats->connecting < WBOX_HOLD_MAXCONNECTING &&
+              (conf->holdrate == 0 || opened < conf->holdrate))
+        {
+            if (!holdStartConn()) stalled = 1;
+            opened++;
+        }
+        evProcessEvents(hi.el,WBOX_CRON_MS);
+        if (now-lastcron < 1000) continue;
+        lastcron = now;
+        opened = 0;
+        stalled = 0;
+        /* Exit if the measuring process is gone */
+        if (getppid() == 1) exit(WBOX_EXIT_SUCCESS);
+        if (conf->trickle == 0) continue;
+        for (j = 0; j < conf->hold; j++) {
+            holdconn *hc = &hi.conn[j];
+
+            if (hc->state != WBOX_HOLD_HELD || hc->next > secs) continue;
+            hc->next = secs+conf->trickle;
+            if (write(hc->fd,hi.req,sdslen(hi.req)) == -1 && errno != EAGAIN) {
+                conf->holdstats->closed++;
+                holdCloseConn(hc);
+            }
+        }
+    }
+}
+
+/* Fork the process holding the connections, the statistics are shared
+ * using an anonymous shared memory mapping. */
+static void startHoldProcess(char *ip, urlinfo *ui, wconfig *conf) {
+    int maxfd = adjustOpenFilesLimit(conf->hold+64);
+
+    if (maxfd < conf->hold+64) {
+        fprintf(stderr,"Warning: only %d file descriptors available, "
+                       "holding %d connections. Raise the limit with "
+                       "ulimit -n.\n", maxfd, maxfd-64);
+        conf->hold = maxfd-64;
+        if (conf->hold < 1) exit(WBOX_EXIT_BADARGS);
+    }
+    conf->holdstats = mmap(NULL,sizeof(holdstats),PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_ANON,-1,0);
+    if (conf->holdstats == MAP_FAILED) {
+        perror("mmap");
+        exit(WBOX_EXIT_IO);
+    }
+    memset((void*)conf->holdstats,0,sizeof(holdstats));
+    conf->holdpid = fork();
+    if (conf->holdpid == -1) {
+        perror("fork");
+        exit(WBOX_EXIT_IO);
+    }
+    if (conf->holdpid == 0) {
+        Signal(SIGINT,SIG_IGN); /* the parent will kill us */
+        holdMode(ip,ui,conf);
+    }
+}
+
+/* --------------------------------- HTTP server ---------------------------- */
+/* Return true if the Accept-Encoding field value 'v' accepts gzip, that
+ * is, if gzip or * is listed without a zero quality. */
+static int acceptsGzip(char *v) {
+    int ok = 0;
+
+    while(*v) {
+        char *tok, *q;
+        size_t len;
+
+        while(*v == ' ' || *v == '\t' || *v == ',') v++;
+        tok = v;
+        while(*v && *v != ',') v++;
+        len = strcspn(tok,"; \t,\r");
+        if (!((len == 4 && !strncasecmp(tok,"gzip",4)) ||
+              (len == 6 && !strncasecmp(tok,"x-gzip",6)) ||
+              (len == 1 && tok[0] == '*'))) continue;
+        for (q = tok+len; q+1 < v; q++) {
+            if (q[0] == 'q' && q[1] == '=') {
+                if (strtod(q+2,NULL) == 0) return 0; /* refused */
+                break;
+            }
+        }
+        ok = 1;
+    }
+    return ok;
+}
+
+/* Parse an HTTP date in the RFC 1123 format, the only one generated by
+ * current clients. Returns -1 on error. */
+static time_t parseHttpDate(char *s) {
+    struct tm tm;
+
+    while(*s == ' ' || *s == '\t') s++;
+    memset(&tm,0,sizeof(tm));
+    if (strptime(s,"%a, %d %b %Y %H:%M:%S GMT",&tm) == NULL) return -1;
+    return timegm(&tm);
+}
+
+static void initReqInfo(reqinfo *ri) {
+    ri->file = ri->host = NULL;
+    ri->range = ri->ifrange = ri->ifnonematch = NULL;
+    ri->ifmodsince = -1;
+    ri->bodylen = 0;
+}
+
+/* True if the header field name 'name' of length 'len' is 'field' */
+static int isField(char *name, size_t len, char *field) {
+    return len == strlen(field) && !strncasecmp(name,field,len);
+}
+
+/* Parse in place the request header 'req' of length 'len', including the
+ * final empty line. Lines are located with memchr(), and terminated in
+ * the buffer itself, so the strings in 'ri' are slices of 'req' valid as
+ * long as it is not modified: no allocation is performed. */
+static int parseRequest(char *req, size_t len, reqinfo *ri) {
+    char *end = req+len, *line, *eol, *p, *v;
+    size_t llen, nlen;
+
+    initReqInfo(ri);
+    /* Request line: method, path, protocol */
+    if ((eol = memchr(req,'\n',len)) == NULL) return 1;
+    llen = eol-req;
+    if (llen && req[llen-1] == '\r') llen--;
+    req[llen] = '\0';
+    if ((p = memchr(req,' ',llen)) == NULL) return 1;
+    if (isField(req,p-req,"get")) ri->method = WBOX_REQ_METHOD_GET;
+    else if (isField(req,p-req,"post")) ri->method = WBOX_REQ_METHOD_POST;
+    else if (isField(req,p-req,"head")) ri->method = WBOX_REQ_METHOD_HEAD;
+    else ri->method = WBOX_REQ_METHOD_OTHER;
+    while(*p == ' ') p++;
+    if (*p != '/') return 1;
+    ri->file = p;
+    ri->protover = 10;
+    if ((p = strchr(p,' ')) != NULL) {
+        *p++ = '\0';
+        if (strstr(p,"HTTP/1.1")) ri->protover = 11;
+    }
+    /* Header fields */
+    ri->acceptgzip = 0;
+    ri->keepalive = ri->protover == 11;
+    ri->hasbody = 0;
+    for (line = eol+1; line < end; line = eol+1) {
+        if ((eol = memchr(line,'\n',end-line)) == NULL) break;
+        llen = eol-line;
+        if (llen && line[llen-1] == '\r') llen--;
+        if (llen == 0) break; /* the final empty line */
+        line[llen] = '\0';
+        if ((v = memchr(line,':',llen)) == NULL) continue;
+        nlen = v-line;
+        /* Trim the value */
+        v++;
+        while(*v == ' ' || *v == '\t') v++;
+        for (p = line+llen; p > v && (p[-1] == ' ' || p[-1] == '\t'); p--)
+            p[-1] = '\0';
+        if (isField(line,nlen,"host")) {
+            ri->host = v;
+        } else if (isField(line,nlen,"accept-encoding")) {
+            ri->acceptgzip = acceptsGzip(v);
+        } else if (isField(line,nlen,"range")) {
+            ri->range = v;
+        } else if (isField(line,nlen,"if-range")) {
+            ri->ifrange = v;
+        } else if (isField(line,nlen,"if-none-match")) {
+            ri->ifnonematch = v;
+        } else if (isField(line,nlen,"if-modified-since")) {
+            ri->ifmodsince = parseHttpDate(v);
+        } else if (isField(line,nlen,"connection")) {
+            if (strcasestr(v,"close")) ri->keepalive = 0;
+            else if (strcasestr(v,"keep-alive")) ri->keepalive = 1;
+        } else if (isField(line,nlen,"content-length")) {
+            ri->bodylen = strtoll(v,&p,10);
+            if (p == v || *p != '\0' || ri->bodylen < 0) return 1;
+        } else if (isField(line,nlen,"transfer-encoding")) {
+            ri->hasbody = 1;
+        }
+    }
+    return 0;
+}
+
+/* The request strings belong to the query buffer, just forget them */
+static void freeReqInfo(reqinfo *ri) {
+    initReqInfo(ri);
+}
+
+/* Parse the Range field value 'v' for a file of 'size' bytes, filling 'r'
+ * with up to 'max' ranges. Returns the number of ranges, 0 if the field
+ * must be ignored (bad syntax or too many ranges), or -1 if no range can
+ * be satisfied. */
+static int parseRange(char *v, off_t size, srvrange *r, int max) {
+    int n = 0;
+
+    while(*v == ' ' || *v == '\t') v++;
+    if (strncasecmp(v,"bytes=",6)) return 0;
+    v += 6;
+    while(1) {
+        long long start, end;
+        char *e;
+
+        while(*v == ' ' || *v == '\t') v++;
+        if (*v == '-') {
+            /* Suffix range: the last N bytes */
+            end = strtoll(v+1,&e,10);
+            if (e == v+1 || end < 0) return 0;
+            start = size-end;
+            if (start < 0) start = 0;
+            end = (end == 0) ? -1 : size-1;
+        } else {
+            start = strtoll(v,&e,10);
+            if (e == v || *e != '-' || start < 0) return 0;
+            v = e+1;
+            if (isdigit((unsigned char)*v)) {
+                end = strtoll(v,&e,10);
+                if (end < start) return 0;
+                if (end >= size) end = size-1;
+            } else {
+                end = size-1;
+                e = v;
+            }
+        }
+        if (start < size && start <= end) {
+            if (n == max) return 0;
+            r[n].start = start;
+            r[n].end = end;
+            n++;
+        }
+        v = e;
+        while(*v == ' ' || *v == '\t') v++;
+        if (*v == ',') {
+            v++;
+            continue;
+        }
+        if (*v == '\0' || *v == '\r') break;
+        return 0;
+    }
+    return n ? n : -1;
+}
+
+static void urldecode(char *d, char *s, int n)
+{
+    char *start = d;
+    if (n < 1) return;
+    while(*s && n > 1) {
+        int c = *s;
+        switch(c) {
+        case '+': c = ' '; break;
+        case '%':
+            if (*(s+1) && *(s+2)) {
+                int high = toupper(*(s+1));
+                int low = toupper(*(s+2));
+
+                if (high <= '9') high -= '0';
+                else high = (high - 'A') + 10;
+                if (low <= '9') low -= '0';
+                else low = (low - 'A') + 10;
+                c = (high << 4)+low;
+                s += 2;
+            }
+            break;
+        }
+        if (c != ' ' || d != start) {
+                *d++ = c;
+                n--;
+        }
+        s++;
+    }
+    /* Right trim */
+    *d = '\0';
+    d--;
+    while (d >= start && *d == ' ') {
+            *d = '\0';
+            d--;
+    }
+}
+
+static char *createFullPath(char *root, char *file) {
+    size_t rootlen = strlen(root), filelen = strlen(file);
+    char *fp, *p;
+    int len;
+
+    /* Url decode the original name right after the root */
+    fp = sdsnewlen(NULL,rootlen+filelen+1);
+    memcpy(fp,root,rootlen);
+    urldecode(fp+rootlen,file,filelen+1);
+    sdsupdatelen(fp);
+    while((p=strstr(fp,".."))) {
+        *p = '_';
+        *(p+1) = '_';
+    }
+    /* Make sure there aren't trailing slashes */
+    len = sdslen(fp)-1;
+    while(len >= 1 && fp[len] == '/') fp[len] = '\0';
+    sdsupdatelen(fp);
+    return fp;
+}
+
+/* Format 't' as an HTTP date in 'buf', at least WBOX_HTTPDATE_LEN bytes */
+#define WBOX_HTTPDATE_LEN 32
+static void formatHttpDate(char *buf, time_t t) {
+    struct tm tm;
+
+    gmtime_r(&t,&tm);
+    strftime(buf,WBOX_HTTPDATE_LEN,"%a, %d %b %Y %H:%M:%S GMT",&tm);
+}
+
+/* The Date field of the replies only changes once per second: the server
+ * loop refreshes it, instead of formatting it at every request. */
+static char httpdate[WBOX_HTTPDATE_LEN];
+static time_t httpdatetime = -1;
+
+static void updateHttpDate(time_t now) {
+    if (now == httpdatetime) return;
+    httpdatetime = now;
+    formatHttpDate(httpdate,now);
+}
+
+/* Append the decimal representation of 'value' to 's', without the
+ * temporary buffer allocated by sdscatprintf(). */
+static char *sdscatlonglong(char *s, long long value) {
+    char buf[24], *p = buf+sizeof(buf);
+    unsigned long long v = value < 0 ? -(unsigned long long)value :
+                                       (unsigned long long)value;
+
+    do {
+        *--p = '0'+(v%10);
+        v /= 10;
+    } while(v);
+    if (value < 0) *--p = '-';
+    return sdscatlen(s,p,buf+sizeof(buf)-p);
+}
+
+/* Append to 'r' the first part of the reply header, that changes at every
+ * request: status line, date and server name. When 'r' is the buffer of
+ * the connection, that is reused across requests, no allocation is
+ * performed. */
+static char *createHttpReplyStatus(char *r, reqinfo *ri, char *code,
+                                   char *reason)
+{
+    if (httpdatetime == -1) updateHttpDate(time(NULL));
+    r = sdscatlen(r,ri->protover == 11 ? "HTTP/1.1 " : "HTTP/1.0 ",9);
+    r = sdscat(r,code);
+    r = sdscatlen(r," ",1);
+    r = sdscat(r,reason);
+    r = sdscatlen(r,"\r\nDate: ",8);
+    r = sdscat(r,httpdate);
+    r = sdscat(r,"\r\nServer: WBox " WBOX_STR(WBOX_VERSION)
+                 " (http://hping.org/wbox)\r\n");
+    /* Persistent connections are the default only in HTTP/1.1 */
+    if (ri->protover == 11 && !ri->keepalive)
+        r = sdscat(r,"Connection: close\r\n");
+    else if (ri->protover == 10 && ri->keepalive)
+        r = sdscat(r,"Connection: keep-alive\r\n");
+    return r;
+}
+
+/* Append the content related fields and the final empty line to the
+ * reply header 'r'. A 'len' of -1 means unknown length. */
+static char *catHttpReplyContent(char *r, char *ctype, long long len)
+{
+    r = sdscat(r,"Content-type: ");
+    r = sdscat(r,ctype);
+    if (len != -1) {
+        r = sdscat(r,"\r\nContent-Length: ");
+        r = sdscatlonglong(r,len);
+    }
+    r = sdscatlen(r,"\r\n\r\n",4);
+    return r;
+}
+
+static char *createHttpReply(char *r, reqinfo *ri, char *code, char *reason,
+                             char *ctype, long long len)
+{
+    r = createHttpReplyStatus(r,ri,code,reason);
+    return catHttpReplyContent(r,ctype,len);
+}
+
+static char *sdscatentities(char *d, char *s) {
+    int len = strlen(s);
+    int i;
+
+    for(i = 0; i < len; i++) {
+        switch(s[i]) {
+        case '<': d=sdscatlen(d,"&lt;",4); break;
+        case '>': d=sdscatlen(d,"&gt;",4); break;
         case '&': d=sdscatlen(d,"&amp;",5); break;
         case '"': d=sdscatlen(d,"&quot;",6); break;
         default: d=sdscatlen(d,s+i,1); break;
@@ -649,304 +2001,3323 @@ static char *sdscatentities(char *d, char *s) {
     return d;
 }
 
-/* Special version of sdscat() that takes care of special
- * chars in filenames having a special meaning for the
- * browser (like #). This function also performs HTML entities
- * conversion. */
-static char *sdscaturl(char *d, char *s) {
-    char *hexset = "0123456789abcdef";
-    int len;
-    int i;
-    unsigned int t;
+/* Special version of sdscat() that takes care of special
+ * chars in filenames having a special meaning for the
+ * browser (like #). This function also performs HTML entities
+ * conversion. */
+static char *sdscaturl(char *d, char *s) {
+    char *hexset = "0123456789abcdef";
+    int len;
+    int i;
+    unsigned int t;
+
+    /* Entities conversion step */
+    {
+        char *new = sdsnew("");
+        new = sdscatentities(new,s);
+        s = new;
+    }
+    len = strlen(s);
+    for(i = 0; i < len; i++) {
+        switch(s[i]) {
+        case '#':
+            t = (unsigned) s[i];
+            d = sdscatlen(d,"%",1);
+            d = sdscatlen(d,hexset+((t & 0xF0) >> 4),1);
+            d = sdscatlen(d,hexset+((t & 0x0F) >> 4),1);
+            break;
+        default:
+            d = sdscatlen(d,s+i,1);
+            break;
+        }
+    }
+    sdsfree(s);
+    return d;
+}
+
+/* Content types by file extension. Lookups go through a small open
+ * addressing hash table built on first use, keyed by the lowercase
+ * extension. All the rest is binary data, but is sent as text/plain. */
+static struct mimetype {
+    char *ext;
+    char *ctype;
+} mimetypes[] = {
+    {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"},
+    {"css", "text/css"}, {"js", "text/javascript"},
+    {"ico", "image/x-icon"}, {"png", "image/png"}, {"gif", "image/gif"},
+    {"html", "text/html"}, {"htm", "text/html"},
+    {"xml", "text/plain"}, {"txt", "text/plain"}, {"c", "text/plain"},
+    {"rb", "text/plain"}, {"py", "text/plain"}, {"cpp", "text/plain"},
+    {"c++", "text/plain"}, {"tcl", "text/plain"}, {"pl", "text/plain"},
+    {"lua", "text/plain"}, {"csv", "text/plain"},
+    {"pdf", "application/pdf"}, {"mp3", "audio/mpeg"},
+    {"mpg", "video/mpeg"},
+    {NULL, NULL}
+};
+
+#define WBOX_MIME_BUCKETS 64 /* power of two, at least twice the types */
+#define WBOX_MIME_MAXEXT 8
+static struct mimetype *mimetable[WBOX_MIME_BUCKETS];
+static int mimeready = 0;
+
+static unsigned int mimeHash(char *ext) {
+    unsigned int h = 5381;
+
+    while(*ext) h = h*33+(unsigned char)*ext++;
+    return h & (WBOX_MIME_BUCKETS-1);
+}
+
+static void mimeInit(void) {
+    struct mimetype *m;
+
+    for (m = mimetypes; m->ext; m++) {
+        unsigned int h = mimeHash(m->ext);
+
+        while(mimetable[h]) h = (h+1) & (WBOX_MIME_BUCKETS-1);
+        mimetable[h] = m;
+    }
+    mimeready = 1;
+}
+
+static char *guessContentType(char *filename) {
+    char ext[WBOX_MIME_MAXEXT+1], *p;
+    unsigned int h;
+    int j;
+
+    p = strrchr(filename,'.');
+    if (!p) return "text/plain";
+    p++;
+    for (j = 0; p[j] && j < WBOX_MIME_MAXEXT; j++) ext[j] = tolower(p[j]);
+    if (p[j]) return "text/plain";
+    ext[j] = '\0';
+    if (!mimeready) mimeInit();
+    h = mimeHash(ext);
+    while(mimetable[h]) {
+        if (!strcmp(mimetable[h]->ext,ext)) return mimetable[h]->ctype;
+        h = (h+1) & (WBOX_MIME_BUCKETS-1);
+    }
+    return "text/plain";
+}
+
+/* -------------------------------- File cache ------------------------------ */
+/* Server mode keeps the open file, the stat() result and the content part
+ * of the reply header of recently requested regular files, indexed by
+ * request path, so that serving a cached file costs a hash lookup plus
+ * the system calls to send it. Every worker has its own cache.
+ *
+ * Entries are invalidated by inotify events on the directories leading to
+ * the cached files: without inotify (not Linux) the cache is disabled.
+ * Clients sending a file hold a reference to its entry, so an entry
+ * removed from the cache is freed only when the last transfer ends.
+ *
+ * The precompressed <file>.gz sibling, if any, is part of the entry of
+ * the original file, so its existence is checked only once. */
+typedef struct fcentry {
+    char *key; /* request path, as sent by the client */
+    char *name; /* file name inside the watched directory */
+    int wd; /* inotify watch descriptor of the directory */
+    int fd;
+    struct stat st;
+    char *ctype;
+    char *hdr; /* reply header after the status, date and server lines */
+    int gzfd; /* precompressed sibling, or -1 */
+    struct stat gzst;
+    int refcount; /* one for the cache, plus one for every client */
+    struct fcentry *hnext; /* hash table chain */
+    struct fcentry *prev, *next; /* LRU list, most recently used first */
+} fcentry;
+
+typedef struct fcache {
+    fcentry **table;
+    unsigned long mask; /* table size - 1, the size is a power of two */
+    int count;
+    fcentry *head, *tail;
+    int ifd; /* inotify file descriptor */
+} fcache;
+
+static fcache fc;
+
+static unsigned long fcHash(char *key, size_t len) {
+    unsigned long h = 5381;
+
+    while(len--) h = ((h << 5) + h) + (unsigned char) *key++;
+    return h;
+}
+
+static void fcRelease(fcentry *e) {
+    if (--e->refcount) return;
+    close(e->fd);
+    if (e->gzfd != -1) close(e->gzfd);
+    sdsfree(e->key);
+    sdsfree(e->name);
+    sdsfree(e->hdr);
+    free(e);
+}
+
+/* Remove the entry from the cache. Clients still sending the file keep
+ * using it until they release their reference. */
+static void fcRemove(fcentry *e) {
+    fcentry **pe = &fc.table[fcHash(e->key,sdslen(e->key)) & fc.mask];
+
+    while(*pe != e) pe = &(*pe)->hnext;
+    *pe = e->hnext;
+    if (e->prev) e->prev->next = e->next; else fc.head = e->next;
+    if (e->next) e->next->prev = e->prev; else fc.tail = e->prev;
+    fc.count--;
+    fcRelease(e);
+}
+
+static void fcMoveToHead(fcentry *e) {
+    if (fc.head == e) return;
+    e->prev->next = e->next;
+    if (e->next) e->next->prev = e->prev; else fc.tail = e->prev;
+    e->prev = NULL;
+    e->next = fc.head;
+    fc.head->prev = e;
+    fc.head = e;
+}
+
+/* Return the entry for the request path 'key', or NULL. */
+static fcentry *fcLookup(char *key) {
+    size_t keylen = strlen(key);
+    fcentry *e;
+
+    if (!fc.table) return NULL;
+    e = fc.table[fcHash(key,keylen) & fc.mask];
+    while(e) {
+        if (sdslen(e->key) == keylen && !memcmp(e->key,key,keylen)) {
+            fcMoveToHead(e);
+            conf.wstats->fchits++;
+            return e;
+        }
+        e = e->hnext;
+    }
+    conf.wstats->fcmisses++;
+    return NULL;
+}
+
+/* Return true if changes to 'path' (already opened, with inode 'ino') are
+ * notified by the inotify watch of its directory. Symlinks and hard links
+ * may be modified via paths we don't watch. */
+static int fcCacheable(char *path, ino_t ino) {
+    struct stat lst;
+
+    return lstat(path,&lst) == 0 && S_ISREG(lst.st_mode) &&
+           lst.st_nlink == 1 && lst.st_ino == ino;
+}
+
+/* Add the file 'fullpath', already open as 'fd', to the cache, with its
+ * precompressed sibling 'gzfd' if not -1. On success the cache owns the
+ * file descriptors and the 'hdr' string. Returns NULL if the file can't
+ * be cached, that is, if we would not be notified of its changes. */
+static fcentry *fcAdd(char *key, char *fullpath, int fd, struct stat *st,
+                      int gzfd, struct stat *gzst, char *ctype, char *hdr)
+{
+#ifdef __linux__
+    fcentry *e;
+    char *dir, *p;
+    unsigned long h;
+    size_t j;
+    int wd = -1;
+
+    if (!fc.table || !fcCacheable(fullpath,st->st_ino)) return NULL;
+    if (gzfd != -1) {
+        char *gzpath = sdscat(sdsdup(fullpath),".gz");
+        int ok = fcCacheable(gzpath,gzst->st_ino);
+
+        sdsfree(gzpath);
+        if (!ok) return NULL;
+    }
+    /* Watch every directory from the webroot to the file, so that renaming
+     * any of them is noticed. Adding a watch to an already watched
+     * directory just returns the same descriptor. */
+    p = strrchr(fullpath,'/');
+    dir = sdsnewlen(fullpath,p-fullpath);
+    for (j = strlen(conf.webroot); j <= sdslen(dir); j++) {
+        if (j != sdslen(dir) && dir[j] != '/') continue;
+        dir[j] = '\0';
+        wd = inotify_add_watch(fc.ifd,j ? dir : "/",
+            IN_MODIFY|IN_ATTRIB|IN_CLOSE_WRITE|IN_MOVED_FROM|IN_MOVED_TO|
+            IN_CREATE|IN_DELETE|IN_DELETE_SELF|IN_MOVE_SELF);
+        if (j != sdslen(dir)) dir[j] = '/';
+        if (wd == -1) break;
+    }
+    sdsfree(dir);
+    if (wd == -1) return NULL;
+    if (fc.count >= conf.fcachemax) fcRemove(fc.tail);
+    if ((e = malloc(sizeof(*e))) == NULL) return NULL;
+    e->key = sdsnew(key);
+    e->name = sdsnew(p+1);
+    e->wd = wd;
+    e->fd = fd;
+    e->st = *st;
+    e->ctype = ctype;
+    e->hdr = hdr;
+    e->gzfd = gzfd;
+    if (gzfd != -1) e->gzst = *gzst;
+    e->refcount = 1;
+    h = fcHash(key,strlen(key)) & fc.mask;
+    e->hnext = fc.table[h];
+    fc.table[h] = e;
+    e->prev = NULL;
+    e->next = fc.head;
+    if (fc.head) fc.head->prev = e; else fc.tail = e;
+    fc.head = e;
+    fc.count++;
+    return e;
+#else
+    WBOX_NOTUSED(key);
+    WBOX_NOTUSED(fullpath);
+    WBOX_NOTUSED(fd);
+    WBOX_NOTUSED(st);
+    WBOX_NOTUSED(gzfd);
+    WBOX_NOTUSED(gzst);
+    WBOX_NOTUSED(ctype);
+    WBOX_NOTUSED(hdr);
+    return NULL;
+#endif
+}
+
+static void fcFlush(void) {
+    while(fc.head) fcRemove(fc.head);
+}
+
+#ifdef __linux__
+/* Return true if the event about 'name' affects the entry: the file itself
+ * or its .gz sibling changed. */
+static int fcNameMatch(fcentry *e, char *name) {
+    size_t len = sdslen(e->name);
+
+    return !strncmp(e->name,name,len) &&
+           (name[len] == '\0' || !strcmp(name+len,".gz"));
+}
+
+/* Drop the entries affected by the inotify events. Changes to directories
+ * are rare, and may affect any file below them: the whole cache is
+ * flushed in that case. */
+static void fcInotifyHandler(evLoop *el, int fd, void *privdata, int mask) {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t nread, j;
+    WBOX_NOTUSED(el);
+    WBOX_NOTUSED(privdata);
+    WBOX_NOTUSED(mask);
+
+    while((nread = read(fd,buf,sizeof(buf))) > 0) {
+        for (j = 0; j < nread;) {
+            struct inotify_event *ev = (struct inotify_event*) (buf+j);
+            fcentry *e = fc.head, *next;
+
+            j += sizeof(*ev)+ev->len;
+            if (ev->len == 0 ||
+                ev->mask & (IN_Q_OVERFLOW|IN_ISDIR|IN_IGNORED))
+            {
+                conf.wstats->fcinvalidated += fc.count;
+                fcFlush();
+                continue;
+            }
+            while(e) {
+                next = e->next;
+                if (e->wd == ev->wd && fcNameMatch(e,ev->name)) {
+                    conf.wstats->fcinvalidated++;
+                    fcRemove(e);
+                }
+                e = next;
+            }
+        }
+    }
+}
+#endif
+
+/* Create the cache of the current worker, if enabled. */
+static void fcInit(void) {
+#ifdef __linux__
+    unsigned long size = 16;
+
+    if (conf.fcachemax == 0) return;
+    fc.ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (fc.ifd == -1 ||
+        evCreateFileEvent(conf.el,fc.ifd,EV_READABLE,fcInotifyHandler,NULL)
+        == EV_ERR)
+    {
+        fprintf(stderr,"Warning: inotify not available (%s), "
+                       "file cache disabled\n", strerror(errno));
+        if (fc.ifd != -1) close(fc.ifd);
+        return;
+    }
+    while(size < (unsigned long)conf.fcachemax*2) size <<= 1;
+    fc.table = calloc(size,sizeof(fcentry*));
+    if (!fc.table) {
+        close(fc.ifd);
+        return;
+    }
+    fc.mask = size-1;
+#endif
+}
+
+/* ------------------------- Rendered content cache ------------------------- */
+/* Content generated by the server, that is, compressed variants of files
+ * created on the fly ("gzip" option) and directory listings, is kept in
+ * LRU caches bounded in bytes. Entries are keyed by request path and are
+ * valid as long as inode, size and modification time of the source file
+ * or directory match, so they don't depend on inotify. The content is
+ * stored in an anonymous memory file, so it is sent with sendfile() like
+ * any other file. */
+typedef struct rcentry {
+    char *key; /* request path */
+    ino_t ino;
+    off_t size;
+    unsigned long long mtime; /* statMtime() */
+    int fd; /* rendered content, or -1 (gzip: the file does not compress) */
+    off_t len;
+    int refcount; /* one for the cache, plus one for every client */
+    struct rcentry *hnext; /* hash table chain */
+    struct rcentry *prev, *next; /* LRU list, most recently used first */
+} rcentry;
+
+typedef struct rcache {
+    rcentry *table[WBOX_RCACHE_BUCKETS];
+    rcentry *head, *tail;
+    long long used; /* bytes, including the entries overhead */
+    long long max;
+} rcache;
+
+static rcache gzc; /* compressed variants */
+static rcache dlc; /* directory listings */
+
+/* Create the anonymous file used to store rendered content */
+static int rcCreateFile(void) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    return memfd_create("wbox-rcache",MFD_CLOEXEC);
+#else
+    char tmpl[] = "/tmp/wbox-rcache-XXXXXX";
+    int fd = mkstemp(tmpl);
+
+    if (fd != -1) unlink(tmpl);
+    return fd;
+#endif
+}
+
+static void rcRelease(rcentry *e) {
+    if (--e->refcount) return;
+    if (e->fd != -1) close(e->fd);
+    sdsfree(e->key);
+    free(e);
+}
+
+static void rcRemove(rcache *rc, rcentry *e) {
+    rcentry **pe = &rc->table[fcHash(e->key,sdslen(e->key)) &
+                              (WBOX_RCACHE_BUCKETS-1)];
+
+    while(*pe != e) pe = &(*pe)->hnext;
+    *pe = e->hnext;
+    if (e->prev) e->prev->next = e->next; else rc->head = e->next;
+    if (e->next) e->next->prev = e->prev; else rc->tail = e->prev;
+    rc->used -= e->len+sizeof(*e);
+    rcRelease(e);
+}
+
+/* Return the entry for 'key' rendered from the file with stat 'st', or
+ * NULL. Stale entries are removed. */
+static rcentry *rcLookup(rcache *rc, char *key, struct stat *st) {
+    size_t keylen = strlen(key);
+    unsigned long h = fcHash(key,keylen) & (WBOX_RCACHE_BUCKETS-1);
+    rcentry *e;
+
+    for (e = rc->table[h]; e; e = e->hnext) {
+        if (sdslen(e->key) != keylen || memcmp(e->key,key,keylen))
+            continue;
+        if (e->ino != st->st_ino || e->size != st->st_size ||
+            e->mtime != statMtime(st))
+        {
+            rcRemove(rc,e);
+            return NULL;
+        }
+        if (rc->head != e) {
+            e->prev->next = e->next;
+            if (e->next) e->next->prev = e->prev; else rc->tail = e->prev;
+            e->prev = NULL;
+            e->next = rc->head;
+            rc->head->prev = e;
+            rc->head = e;
+        }
+        return e;
+    }
+    return NULL;
+}
+
+/* Add the content 'fd' of length 'len' rendered from the file with stat
+ * 'st' to the cache, that takes ownership of 'fd'. Least recently used
+ * entries are evicted to make room. */
+static rcentry *rcAdd(rcache *rc, char *key, struct stat *st, int fd,
+                      off_t len)
+{
+    unsigned long h = fcHash(key,strlen(key)) & (WBOX_RCACHE_BUCKETS-1);
+    rcentry *e;
+
+    if ((e = malloc(sizeof(*e))) == NULL) {
+        if (fd != -1) close(fd);
+        return NULL;
+    }
+    e->key = sdsnew(key);
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = statMtime(st);
+    e->fd = fd;
+    e->len = len;
+    e->refcount = 1;
+    rc->used += e->len+sizeof(*e);
+    while(rc->used > rc->max && rc->tail) rcRemove(rc,rc->tail);
+    e->hnext = rc->table[h];
+    rc->table[h] = e;
+    e->prev = NULL;
+    e->next = rc->head;
+    if (rc->head) rc->head->prev = e; else rc->tail = e;
+    rc->head = e;
+    return e;
+}
+
+/* Return true if content of this type is worth compressing */
+static int gzCompressible(char *ctype) {
+    return !strncmp(ctype,"text/",5) || strstr(ctype,"javascript") ||
+           strstr(ctype,"json") || strstr(ctype,"xml");
+}
+
+/* Compress the first 'size' bytes of 'fd' with gzip into a new anonymous
+ * file. Returns the file, or -1 on error or if the compressed data would
+ * not be smaller than the original. */
+static int gzCompressFile(int fd, off_t size, off_t *len) {
+#ifdef WBOX_ZLIB
+    static unsigned char in[WBOX_COPY_CHUNK], out[WBOX_COPY_CHUNK];
+    z_stream zs;
+    off_t off = 0;
+    int outfd, flush;
+
+    if ((outfd = rcCreateFile()) == -1) return -1;
+    memset(&zs,0,sizeof(zs));
+    /* 15+16 window bits: gzip header and trailer instead of zlib's. */
+    if (deflateInit2(&zs,6,Z_DEFLATED,15+16,8,Z_DEFAULT_STRATEGY) != Z_OK) {
+        close(outfd);
+        return -1;
+    }
+    do {
+        ssize_t nread = pread(fd,in,sizeof(in),off);
+
+        if (nread == -1) goto err;
+        off += nread;
+        flush = (nread == 0 || off >= size) ? Z_FINISH : Z_NO_FLUSH;
+        zs.next_in = in;
+        zs.avail_in = nread;
+        do {
+            size_t have;
+
+            zs.next_out = out;
+            zs.avail_out = sizeof(out);
+            deflate(&zs,flush);
+            have = sizeof(out)-zs.avail_out;
+            if (have && write(outfd,out,have) != (ssize_t)have) goto err;
+            if ((off_t)zs.total_out >= size) goto err; /* not worth it */
+        } while(zs.avail_out == 0);
+    } while(flush != Z_FINISH);
+    *len = zs.total_out;
+    deflateEnd(&zs);
+    return outfd;
+
+err:
+    deflateEnd(&zs);
+    close(outfd);
+    return -1;
+#else
+    WBOX_NOTUSED(fd);
+    WBOX_NOTUSED(size);
+    WBOX_NOTUSED(len);
+    return -1;
+#endif
+}
+
+/* Return true if the file with stat 'st' is small enough to be
+ * compressed on the fly. */
+static int gzOnTheFly(struct stat *st) {
+    return st->st_size <= WBOX_GZIP_MAX && st->st_size <= gzc.max/2;
+}
+
+/* Return the compressed variant of the file 'fd' requested as 'key',
+ * compressing it if not already cached. The returned entry has fd set to
+ * -1 if the file is not worth compressing. Compression happens in the
+ * event loop, so files larger than WBOX_GZIP_MAX are sent as they are
+ * (NULL is returned) unless a precompressed sibling exists. */
+static rcentry *gzGet(char *key, int fd, struct stat *st) {
+    rcentry *e;
+    off_t len = 0;
+    int gzfd;
+
+    if ((e = rcLookup(&gzc,key,st)) != NULL) {
+        conf.wstats->gzhits++;
+        return e;
+    }
+    if (!gzOnTheFly(st)) return NULL;
+    gzfd = gzCompressFile(fd,st->st_size,&len);
+    conf.wstats->gzcompressed++;
+    return rcAdd(&gzc,key,st,gzfd,len);
+}
+
+/* ---------------------------- Directory listings -------------------------- */
+/* Listings are rendered incrementally while they are sent, a chunk at a
+ * time, so huge directories don't need huge buffers nor a long wait for
+ * the first byte. Entries are read in batches (getdents64 on Linux) and
+ * stat()ed relative to the directory fd. Directories are listed first:
+ * the directory is read twice, but only the entries of the type listed in
+ * the current pass are stat()ed when the type is known from the
+ * directory entry itself. The output is also written to an anonymous file
+ * that is added to the listings cache once complete. */
+#define WBOX_DIRLIST_BUF (1024*32)
+#define WBOX_DIRLIST_CHUNK (1024*16) /* rendered bytes per chunk */
+
+#ifdef __linux__
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+typedef struct dirlist {
+    int fd; /* the directory */
+#ifdef __linux__
+    char buf[WBOX_DIRLIST_BUF] __attribute__ ((aligned(8)));
+    int bufpos, buflen;
+#else
+    DIR *dir;
+#endif
+    int pass; /* 2 = header, 1 = directories, 0 = the rest, -1 = done */
+    char *key; /* request path */
+    struct stat st; /* of the directory, the cache validity key */
+    int cachefd; /* rendered output for the cache, or -1 */
+    off_t cachelen;
+} dirlist;
+
+/* Return the name and type (DT_* or DT_UNKNOWN) of the next entry of the
+ * directory, or NULL at the end. */
+static char *dlNextEntry(dirlist *dl, int *type) {
+#ifdef __linux__
+    struct linux_dirent64 *de;
+
+    if (dl->bufpos == dl->buflen) {
+        long nread = syscall(SYS_getdents64,dl->fd,dl->buf,
+                             sizeof(dl->buf));
+
+        if (nread <= 0) return NULL;
+        dl->bufpos = 0;
+        dl->buflen = nread;
+    }
+    de = (struct linux_dirent64*) (dl->buf+dl->bufpos);
+    dl->bufpos += de->d_reclen;
+    *type = de->d_type;
+    return de->d_name;
+#else
+    struct dirent *de = readdir(dl->dir);
+
+    if (de == NULL) return NULL;
+#ifdef DT_UNKNOWN
+    *type = de->d_type;
+#else
+    *type = 0;
+#endif
+    return de->d_name;
+#endif
+}
+
+static void dlRewind(dirlist *dl) {
+#ifdef __linux__
+    lseek(dl->fd,0,SEEK_SET);
+    dl->bufpos = dl->buflen = 0;
+#else
+    rewinddir(dl->dir);
+#endif
+}
+
+/* Cheap access(R_OK): the mode bits are enough unless supplementary
+ * groups may make a difference. */
+static int dlReadable(int dfd, char *name, struct stat *st) {
+    static uid_t euid = (uid_t) -1;
+    mode_t m = st->st_mode;
+
+    if (euid == (uid_t) -1) euid = geteuid();
+    if (euid == 0) return 1;
+    if (st->st_uid == euid) return (m & S_IRUSR) != 0;
+    if (st->st_gid == getegid()) return (m & S_IRGRP) != 0;
+    if (((m & S_IRGRP) != 0) != ((m & S_IROTH) != 0))
+        return faccessat(dfd,name,R_OK,0) == 0;
+    return (m & S_IROTH) != 0;
+}
+
+static char *sdscatsize(char *b, off_t bytes) {
+    float size = bytes;
+    char unitchar;
+
+    if (size > 1024*1024*1024) {
+        size /= 1024*1024*1024;
+        unitchar='G';
+    } else if (size > 1024*1024) {
+        size /= 1024*1024;
+        unitchar='M';
+    } else if (size > 1024) {
+        size /= 1024;
+        unitchar='k';
+    } else {
+        unitchar='b';
+    }
+    if (size-(int)size)
+        return sdscatprintf(b,"%.1f%c",size,unitchar);
+    else
+        return sdscatprintf(b,"%d%c",(int)size,unitchar);
+}
+
+/* Append the next part of the listing to 'b', at least
+ * WBOX_DIRLIST_CHUNK bytes unless the listing is over. */
+static char *dlRender(dirlist *dl, char *b) {
+    size_t start = sdslen(b);
+    int type;
+    char *name;
+
+    if (dl->pass == 2) {
+        b = sdscat(b,htmlheader);
+        b = sdscat(b,"<h1>Index of ");
+        b = sdscatentities(b,dl->key);
+        b = sdscat(b,"</h1>\n<table class=\"dirindex\">");
+        dl->pass = 1;
+    }
+    while(dl->pass >= 0 && sdslen(b)-start < WBOX_DIRLIST_CHUNK) {
+        struct stat sbuf;
+        char *trname;
+        int isdir;
+
+        if ((name = dlNextEntry(dl,&type)) == NULL) {
+            if (dl->pass-- == 1) {
+                dlRewind(dl);
+            } else {
+                b = sdscat(b,"</table>\n");
+                b = sdscat(b,htmlfooter);
+            }
+            continue;
+        }
+#ifdef DT_UNKNOWN
+        /* Skip entries of the wrong type without stat() if possible */
+        if ((type == DT_DIR && !dl->pass) ||
+            (type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN &&
+             dl->pass)) continue;
+#endif
+        if (fstatat(dl->fd,name,&sbuf,0) == -1 ||
+            !dlReadable(dl->fd,name,&sbuf)) continue;
+        isdir = S_ISDIR(sbuf.st_mode);
+        if (dl->pass != isdir) continue;
+        if (isdir && name[0] == '.' && name[1] == '\0') continue;
+        /* File name */
+        b = sdscat(b,"<tr><td><a href=\"");
+        trname = sdsnew(name);
+        if (sdslen(trname) > 30) {
+            trname = sdsrange(trname,0,30);
+            trname = sdscat(trname,"...>");
+        }
+        b = sdscaturl(b,name);
+        if (isdir) {
+            b = sdscatlen(b,"/",1);
+            b = sdscat(b,"\" class=\"dir\">[DIR] ");
+        } else
+            b = sdscat(b,"\">");
+        b = sdscatentities(b,trname);
+        b = sdscat(b,"</a></td>\n");
+        sdsfree(trname);
+        /* File size */
+        b = sdscat(b,"<td>");
+        b = sdscatsize(b,sbuf.st_size);
+        b = sdscat(b,"</td></tr>\n");
+    }
+    /* Keep a copy for the cache, unless it gets too big. */
+    if (dl->cachefd != -1) {
+        size_t len = sdslen(b)-start;
+
+        if (dl->cachelen+(long long)len > dlc.max/2 ||
+            write(dl->cachefd,b+start,len) != (ssize_t)len)
+        {
+            close(dl->cachefd);
+            dl->cachefd = -1;
+        } else {
+            dl->cachelen += len;
+        }
+    }
+    return b;
+}
+
+/* Start the listing of the open directory 'fd' with stat 'st', requested
+ * as 'key'. Returns NULL on out of memory, otherwise the listing owns
+ * 'fd'. */
+static dirlist *dlCreate(int fd, struct stat *st, char *key) {
+    dirlist *dl = malloc(sizeof(*dl));
+
+    if (dl == NULL) return NULL;
+    dl->fd = fd;
+#ifdef __linux__
+    dl->bufpos = dl->buflen = 0;
+#else
+    if ((dl->dir = fdopendir(fd)) == NULL) {
+        free(dl);
+        return NULL;
+    }
+#endif
+    dl->pass = 2;
+    dl->key = sdsnew(key);
+    dl->st = *st;
+    /* Listings of directories modified in the last second are not cached,
+     * since other changes in the same second would not change mtime. */
+    dl->cachefd = (dlc.max && st->st_mtime < time(NULL)-1) ?
+                  rcCreateFile() : -1;
+    dl->cachelen = 0;
+    return dl;
+}
+
+/* Release the listing, adding the rendered output to the cache if the
+ * listing is complete. */
+static void dlFree(dirlist *dl) {
+    if (dl->cachefd != -1) {
+        if (dl->pass == -1)
+            rcAdd(&dlc,dl->key,&dl->st,dl->cachefd,dl->cachelen);
+        else
+            close(dl->cachefd);
+    }
+#ifdef __linux__
+    close(dl->fd);
+#else
+    closedir(dl->dir);
+#endif
+    sdsfree(dl->key);
+    free(dl);
+}
+
+/* --------------------------------- Server mode ---------------------------- */
+/* Server mode client. Every connection is handled by a small state
+ * machine driven by the event loop: the request is read and parsed, then
+ * the reply header (and the generated body, if any) is sent, followed by
+ * the file content for regular files. With keep alive the client then
+ * goes back to read the next request, that may be already in the query
+ * buffer if the client pipelines requests. */
+#define WBOX_SRV_READREQ 0
+#define WBOX_SRV_WRITEREPLY 1
+
+/* How files are sent, see srvSendFile() */
+#define WBOX_SEND_SENDFILE 0
+#define WBOX_SEND_SPLICE 1
+#define WBOX_SEND_COPY 2
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+typedef struct srvclient {
+    int fd;
+    int state;
+    char ip[32];
+    int port;
+    char *querybuf; /* request being read, and the following ones */
+    size_t qpos; /* offset of the current request in querybuf */
+    size_t reqlen; /* length of the current request header */
+    size_t scanpos; /* where to resume the search of the header end */
+    long long bodyleft; /* request body bytes still to discard */
+    int requests; /* requests served on this connection */
+    long long lastio; /* last time we read or wrote something (ms) */
+    long long reqstart; /* when the request started to arrive (ms) */
+    twTimer timer; /* next timeout check, see srvDeadline() */
+    twTimer wake; /* end of a bandwidth or first byte delay pause */
+    struct ipentry *ipe; /* limits of the client IP, or NULL */
+    tokenbucket bw; /* 'bwconn' bandwidth limit */
+    long long reqparsed; /* when the request was parsed (us) */
+    int status; /* status code of the reply being sent */
+    long long sent; /* bytes of the reply already sent */
+    reqinfo ri;
+    char *reply; /* reply header, plus body for generated documents */
+    size_t replypos; /* bytes of 'reply' already sent */
+    int filefd; /* file to send after the reply, or -1 */
+    off_t fileoff, filelen;
+    fcentry *fe; /* file cache entry of the file sent, if any */
+    rcentry *re; /* rendered content cache entry of the file sent, if any */
+    dirlist *dl; /* directory listing being rendered, if any */
+    int chunked; /* use the chunked encoding for the listing or stream */
+    int streamfd; /* content of unknown length being read, or -1 */
+    srvrange *ranges; /* multipart/byteranges reply parts, or NULL */
+    int nranges, rangeidx; /* number of parts, next part to send */
+    char *rangectype; /* parts content type */
+    off_t rangesize; /* file size, reported in every part */
+    struct srvbind *bind; /* waiting for the output of this command */
+    struct srvclient *bindnext; /* next client waiting for 'bind' */
+    struct srvpage *page; /* servertest page to send instead, or NULL */
+    char *pagehdr; /* header variant of 'page' for this request */
+    size_t pagehdrlen;
+    int sendmode; /* WBOX_SEND_* */
+    int pipefd[2]; /* only used by the splice() fallback */
+    size_t pipelen; /* file bytes in the pipe not yet sent */
+    int recvop, sendop; /* io_uring ops in flight, or -1 */
+    char *ringin; /* data received by the ring while replying */
+    struct ringbuf *rb; /* io_uring send buffer, or NULL */
+    int recveof; /* EOF received by the ring while replying */
+    int closing; /* freed, waiting for its io_uring ops to complete */
+    struct srvclient *prev, *next; /* list of all the worker clients */
+} srvclient;
+
+static srvclient *srvclients; /* head of the clients list */
+
+static void srvReadHandler(evLoop *el, int fd, void *privdata, int mask);
+static void srvWriteHandler(evLoop *el, int fd, void *privdata, int mask);
+
+static void srvBindRemoveWaiter(srvclient *c);
+static int srvRingRecvArm(srvclient *c);
+static int srvRingReply(srvclient *c);
+static int srvRingListen(void);
+
+/* Create an empty reply buffer able to hold the usual headers */
+static char *srvCreateReplyBuffer(void) {
+    char *r = sdsnewlen(NULL,WBOX_REPLY_BUF);
+
+    sdsclear(r);
+    return r;
+}
+
+/* Per client IP limits. Every worker tracks the IPs of its clients in a
+ * fixed size open addressing table: an IP is looked for in a few slots
+ * after its hash, and an IP without connections that was not seen for
+ * WBOX_IP_AGE_MS can be replaced. If there is no room the client is not
+ * limited at all, the table never grows. */
+typedef struct ipentry {
+    char ip[32]; /* empty if the slot was never used */
+    int conns; /* connections open */
+    long long lastseen; /* milliseconds */
+    tokenbucket reqs; /* 'iprate' requests/s limit */
+} ipentry;
+
+static ipentry *iptable;
+
+/* The limits are answered with fixed replies, that cost just a copy */
+static char srvreply429[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Server: WBox " WBOX_STR(WBOX_VERSION) " (http://hping.org/wbox)\r\n"
+    "Retry-After: 1\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+static char srvreply503[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Server: WBox " WBOX_STR(WBOX_VERSION) " (http://hping.org/wbox)\r\n"
+    "Retry-After: 1\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+
+/* Return the entry of 'ip', creating it if needed, or NULL if the table
+ * is full. */
+static ipentry *ipLookup(char *ip, long long now) {
+    unsigned long h = fcHash(ip,strlen(ip));
+    ipentry *slot = NULL;
+    int j;
+
+    for (j = 0; j < WBOX_IPTABLE_PROBES; j++) {
+        ipentry *e = &iptable[(h+j) & (WBOX_IPTABLE_SIZE-1)];
+
+        if (!strcmp(e->ip,ip)) {
+            e->lastseen = now;
+            return e;
+        }
+        if (slot == NULL && (e->ip[0] == '\0' ||
+            (e->conns == 0 && now-e->lastseen > WBOX_IP_AGE_MS))) slot = e;
+    }
+    if (slot == NULL) return NULL;
+    memcpy(slot->ip,ip,sizeof(slot->ip));
+    slot->ip[sizeof(slot->ip)-1] = '\0';
+    slot->conns = 0;
+    slot->lastseen = now;
+    if (conf.iprate) {
+        tbInit(&slot->reqs,conf.iprate,1000);
+        slot->reqs.burst = slot->reqs.tokens = conf.ipburst;
+    }
+    return slot;
+}
+
+/* Account a new connection from 'ip', setting '*ipe' to its entry (NULL
+ * if not tracked). Returns 0 if the IP is over 'ipconnmax' instead. */
+static int srvIpAccept(char *ip, ipentry **ipe) {
+    ipentry *e = ipLookup(ip,milliseconds());
+
+    *ipe = NULL;
+    if (e == NULL) return 1;
+    if (conf.ipconnmax && e->conns >= conf.ipconnmax) return 0;
+    e->conns++;
+    *ipe = e;
+    return 1;
+}
+
+static void srvIpRelease(srvclient *c) {
+    if (c->ipe == NULL) return;
+    c->ipe->conns--;
+    c->ipe->lastseen = milliseconds();
+    c->ipe = NULL;
+}
+
+/* Return 1 if the client IP can send one more request now */
+static int srvIpAllowRequest(srvclient *c) {
+    ipentry *e = c->ipe;
+    long long now;
+
+    if (e == NULL) return 1;
+    now = milliseconds();
+    e->lastseen = now;
+    tbRefill(&e->reqs,now);
+    if (e->reqs.tokens <= 0) return 0;
+    e->reqs.tokens--;
+    return 1;
+}
+
+/* Release what was used to reply to the current request */
+static void srvFreeReply(srvclient *c) {
+    if (c->fe) fcRelease(c->fe);
+    if (c->re) rcRelease(c->re);
+    if (!c->fe && !c->re && c->filefd != -1) close(c->filefd);
+    if (c->dl) dlFree(c->dl);
+    c->fe = NULL;
+    c->re = NULL;
+    c->dl = NULL;
+    c->filefd = -1;
+    c->fileoff = c->filelen = 0;
+    c->sendmode = WBOX_SEND_SENDFILE; /* the next file may support it */
+    c->chunked = 0;
+    if (c->streamfd != -1) {
+        evDeleteFileEvent(conf.el,c->streamfd,EV_READABLE);
+        close(c->streamfd);
+        c->streamfd = -1;
+    }
+    free(c->ranges);
+    c->ranges = NULL;
+    c->nranges = c->rangeidx = 0;
+    c->page = NULL;
+    if (c->bind) srvBindRemoveWaiter(c);
+    /* The reply buffer is reused by the next request, unless a directory
+     * chunk or an error page made it grow too much. */
+    if (sdslen(c->reply)+sdsavail(c->reply) > WBOX_REPLY_BUF*4) {
+        sdsfree(c->reply);
+        c->reply = srvCreateReplyBuffer();
+    } else {
+        sdsclear(c->reply);
+    }
+    c->replypos = 0;
+    freeReqInfo(&c->ri);
+}
+
+static void srvDestroyClient(srvclient *c) {
+    close(c->fd);
+    srvFreeReply(c);
+    if (c->pipefd[0] != -1) {
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+    }
+    sdsfree(c->querybuf);
+    sdsfree(c->reply);
+    sdsfree(c->ringin);
+    free(c);
+}
+
+static void srvFreeClient(srvclient *c) {
+    evDeleteFileEvent(conf.el,c->fd,EV_READABLE|EV_WRITABLE);
+    twDel(&c->timer);
+    if (twPending(&c->wake)) {
+        twDel(&c->wake);
+        conf.paused--;
+    }
+    srvIpRelease(c);
+    if (c->prev) c->prev->next = c->next; else srvclients = c->next;
+    if (c->next) c->next->prev = c->prev;
+    conf.activeclients--;
+    conf.wstats->active = conf.activeclients;
+    if (c->recvop != -1 || c->sendop != -1) {
+        /* The ring may still use the socket, the file being sent and the
+         * send buffer: the client is destroyed when its ops complete. */
+        if (c->recvop != -1) evCancelOp(conf.el,c->recvop);
+        if (c->sendop != -1)
+            shutdown(c->fd,SHUT_RDWR);
+        else
+            srvFreeReply(c);
+        c->closing = 1;
+        return;
+    }
+    srvDestroyClient(c);
+}
+
+/* Client timeouts. Every client has a timer in the wheel, set at the
+ * deadline of what the client is expected to do: sending the request
+ * header within 'headertimeout' seconds from its first byte, making
+ * progress with a body or with the reply within 'iotimeout' seconds, or
+ * sending the next request within 'keepalive' seconds. The timer is only
+ * moved earlier when the client state changes: when it fires the deadline
+ * is computed again, and the timer moved forward if the client made
+ * progress meanwhile. */
+#define WBOX_TO_IDLE 0
+#define WBOX_TO_HEADER 1
+#define WBOX_TO_BODY 2
+#define WBOX_TO_SEND 3
+
+/* Return the current deadline of the client in milliseconds, setting
+ * 'kind' to the WBOX_TO_* cause. */
+static long long srvDeadline(srvclient *c, long long now, int *kind) {
+    if (c->state == WBOX_SRV_WRITEREPLY) {
+        *kind = WBOX_TO_SEND;
+        /* The output of bound commands has its own timeout, and paused
+         * clients are not expected to read anything. */
+        if (c->bind || twPending(&c->wake))
+            return now+conf.iotimeout*1000LL;
+        return c->lastio+conf.iotimeout*1000LL;
+    }
+    if (c->bodyleft) {
+        *kind = WBOX_TO_BODY;
+        return c->lastio+conf.iotimeout*1000LL;
+    }
+    if (sdslen(c->querybuf) > c->qpos) {
+        *kind = WBOX_TO_HEADER;
+        return c->reqstart+conf.headertimeout*1000LL;
+    }
+    *kind = WBOX_TO_IDLE;
+    return c->lastio+conf.keepalive*1000LL;
+}
+
+/* Make sure the timer fires no later than the current deadline */
+static void srvUpdateTimer(srvclient *c) {
+    int kind;
+    long long tick = srvDeadline(c,milliseconds(),&kind)/WBOX_TIMER_MS+1;
+
+    if (!twPending(&c->timer) || tick < c->timer.expire)
+        twAdd(&conf.timers,&c->timer,tick);
+}
+
+static void srvTimerProc(twWheel *tw, twTimer *t) {
+    srvclient *c = (srvclient*)((char*)t-offsetof(srvclient,timer));
+    static char *what[] = {"idle","header","body","send"};
+    long long now = milliseconds(), deadline;
+    int kind;
+
+    if ((deadline = srvDeadline(c,now,&kind)) > now) {
+        twAdd(tw,t,deadline/WBOX_TIMER_MS+1);
+        return;
+    }
+    if (!conf.silent)
+        printf("%s:%d %s timeout\n", c->ip, c->port, what[kind]);
+    conf.wstats->timedout++;
+    if (kind == WBOX_TO_HEADER) conf.wstats->tohdr++;
+    else if (kind == WBOX_TO_BODY) conf.wstats->tobody++;
+    else if (kind == WBOX_TO_SEND) conf.wstats->tosend++;
+    srvFreeClient(c);
+}
+
+/* Bandwidth shaping and first byte delays. A paused client has no
+ * writable event: its 'wake' timer, in a wheel of its own, creates the
+ * event again when the pause is over. */
+static void srvWakeProc(twWheel *tw, twTimer *t) {
+    srvclient *c = (srvclient*)((char*)t-offsetof(srvclient,wake));
+    WBOX_NOTUSED(tw);
+
+    conf.paused--;
+    if (evCreateFileEvent(conf.el,c->fd,EV_WRITABLE,srvWriteHandler,c)
+        == EV_ERR) srvFreeClient(c);
+}
+
+static void srvPause(srvclient *c, long long ms) {
+    evDeleteFileEvent(conf.el,c->fd,EV_WRITABLE);
+    if (!twPending(&c->wake)) conf.paused++;
+    twAdd(&conf.wakes,&c->wake,(milliseconds()+ms)/WBOX_TIMER_MS+1);
+}
+
+/* Return how many of the 'len' bytes the client can send now according
+ * to the 'bwconn' and 'bwtotal' limits. If none, the client is paused
+ * until the buckets are refilled, and 0 is returned. */
+static size_t srvShape(srvclient *c, size_t len) {
+    long long now = milliseconds(), avail = len, wait = 0;
+
+    if (conf.bwconn) {
+        tbRefill(&c->bw,now);
+        if (c->bw.tokens < avail) avail = c->bw.tokens;
+        if (c->bw.tokens <= 0) wait = tbWait(&c->bw);
+    }
+    if (conf.bwtotal) {
+        tbRefill(&conf.bwall,now);
+        if (conf.bwall.tokens < avail) avail = conf.bwall.tokens;
+        if (conf.bwall.tokens <= 0 && tbWait(&conf.bwall) > wait)
+            wait = tbWait(&conf.bwall);
+    }
+    if (avail > 0) return avail;
+    srvPause(c,wait);
+    return 0;
+}
+
+static void srvShapeSent(srvclient *c, size_t nwritten) {
+    if (conf.bwconn) c->bw.tokens -= nwritten;
+    if (conf.bwtotal) conf.bwall.tokens -= nwritten;
+}
+
+/* Pause the client before sending the reply if its URL has a first
+ * byte delay. Returns 1 if the client was paused. */
+static int srvDelayReply(srvclient *c) {
+    srvdelay *d = NULL;
+    size_t best = 0;
+    int j, ms;
+
+    /* The longest matching prefix wins */
+    for (j = 0; j < conf.ndelays; j++) {
+        size_t len = strlen(conf.delay[j].prefix);
+
+        if (len >= best && !strncmp(c->ri.file,conf.delay[j].prefix,len)) {
+            d = &conf.delay[j];
+            best = len;
+        }
+    }
+    if (d == NULL) return 0;
+    ms = d->ms + (d->jitter ? rand() % (d->jitter+1) : 0);
+    if (ms == 0) return 0;
+    srvPause(c,ms);
+    return 1;
+}
+
+/* Create the content part of the reply header for a file. Vary is sent
+ * whenever a compressed variant of the file may be served. */
+#define WBOX_HDR_GZIP 1 /* compressed variant */
+#define WBOX_HDR_VARY 2 /* the reply depends on Accept-Encoding */
+#define WBOX_HDR_RANGES 4 /* Range requests are supported */
+#define WBOX_HDR_VALIDATORS 8 /* send ETag and Last-Modified */
+
+/* Write in 'buf' the ETag of the content of the file with stat 'st', or
+ * of its compressed variant if 'gzip' is true. It changes whenever the
+ * file is modified or replaced. */
+#define WBOX_ETAG_LEN 64
+static void srvETag(char *buf, struct stat *st, int gzip) {
+    snprintf(buf,WBOX_ETAG_LEN,"\"%llx-%llx-%llx%s\"",
+        (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+        statMtime(st), gzip ? "-gz" : "");
+}
+
+/* Append ETag and Last-Modified to the reply header 'r'. 'st' is the
+ * stat of the file the content comes from, 'mtime' the modification
+ * time of the original file. */
+static char *catHttpValidators(char *r, struct stat *st, int gzip,
+                               time_t mtime)
+{
+    char buf[WBOX_ETAG_LEN];
+
+    srvETag(buf,st,gzip);
+    r = sdscat(r,"ETag: ");
+    r = sdscat(r,buf);
+    formatHttpDate(buf,mtime);
+    r = sdscat(r,"\r\nLast-Modified: ");
+    r = sdscat(r,buf);
+    return sdscat(r,"\r\n");
+}
+
+static char *srvFileHeader(char *r, char *ctype, off_t len,
+                           struct stat *st, time_t mtime, int flags)
+{
+    if (flags & WBOX_HDR_GZIP) r = sdscat(r,"Content-Encoding: gzip\r\n");
+    if (flags & WBOX_HDR_VARY) r = sdscat(r,"Vary: Accept-Encoding\r\n");
+    if (flags & WBOX_HDR_RANGES) r = sdscat(r,"Accept-Ranges: bytes\r\n");
+    if (flags & WBOX_HDR_VALIDATORS)
+        r = catHttpValidators(r,st,flags & WBOX_HDR_GZIP,mtime);
+    return catHttpReplyContent(r,ctype,len);
+}
+
+/* Return true if the conditional request can be answered with 304 Not
+ * Modified, given the stat of the file providing the content and the
+ * modification time of the original file. If-None-Match takes the
+ * precedence, and uses the weak comparison. */
+static int srvNotModified(reqinfo *ri, struct stat *st, int gzip,
+                          time_t mtime)
+{
+    char etag[WBOX_ETAG_LEN], *p;
+    size_t len;
+
+    if (ri->method != WBOX_REQ_METHOD_GET &&
+        ri->method != WBOX_REQ_METHOD_HEAD) return 0;
+    if (ri->ifnonematch) {
+        srvETag(etag,st,gzip);
+        len = strlen(etag);
+        for (p = ri->ifnonematch; *p; p++) {
+            if (*p == '*') return 1;
+            if (p[0] == 'W' && p[1] == '/') p += 2;
+            if (*p == '"') {
+                if (!strncmp(p,etag,len)) return 1;
+                if ((p = strchr(p+1,'"')) == NULL) break;
+            }
+        }
+        return 0;
+    }
+    return ri->ifmodsince != -1 && mtime <= ri->ifmodsince;
+}
+
+/* Return true if the If-Range condition, if any, allows to send the
+ * requested ranges: the validator must match the current file. */
+static int srvIfRange(reqinfo *ri, struct stat *st) {
+    char etag[WBOX_ETAG_LEN];
+
+    if (ri->ifrange == NULL) return 1;
+    if (ri->ifrange[0] == '"') {
+        srvETag(etag,st,0);
+        return !strcmp(ri->ifrange,etag);
+    }
+    return parseHttpDate(ri->ifrange) == st->st_mtime;
+}
+
+/* Append the Content-Range field value for the range 'start'-'end' of a
+ * file of 'size' bytes to 'r'. */
+static char *catContentRange(char *r, off_t start, off_t end, off_t size) {
+    r = sdscat(r,"bytes ");
+    r = sdscatlonglong(r,start);
+    r = sdscatlen(r,"-",1);
+    r = sdscatlonglong(r,end);
+    r = sdscatlen(r,"/",1);
+    return sdscatlonglong(r,size);
+}
+
+/* Append to 'r' the part header number 'j' of a multipart/byteranges
+ * reply, or the final boundary if 'j' is the number of parts. */
+static char *srvRangePartHeader(char *r, srvclient *c, int j) {
+    if (j) r = sdscatlen(r,"\r\n",2);
+    if (j == c->nranges)
+        return sdscat(r,"--" WBOX_BOUNDARY "--\r\n");
+    r = sdscat(r,"--" WBOX_BOUNDARY "\r\nContent-type: ");
+    r = sdscat(r,c->rangectype);
+    r = sdscat(r,"\r\nContent-Range: ");
+    r = catContentRange(r,c->ranges[j].start,c->ranges[j].end,c->rangesize);
+    return sdscatlen(r,"\r\n\r\n",4);
+}
+
+/* Setup a 206 or 416 reply for the Range request of a regular file with
+ * stat 'st'. If 'vary' is true a compressed variant exists, as for the
+ * full replies. Returns 0 if the Range field should be ignored, so that
+ * the whole file is sent as usual. */
+static int srvReplyRanges(srvclient *c, struct stat *st, char *ctype,
+                          int vary)
+{
+    reqinfo *ri = &c->ri;
+    srvrange r[WBOX_MAX_RANGES];
+    int n, j;
+
+    if (!srvIfRange(ri,st)) return 0;
+    n = parseRange(ri->range,st->st_size,r,WBOX_MAX_RANGES);
+    if (n == 0) return 0;
+    if (n == -1) {
+        c->reply = createHttpReplyStatus(c->reply,ri,"416",
+            "Range Not Satisfiable");
+        c->reply = sdscat(c->reply,"Content-Range: bytes */");
+        c->reply = sdscatlonglong(c->reply,st->st_size);
+        c->reply = sdscatlen(c->reply,"\r\n",2);
+        c->reply = catHttpReplyContent(c->reply,"text/html",0);
+        return 1;
+    }
+    c->reply = createHttpReplyStatus(c->reply,ri,"206","Partial Content");
+    c->reply = sdscat(c->reply,"Accept-Ranges: bytes\r\n");
+    if (vary) c->reply = sdscat(c->reply,"Vary: Accept-Encoding\r\n");
+    c->reply = catHttpValidators(c->reply,st,0,st->st_mtime);
+    if (n == 1) {
+        c->reply = sdscat(c->reply,"Content-Range: ");
+        c->reply = catContentRange(c->reply,r[0].start,r[0].end,
+            st->st_size);
+        c->reply = sdscatlen(c->reply,"\r\n",2);
+        c->reply = catHttpReplyContent(c->reply,ctype,r[0].end-r[0].start+1);
+        c->fileoff = r[0].start;
+        c->filelen = r[0].end+1;
+    } else {
+        long long len = 0;
+        char *h;
+
+        /* Parts are sent by srvNextRange(), but the total length must be
+         * known in advance. */
+        if ((c->ranges = malloc(sizeof(srvrange)*n)) == NULL) return 0;
+        memcpy(c->ranges,r,sizeof(srvrange)*n);
+        c->nranges = n;
+        c->rangeidx = 0;
+        c->rangectype = ctype;
+        c->rangesize = st->st_size;
+        h = sdsnew("");
+        for (j = 0; j <= n; j++) {
+            sdsclear(h);
+            h = srvRangePartHeader(h,c,j);
+            len += sdslen(h);
+            if (j < n) len += r[j].end-r[j].start+1;
+        }
+        sdsfree(h);
+        c->reply = catHttpReplyContent(c->reply,
+            "multipart/byteranges; boundary=" WBOX_BOUNDARY,len);
+    }
+    if (ri->method == WBOX_REQ_METHOD_HEAD) {
+        c->filelen = 0;
+        c->nranges = 0;
+    }
+    return 1;
+}
+
+/* Replace the already sent reply with the header of the next part of a
+ * multipart/byteranges reply, and setup the file range to send after it. */
+static void srvNextRange(srvclient *c) {
+    sdsclear(c->reply);
+    c->reply = srvRangePartHeader(c->reply,c,c->rangeidx);
+    c->replypos = 0;
+    if (c->rangeidx < c->nranges) {
+        c->fileoff = c->ranges[c->rangeidx].start;
+        c->filelen = c->ranges[c->rangeidx].end+1;
+    }
+    c->rangeidx++;
+}
+
+/* Return true if a conditional request for the file with stat 'st' can
+ * be answered with 304, setting '*vst' and '*gzip' to the variant whose
+ * validators to send. The validators of every variant the client may
+ * have are accepted, so that no variant needs to be compressed just to
+ * compute its ETag. */
+static int srvFileNotModified(srvclient *c, struct stat *st, int gzfd,
+                              struct stat *gzst, char *ctype,
+                              struct stat **vst, int *gzip)
+{
+    reqinfo *ri = &c->ri;
+    time_t mtime = st->st_mtime;
+
+    if (!S_ISREG(st->st_mode) || (!ri->ifnonematch && ri->ifmodsince == -1))
+        return 0;
+    *vst = st;
+    *gzip = 0;
+    if (ri->acceptgzip && gzfd != -1) {
+        /* Precompressed sibling */
+        *vst = gzst;
+        *gzip = 1;
+        if (srvNotModified(ri,gzst,1,mtime)) return 1;
+        *vst = st;
+        *gzip = 0;
+    } else if (ri->acceptgzip && conf.gzip && gzCompressible(ctype)) {
+        /* Compressed on the fly: a cached variant tells if the file
+         * compresses, otherwise assume it does. */
+        rcentry *ge = rcLookup(&gzc,ri->file,st);
+
+        *gzip = ge ? ge->fd != -1 : gzOnTheFly(st);
+        if (srvNotModified(ri,st,*gzip,mtime)) return 1;
+        *gzip = 0;
+    }
+    return srvNotModified(ri,st,0,mtime);
+}
+
+/* Setup the reply for a regular file, sending a compressed variant if the
+ * client accepts it. 'hdr' is the header used for the uncompressed file.
+ * If 'fe' is not NULL the files belong to the cache entry, otherwise to
+ * the client, that closes the ones it does not need. The preconditions
+ * are evaluated first: a 304 ignores Range and needs no body work. */
+static void srvReplyFile(srvclient *c, fcentry *fe, int fd, struct stat *st,
+                         int gzfd, struct stat *gzst, char *ctype, char *hdr)
+{
+    reqinfo *ri = &c->ri;
+    rcentry *ge = NULL;
+    struct stat *vst = st; /* stat of the file the content comes from */
+    off_t len = st->st_size;
+    int vary = gzfd != -1 || (conf.gzip && gzCompressible(ctype));
+    int gzip;
+
+    if (fe) {
+        fe->refcount++;
+        c->fe = fe;
+    }
+    if (srvFileNotModified(c,st,gzfd,gzst,ctype,&vst,&gzip)) {
+        /* The client copy is still valid, no body */
+        if (!fe) {
+            close(fd);
+            if (gzfd != -1) close(gzfd);
+        }
+        c->reply = createHttpReplyStatus(c->reply,ri,"304","Not Modified");
+        if (vary) c->reply = sdscat(c->reply,"Vary: Accept-Encoding\r\n");
+        c->reply = catHttpValidators(c->reply,vst,gzip,st->st_mtime);
+        c->reply = sdscat(c->reply,"\r\n");
+        c->filelen = 0;
+        conf.wstats->notmodified++;
+        return;
+    }
+    vst = st;
+    /* Ranges always refer to the uncompressed file */
+    if (ri->range && S_ISREG(st->st_mode) && srvReplyRanges(c,st,ctype,vary)) {
+        if (!fe && gzfd != -1) close(gzfd);
+        c->filefd = fd;
+        return;
+    }
+    if (ri->acceptgzip && gzfd != -1) {
+        /* Precompressed sibling */
+        if (!fe) close(fd);
+        fd = gzfd;
+        len = gzst->st_size;
+        vst = gzst;
+        hdr = NULL;
+    } else {
+        if (!fe && gzfd != -1) close(gzfd);
+        if (ri->acceptgzip && conf.gzip && S_ISREG(st->st_mode) &&
+            gzCompressible(ctype) && (ge = gzGet(ri->file,fd,st)) != NULL &&
+            ge->fd != -1)
+        {
+            if (!fe) close(fd);
+            ge->refcount++;
+            c->re = ge;
+            fd = ge->fd;
+            len = ge->len;
+            hdr = NULL;
+        }
+    }
+    c->filefd = fd;
+    c->fileoff = 0;
+    c->reply = createHttpReplyStatus(c->reply,ri,"200","OK");
+    if (hdr)
+        c->reply = sdscatlen(c->reply,hdr,sdslen(hdr));
+    else
+        c->reply = srvFileHeader(c->reply,ctype,len,vst,st->st_mtime,
+            WBOX_HDR_GZIP|WBOX_HDR_VARY|WBOX_HDR_VALIDATORS);
+    c->filelen = (ri->method == WBOX_REQ_METHOD_HEAD) ? 0 : len;
+}
+
+/* Setup the reply for a directory listing: the cached one if still valid,
+ * otherwise the listing is rendered while it is sent. */
+static void srvReplyDir(srvclient *c, char *fullpath, struct stat *st) {
+    reqinfo *ri = &c->ri;
+    rcentry *e;
+    int fd;
+
+    if (dlc.max && (e = rcLookup(&dlc,ri->file,st)) != NULL) {
+        conf.wstats->dirhits++;
+        e->refcount++;
+        c->re = e;
+        c->reply = createHttpReply(c->reply,ri,"200","OK","text/html",
+            e->len);
+        c->filefd = e->fd;
+        c->fileoff = 0;
+        c->filelen = e->len;
+        return;
+    }
+    fd = open(fullpath,O_RDONLY|O_DIRECTORY);
+    if (fd == -1 || (c->dl = dlCreate(fd,st,ri->file)) == NULL) {
+        if (fd != -1) close(fd);
+        c->reply = createHttpReply(c->reply,ri,"403","Forbidden",
+            "text/html",0);
+        return;
+    }
+    conf.wstats->dirrendered++;
+    /* The length is not known in advance: HTTP/1.1 clients get the
+     * chunked encoding, HTTP/1.0 ones just see the connection closed. */
+    if (ri->protover == 11) c->chunked = 1; else ri->keepalive = 0;
+    c->reply = createHttpReplyStatus(c->reply,ri,"200","OK");
+    if (c->chunked)
+        c->reply = sdscat(c->reply,"Transfer-Encoding: chunked\r\n");
+    c->reply = catHttpReplyContent(c->reply,"text/html",-1);
+    if (ri->method == WBOX_REQ_METHOD_HEAD) {
+        dlFree(c->dl);
+        c->dl = NULL;
+    }
+}
+
+/* Replace the already sent reply with the next part of the listing. */
+static void srvNextDirChunk(srvclient *c) {
+    char *b = dlRender(c->dl,sdsnew(""));
+    int done = c->dl->pass == -1;
+
+    if (c->chunked) {
+        sdsclear(c->reply);
+        if (sdslen(b)) {
+            char size[32];
+
+            c->reply = sdscatlen(c->reply,size,snprintf(size,sizeof(size),
+                "%lx\r\n",(unsigned long)sdslen(b)));
+        }
+        c->reply = sdscatlen(c->reply,b,sdslen(b));
+        if (sdslen(b)) c->reply = sdscatlen(c->reply,"\r\n",2);
+        if (done) c->reply = sdscat(c->reply,"0\r\n\r\n");
+        sdsfree(b);
+    } else {
+        sdsfree(c->reply);
+        c->reply = b;
+    }
+    c->replypos = 0;
+    if (done) {
+        dlFree(c->dl);
+        c->dl = NULL;
+    }
+}
+
+/* Reply with the content of 'fd', whose length is not known in advance:
+ * files in /proc and /sys report a zero size, and pipes have none. The
+ * content is sent as it is read, with the chunked encoding for HTTP/1.1
+ * clients, while HTTP/1.0 ones see the connection closed at the end. */
+static void srvReplyStream(srvclient *c, int fd, char *ctype) {
+    reqinfo *ri = &c->ri;
+
+    if (ri->protover == 11) c->chunked = 1; else ri->keepalive = 0;
+    c->reply = createHttpReplyStatus(c->reply,ri,"200","OK");
+    if (c->chunked)
+        c->reply = sdscat(c->reply,"Transfer-Encoding: chunked\r\n");
+    c->reply = catHttpReplyContent(c->reply,ctype,-1);
+    if (ri->method == WBOX_REQ_METHOD_HEAD)
+        close(fd);
+    else
+        c->streamfd = fd;
+}
+
+/* Zero sized regular files may really be empty, or be files of /proc and
+ * /sys, generated when read. */
+static int srvFileHasData(int fd) {
+    char byte;
+
+    return pread(fd,&byte,1,0) == 1;
+}
+
+/* The pipe we were waiting for has data (or was closed) */
+static void srvStreamReadHandler(evLoop *el, int fd, void *privdata,
+                                 int mask)
+{
+    srvclient *c = privdata;
+    WBOX_NOTUSED(mask);
+
+    evDeleteFileEvent(el,fd,EV_READABLE);
+    if (evCreateFileEvent(el,c->fd,EV_WRITABLE,srvWriteHandler,c) == EV_ERR)
+        srvFreeClient(c);
+}
+
+/* Replace the already sent reply with the next data read from the
+ * stream. Returns 1 if there is something to send (the last chunk
+ * included), 0 if the stream is a pipe with no data available now, in
+ * which case the client will be woken up when there is, or -1 on read
+ * errors. */
+static int srvNextStreamChunk(srvclient *c) {
+    static char buf[WBOX_COPY_CHUNK];
+    ssize_t nread = read(c->streamfd,buf,sizeof(buf));
+
+    if (nread == -1) {
+        if (errno == EINTR) return 1; /* nothing new, read again */
+        if (errno != EAGAIN) return -1;
+        evDeleteFileEvent(conf.el,c->fd,EV_WRITABLE);
+        if (evCreateFileEvent(conf.el,c->streamfd,EV_READABLE,
+                srvStreamReadHandler,c) == EV_ERR) return -1;
+        return 0;
+    }
+    sdsclear(c->reply);
+    c->replypos = 0;
+    if (c->chunked && nread) {
+        char size[32];
+
+        c->reply = sdscatlen(c->reply,size,snprintf(size,sizeof(size),
+            "%lx\r\n",(unsigned long)nread));
+    }
+    c->reply = sdscatlen(c->reply,buf,nread);
+    if (c->chunked && nread) c->reply = sdscatlen(c->reply,"\r\n",2);
+    if (nread == 0) {
+        if (c->chunked) c->reply = sdscat(c->reply,"0\r\n\r\n");
+        close(c->streamfd);
+        c->streamfd = -1;
+    }
+    return 1;
+}
+
+/* Create the reply for the request in c->ri: after this function returns
+ * c->reply is ready to be sent, and c->filefd is set if a file should be
+ * sent after the reply. */
+static void srvPreparePage(srvclient *c);
+static srvbind *srvLookupBind(char *path);
+static void srvReplyBind(srvclient *c, srvbind *b);
+static int srvReplyStats(srvclient *c);
+
+static void srvPrepareReply(srvclient *c) {
+    reqinfo *ri = &c->ri;
+    char *fullpath;
+    struct stat sbuf;
+    fcentry *fe;
+    srvbind *b;
+
+    if (conf.statsurl && srvReplyStats(c)) return;
+    if (conf.servertest) {
+        srvPreparePage(c);
+        return;
+    }
+    if (conf.nbinds && (b = srvLookupBind(ri->file)) != NULL) {
+        srvReplyBind(c,b);
+        return;
+    }
+    /* Fast path: file already in the cache */
+    if ((fe = fcLookup(ri->file)) != NULL) {
+        srvReplyFile(c,fe,fe->fd,&fe->st,fe->gzfd,&fe->gzst,fe->ctype,
+            fe->hdr);
+        return;
+    }
+    /* Create the full path of the resource */
+    fullpath = createFullPath(conf.webroot, ri->file);
+    /* Generate the reply */
+    if (access(fullpath,R_OK) == -1 || stat(fullpath,&sbuf) == -1) {
+        /* 404 */
+        char *body = sdsnew(htmlheader);
+
+        if (!conf.silent)
+            printf("%s:%d 404: %s\n", c->ip, c->port, fullpath);
+        body = sdscat(body, "<h1>404 Not Found</h1>");
+        body = sdscatprintf(body, "<h2>");
+        body = sdscatentities(body,ri->file);
+        body = sdscat(body," was not found on this server</h2>");
+        body = sdscat(body, htmlfooter);
+        c->reply = createHttpReply(c->reply,ri,"404","Not Found",
+            "text/html",sdslen(body));
+        c->reply = sdscatlen(c->reply,body,sdslen(body));
+        sdsfree(body);
+    } else if (S_ISDIR(sbuf.st_mode)) {
+        srvReplyDir(c,fullpath,&sbuf);
+    } else {
+        /* Regular file */
+        char *ctype = guessContentType(ri->file);
+        int fd, gzfd = -1;
+        struct stat gzsbuf;
+
+        /* Opening a pipe with no writer would block */
+        fd = open(fullpath,O_RDONLY|(S_ISFIFO(sbuf.st_mode) ? O_NONBLOCK:0));
+        if (fd != -1 && fstat(fd,&sbuf) == -1) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1) {
+            c->reply = createHttpReply(c->reply,ri,"403","Forbidden",
+                "text/html",0);
+        } else if (S_ISFIFO(sbuf.st_mode) ||
+                   (S_ISREG(sbuf.st_mode) && sbuf.st_size == 0 &&
+                    srvFileHasData(fd)))
+        {
+            srvReplyStream(c,fd,ctype);
+        } else {
+            char *hdr;
+
+            if (S_ISREG(sbuf.st_mode)) {
+                char *gzpath = sdscat(sdsdup(fullpath),".gz");
+
+                gzfd = open(gzpath,O_RDONLY);
+                if (gzfd != -1 && (fstat(gzfd,&gzsbuf) == -1 ||
+                                   !S_ISREG(gzsbuf.st_mode)))
+                {
+                    close(gzfd);
+                    gzfd = -1;
+                }
+                sdsfree(gzpath);
+            }
+            hdr = srvFileHeader(sdsnew(""),ctype,sbuf.st_size,&sbuf,
+                sbuf.st_mtime,
+                (S_ISREG(sbuf.st_mode) ?
+                 WBOX_HDR_RANGES|WBOX_HDR_VALIDATORS : 0) |
+                ((gzfd != -1 || (conf.gzip && gzCompressible(ctype))) ?
+                 WBOX_HDR_VARY : 0));
+            if (S_ISREG(sbuf.st_mode) &&
+                (fe = fcAdd(ri->file,fullpath,fd,&sbuf,gzfd,&gzsbuf,ctype,
+                            hdr)) != NULL)
+            {
+                srvReplyFile(c,fe,fd,&sbuf,gzfd,&gzsbuf,ctype,hdr);
+            } else {
+                srvReplyFile(c,NULL,fd,&sbuf,gzfd,&gzsbuf,ctype,hdr);
+                sdsfree(hdr);
+            }
+        }
+    }
+    if (ri->method == WBOX_REQ_METHOD_HEAD) {
+        /* Just the header */
+        char *p = strstr(c->reply,"\r\n\r\n");
+        if (p) sdsrange(c->reply,0,(p-c->reply)+3);
+        c->filelen = 0;
+    }
+    sdsfree(fullpath);
+}
+
+/* Return the length of the request header at the start of 'buf', that
+ * holds 'len' bytes, including the final empty line, or 0 if not yet
+ * complete. The search resumes from '*scanpos', updated so that every
+ * byte is examined once even if the header arrives in many reads. */
+static size_t srvHeaderLen(char *buf, size_t len, size_t *scanpos) {
+    char *p = buf+*scanpos, *end = buf+len, *nl;
+
+    while((nl = memchr(p,'\n',end-p)) != NULL) {
+        p = nl+1;
+        /* A line feed followed by an empty line */
+        if (p < end && *p == '\n') return (p-buf)+1;
+        if (p+1 < end && p[0] == '\r' && p[1] == '\n') return (p-buf)+2;
+        if (p == end || (p+1 == end && *p == '\r')) {
+            /* Can't tell yet: resume from this line feed */
+            *scanpos = nl-buf;
+            return 0;
+        }
+    }
+    *scanpos = len;
+    return 0;
+}
+
+static int srvWriteReply(srvclient *c);
+static void srvResetClient(srvclient *c);
+
+/* Serve the requests already in the query buffer, one after the other,
+ * as long as the replies can be sent without blocking. */
+static void srvProcessInput(srvclient *c) {
+    while(c->state == WBOX_SRV_READREQ) {
+        char *req = c->querybuf+c->qpos;
+        size_t avail = sdslen(c->querybuf)-c->qpos;
+        int retval;
+
+        /* Skip the body of the previous request, nobody is interested */
+        if (c->bodyleft) {
+            size_t skip = (long long)avail < c->bodyleft ?
+                          avail : (size_t)c->bodyleft;
+
+            c->qpos += skip;
+            c->bodyleft -= skip;
+            if (c->bodyleft) break;
+            continue;
+        }
+        /* Ignore the empty lines before the request line (RFC 9112 2.2),
+         * like the CRLF some clients send after a POST body. */
+        while(avail && c->scanpos == 0 && (*req == '\r' || *req == '\n')) {
+            req++;
+            avail--;
+            c->qpos++;
+        }
+        /* Wait for the end of the header, that may not be at the end of
+         * the buffer if the client already sent something more. */
+        if ((c->reqlen = srvHeaderLen(req,avail,&c->scanpos)) == 0) {
+            if (avail > WBOX_MAX_REQUEST_LEN) {
+                if (!conf.silent)
+                    printf("%s:%d request too long\n", c->ip, c->port);
+                srvFreeClient(c);
+                return;
+            }
+            break;
+        }
+        /* Parse it */
+        if (parseRequest(req,c->reqlen,&c->ri)) {
+            if (!conf.silent)
+                printf("%s:%d bad request\n", c->ip, c->port);
+            srvFreeClient(c);
+            return;
+        }
+        /* A body of unknown length is not read, so we can't find where
+         * the next request starts: close the connection after the reply.
+         * Bodies with a Content-Length are discarded. */
+        c->reqparsed = microseconds();
+        c->sent = 0;
+        c->requests++;
+        if (c->requests >= conf.keepalivemax || c->ri.hasbody)
+            c->ri.keepalive = 0;
+        if (conf.iprate && !srvIpAllowRequest(c)) {
+            conf.wstats->iplimited++;
+            c->ri.keepalive = 0;
+            c->reply = sdscatlen(c->reply,srvreply429,
+                sizeof(srvreply429)-1);
+        } else {
+            srvPrepareReply(c);
+        }
+        /* Every reply starts with "HTTP/1.x <code>" */
+        c->status = c->page ? 200 : atoi(c->reply+9);
+        conf.wstats->requests++;
+        /* Send the reply ASAP, most of the times there is no need to wait
+         * for the socket to be writable. */
+        c->state = WBOX_SRV_WRITEREPLY;
+        if (conf.ndelays && c->status != 429 && srvDelayReply(c)) {
+            evDeleteFileEvent(conf.el,c->fd,EV_READABLE);
+            srvUpdateTimer(c);
+            return;
+        }
+        if (conf.ring && srvRingReply(c)) return; /* see srvRingSent() */
+        retval = srvWriteReply(c);
+        if (retval == -1) return; /* client freed */
+        if (retval == 0) {
+            /* Don't read more requests until this reply is sent */
+            evDeleteFileEvent(conf.el,c->fd,EV_READABLE);
+            if (evCreateFileEvent(conf.el,c->fd,EV_WRITABLE,
+                    srvWriteHandler,c) == EV_ERR)
+                srvFreeClient(c);
+            else
+                srvUpdateTimer(c);
+            return;
+        }
+        if (!c->ri.keepalive) {
+            srvFreeClient(c);
+            return;
+        }
+        srvResetClient(c);
+    }
+    /* The ring got an EOF while we were replying: the requests that were
+     * already received were served, there is nothing more to read. */
+    if (c->state == WBOX_SRV_READREQ && c->recveof) {
+        if (!conf.silent) printf("%s:%d EOF from client\n",c->ip,c->port);
+        srvFreeClient(c);
+    }
+}
+
+/* Append 'len' bytes received from the client and serve the requests */
+static void srvInput(srvclient *c, char *buf, size_t len) {
+    c->lastio = milliseconds();
+    /* Drop the requests already served before appending more data */
+    if (c->qpos) {
+        sdsrange(c->querybuf,c->qpos,-1);
+        c->qpos = 0;
+    }
+    if (sdslen(c->querybuf) == 0 && !c->bodyleft) c->reqstart = c->lastio;
+    c->querybuf = sdscatlen(c->querybuf,buf,len);
+    srvUpdateTimer(c);
+    srvProcessInput(c);
+}
+
+static void srvReadHandler(evLoop *el, int fd, void *privdata, int mask) {
+    srvclient *c = privdata;
+    char buf[WBOX_RECV_BUF];
+    int nread;
+    WBOX_NOTUSED(el);
+    WBOX_NOTUSED(mask);
+
+    nread = read(fd,buf,WBOX_RECV_BUF);
+    if (nread == -1) {
+        if (errno == EAGAIN || errno == EINTR) return;
+        if (!conf.silent)
+            printf("%s:%d reading: %s\n", c->ip, c->port, strerror(errno));
+        srvFreeClient(c);
+        return;
+    } else if (nread == 0) {
+        if (!conf.silent) printf("%s:%d EOF from client\n",c->ip,c->port);
+        srvFreeClient(c);
+        return;
+    }
+    srvInput(c,buf,nread);
+}
+
+/* Prepare the client for the next request on the same connection. The
+ * served request is just skipped in the query buffer, that is emptied
+ * when all the data was consumed. */
+static void srvResetClient(srvclient *c) {
+    c->bodyleft = c->ri.bodylen;
+    srvFreeReply(c);
+    c->qpos += c->reqlen;
+    if (c->qpos == sdslen(c->querybuf)) {
+        sdsclear(c->querybuf);
+        c->qpos = 0;
+    }
+    c->reqlen = c->scanpos = 0;
+    c->state = WBOX_SRV_READREQ;
+    c->reqstart = milliseconds();
+    if (conf.ring) {
+        /* Take what the ring received meanwhile. If the receive can't be
+         * started again the client just times out. */
+        if (sdslen(c->ringin)) {
+            c->querybuf = sdscatlen(c->querybuf,c->ringin,
+                sdslen(c->ringin));
+            sdsclear(c->ringin);
+        }
+        srvRingRecvArm(c);
+    }
+    srvUpdateTimer(c);
+}
+
+/* Send file data to the client without copying it in user space when
+ * possible: sendfile() is used if the file supports it, otherwise splice()
+ * through a pipe, and only as last resort pread() + write().
+ * Returns the number of bytes sent, 0 if the file is shorter than
+ * expected, or -1 on error (EAGAIN means the socket buffer is full). */
+static ssize_t srvSendFile(srvclient *c, size_t max) {
+    static char buf[WBOX_COPY_CHUNK];
+    off_t len = c->filelen-c->fileoff;
+    ssize_t nread, nwritten;
+
+    if (len > (off_t)max) len = max;
+#ifdef __linux__
+    if (c->sendmode == WBOX_SEND_SENDFILE) {
+        off_t off = c->fileoff;
+
+        nwritten = sendfile(c->fd,c->filefd,&off,len);
+        if (nwritten != -1 || (errno != EINVAL && errno != ENOSYS))
+            return nwritten;
+        c->sendmode = WBOX_SEND_SPLICE;
+    }
+    if (c->sendmode == WBOX_SEND_SPLICE) {
+        if (c->pipefd[0] == -1) {
+            if (pipe(c->pipefd) == -1) {
+                c->pipefd[0] = c->pipefd[1] = -1;
+                c->sendmode = WBOX_SEND_COPY;
+                goto copy;
+            }
+            fcntl(c->pipefd[1],F_SETPIPE_SZ,WBOX_COPY_CHUNK*16);
+        }
+        /* Fill the pipe if empty. Data left in the pipe after a partial
+         * write to the socket is sent the next time. */
+        if (c->pipelen == 0) {
+            loff_t off = c->fileoff;
+
+            nread = splice(c->filefd,&off,c->pipefd[1],NULL,len,
+                SPLICE_F_MOVE);
+            if (nread == -1 && errno == EINVAL) {
+                c->sendmode = WBOX_SEND_COPY;
+                goto copy;
+            }
+            if (nread <= 0) return nread;
+            c->pipelen = nread;
+        }
+        nwritten = splice(c->pipefd[0],NULL,c->fd,NULL,
+            (size_t)len < c->pipelen ? (size_t)len : c->pipelen,
+            SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if (nwritten > 0) c->pipelen -= nwritten;
+        return nwritten;
+    }
+copy:
+#endif
+    if (len > WBOX_COPY_CHUNK) len = WBOX_COPY_CHUNK;
+    nread = pread(c->filefd,buf,len,c->fileoff);
+    if (nread <= 0) return nread;
+    /* If the write is partial the rest will be read again the next
+     * time, so no buffer is needed per client. */
+    return write(c->fd,buf,nread);
+}
+
+/* Send what we can of the reply. Returns 1 if the reply was sent
+ * completely, 0 if the socket buffer is full, or -1 if there was an
+ * error and the client was freed. */
+static int srvWritePage(srvclient *c);
+static void srvReplySent(srvclient *c);
+
+static int srvWriteReply(srvclient *c) {
+    int fd = c->fd;
+    ssize_t nwritten;
+
+    if (twPending(&c->wake)) {
+        /* Paused, see srvPause() */
+        evDeleteFileEvent(conf.el,fd,EV_WRITABLE);
+        return 0;
+    }
+    if (c->page) return srvWritePage(c);
+    while(1) {
+        if (c->replypos < sdslen(c->reply)) {
+            size_t len = sdslen(c->reply)-c->replypos;
+
+            if (conf.shaping && (len = srvShape(c,len)) == 0) return 0;
+            /* If a file follows, let the kernel merge the header with the
+             * first part of the file. */
+            nwritten = send(fd,c->reply+c->replypos,len,
+                            (c->fileoff < c->filelen) ? MSG_MORE : 0);
+            if (nwritten == -1) goto writeerr;
+            if (conf.shaping) srvShapeSent(c,nwritten);
+            c->lastio = milliseconds();
+            c->replypos += nwritten;
+            c->sent += nwritten;
+            conf.wstats->bytes += nwritten;
+            if (c->replypos < sdslen(c->reply)) return 0;
+        }
+        if (c->filefd != -1 && c->fileoff < c->filelen) {
+            size_t max = WBOX_SEND_CHUNK;
+
+            if (conf.shaping && (max = srvShape(c,max)) == 0) return 0;
+            nwritten = srvSendFile(c,max);
+            if (nwritten == 0 || (nwritten == -1 && errno == EIO)) {
+                /* File truncated or I/O error, we can just close the
+                 * connection since the length was already sent. */
+                if (!conf.silent)
+                    printf("%s:%d read error\n", c->ip, c->port);
+                srvFreeClient(c);
+                return -1;
+            }
+            if (nwritten == -1) goto writeerr;
+            if (conf.shaping) srvShapeSent(c,nwritten);
+            c->lastio = milliseconds();
+            c->fileoff += nwritten;
+            c->sent += nwritten;
+            conf.wstats->bytes += nwritten;
+            if (c->fileoff < c->filelen) return 0;
+        }
+        /* Directory listings are rendered as the socket accepts data,
+         * byte ranges are sent one part after the other, and content of
+         * unknown length as it is read. */
+        if (c->dl) {
+            srvNextDirChunk(c);
+        } else if (c->rangeidx < c->nranges+(c->nranges != 0)) {
+            srvNextRange(c);
+        } else if (c->streamfd != -1) {
+            int retval = srvNextStreamChunk(c);
+
+            if (retval == 0) return 0;
+            if (retval == -1) {
+                if (!conf.silent)
+                    printf("%s:%d read error\n", c->ip, c->port);
+                srvFreeClient(c);
+                return -1;
+            }
+        } else if (c->bind) {
+            /* Nothing to send until the command outputs something more,
+             * see srvBindAppend(). */
+            evDeleteFileEvent(conf.el,fd,EV_WRITABLE);
+            return 0;
+        } else {
+            break;
+        }
+    }
+    srvReplySent(c);
+    if (!conf.silent)
+        printf("%s:%d served with success\n", c->ip, c->port);
+    return 1;
+
+writeerr:
+    if (errno == EAGAIN || errno == EINTR) return 0;
+    if (!conf.silent)
+        printf("%s:%d write error\n", c->ip, c->port);
+    srvFreeClient(c);
+    return -1;
+}
+
+/* The reply was sent: close the connection, or serve the next request */
+static void srvNextRequest(srvclient *c) {
+    if (!c->ri.keepalive) {
+        srvFreeClient(c);
+        return;
+    }
+    srvResetClient(c);
+    srvProcessInput(c);
+}
+
+static void srvWriteHandler(evLoop *el, int fd, void *privdata, int mask) {
+    srvclient *c = privdata;
+    WBOX_NOTUSED(mask);
+
+    if (srvWriteReply(c) != 1) return;
+    if (c->ri.keepalive) {
+        /* Back to reading requests, the ring receives them anyway */
+        evDeleteFileEvent(el,fd,EV_WRITABLE);
+        if (!conf.ring &&
+            evCreateFileEvent(el,fd,EV_READABLE,srvReadHandler,c) == EV_ERR)
+        {
+            srvFreeClient(c);
+            return;
+        }
+    }
+    srvNextRequest(c);
+}
+
+/* Setup a client for the new non blocking socket 'cfd', or close it if
+ * the client can't be served. */
+static void srvNewClient(int cfd, char *clientip, int clientport) {
+    srvclient *c;
+    ipentry *ipe = NULL;
+
+    if (conf.activeclients >= conf.maxclients) {
+        conf.wstats->rejected++;
+        if (!conf.silent)
+            printf("%s:%d closing connection! max number of clients reached (tune this using the maxclients <number> option)\n",clientip,clientport);
+        close(cfd);
+        return;
+    }
+    if (iptable && !srvIpAccept(clientip,&ipe)) {
+        static char buf[WBOX_RECV_BUF];
+
+        conf.wstats->iprejected++;
+        if (!conf.silent)
+            printf("%s:%d closing connection, too many connections "
+                   "from this IP (ipconnmax)\n",clientip,clientport);
+        /* Consume the request if already here, so that the close
+         * does not reset the connection before the reply is read. */
+        recv(cfd,buf,sizeof(buf),MSG_DONTWAIT);
+        send(cfd,srvreply503,sizeof(srvreply503)-1,
+            MSG_DONTWAIT|MSG_NOSIGNAL);
+        close(cfd);
+        return;
+    }
+    if ((c = malloc(sizeof(*c))) == NULL) {
+        if (ipe) ipe->conns--;
+        close(cfd);
+        return;
+    }
+    c->ipe = ipe;
+    c->fd = cfd;
+    c->state = WBOX_SRV_READREQ;
+    memcpy(c->ip,clientip,sizeof(c->ip));
+    c->port = clientport;
+    c->querybuf = sdsnew("");
+    c->qpos = c->reqlen = c->scanpos = 0;
+    c->bodyleft = 0;
+    c->requests = 0;
+    c->lastio = c->reqstart = milliseconds();
+    twInitTimer(&c->timer);
+    twInitTimer(&c->wake);
+    if (conf.bwconn) tbInit(&c->bw,conf.bwconn,WBOX_SHAPE_BURST_MS);
+    initReqInfo(&c->ri);
+    c->reply = srvCreateReplyBuffer();
+    c->replypos = 0;
+    c->filefd = -1;
+    c->fileoff = c->filelen = 0;
+    c->fe = NULL;
+    c->re = NULL;
+    c->dl = NULL;
+    c->chunked = 0;
+    c->streamfd = -1;
+    c->ranges = NULL;
+    c->nranges = c->rangeidx = 0;
+    c->page = NULL;
+    c->bind = NULL;
+    c->sendmode = WBOX_SEND_SENDFILE;
+    c->pipefd[0] = c->pipefd[1] = -1;
+    c->pipelen = 0;
+    c->recvop = c->sendop = -1;
+    c->ringin = conf.ring ? sdsnew("") : NULL;
+    c->rb = NULL;
+    c->recveof = c->closing = 0;
+    if (conf.ring ? srvRingRecvArm(c) == -1 :
+        evCreateFileEvent(conf.el,cfd,EV_READABLE,srvReadHandler,c) == EV_ERR)
+    {
+        sdsfree(c->querybuf);
+        sdsfree(c->reply);
+        sdsfree(c->ringin);
+        srvIpRelease(c);
+        free(c);
+        close(cfd);
+        return;
+    }
+    c->prev = NULL;
+    c->next = srvclients;
+    if (srvclients) srvclients->prev = c;
+    srvclients = c;
+    srvUpdateTimer(c);
+    conf.activeclients++;
+    conf.wstats->active = conf.activeclients;
+    conf.wstats->connections++;
+    if (!conf.silent)
+        printf("%s:%d connected\n",clientip,clientport);
+}
+
+static void srvAcceptHandler(evLoop *el, int fd, void *privdata, int mask) {
+    int max = 1000; /* max clients accepted per call */
+    char err[ANET_ERR_LEN];
+    WBOX_NOTUSED(el);
+    WBOX_NOTUSED(privdata);
+    WBOX_NOTUSED(mask);
+
+    while(max--) {
+        char clientip[32];
+        int clientport, cfd;
+
+        cfd = anetAccept(err, fd, clientip, &clientport);
+        if (cfd == ANET_ERR) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "Warning, accepting client: %s\n", err);
+            return;
+        }
+        anetNonBlock(NULL,cfd);
+        srvNewClient(cfd,clientip,clientport);
+    }
+}
+
+static void srvShowRate(void);
+static void srvRefreshPages(void);
+static int srvCreatePages(void);
+static void srvBindCron(time_t now);
+
+/* Called every second */
+static void srvCron(time_t now) {
+    if (conf.nbinds) srvBindCron(now);
+    if (conf.servertest && !conf.silent && conf.workerid == 0) srvShowRate();
+    /* The ring accept stops on errors, like running out of fds */
+    if (conf.ring && conf.acceptop == -1) srvRingListen();
+}
+
+static volatile sig_atomic_t srvexit; /* signal terminating the worker */
+
+static void srvExitHandler(int signum) {
+    srvexit = signum;
+}
+
+/* Called at exit: write the access log lines still in the ring */
+static void srvCloseAccessLog(void) {
+    if (conf.alog) alogClose(conf.alog);
+    conf.alog = NULL;
+}
+
+/* Run the server event loop of worker 'id', listening on 'fd' */
+static void srvWorker(int id, int fd) {
+    time_t lastcron = 0;
+
+    conf.workerid = id;
+    conf.wstats = &conf.stats[id];
+    conf.serverfd = fd;
+#ifdef __linux__
+    if (conf.workers > 1 && !conf.nopin) {
+        cpu_set_t set;
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+        CPU_ZERO(&set);
+        CPU_SET(ncpu > 0 ? id % ncpu : 0, &set);
+        if (sched_setaffinity(0,sizeof(set),&set) == -1)
+            fprintf(stderr,"Warning: can't pin worker %d to a CPU: %s\n",
+                id, strerror(errno));
+    }
+#endif
+    anetNonBlock(NULL,conf.serverfd);
+    evUseUring(conf.uring);
+    conf.el = evCreateLoop(adjustOpenFilesLimit(conf.maxclients*2+
+                                         conf.fcachemax+conf.bindmax+32));
+    conf.ring = conf.el && evHasOps(conf.el);
+    if (conf.el == NULL || (conf.ring ? srvRingListen() == -1 :
+        evCreateFileEvent(conf.el,conf.serverfd,EV_READABLE,
+            srvAcceptHandler,NULL) == EV_ERR))
+    {
+        fprintf(stderr, "Creating the event loop: %s\n", strerror(errno));
+        exit(WBOX_EXIT_IO);
+    }
+    if (conf.uring && id == 0 && strcmp(evGetApiName(),"io_uring"))
+        fprintf(stderr, "Warning: io_uring not available, using %s\n",
+            evGetApiName());
+    twInit(&conf.timers,milliseconds()/WBOX_TIMER_MS);
+    twInit(&conf.wakes,milliseconds()/WBOX_TIMER_MS);
+    if (conf.bwtotal)
+        tbInit(&conf.bwall,(conf.bwtotal+conf.workers-1)/conf.workers,
+            WBOX_SHAPE_BURST_MS);
+    if (!conf.servertest) fcInit();
+    gzc.max = conf.gzcachemax;
+    dlc.max = conf.dircachemax;
+    srand(time(NULL)^getpid());
+    if ((conf.ipconnmax || conf.iprate) &&
+        (iptable = calloc(WBOX_IPTABLE_SIZE,sizeof(ipentry))) == NULL)
+    {
+        fprintf(stderr, "Out of memory allocating the client IP table\n");
+        exit(WBOX_EXIT_IO);
+    }
+    if (conf.alogfd != -1) {
+        if ((conf.alog = alogCreate(conf.alogfd,WBOX_ALOG_BUF,
+                                    WBOX_ALOG_FLUSH_MS)) == NULL)
+        {
+            fprintf(stderr, "Starting the access log writer: %s\n",
+                strerror(errno));
+            exit(WBOX_EXIT_IO);
+        }
+        /* Exit from the event loop instead of dying on the parent
+         * SIGTERM (or Ctrl+C), so that the lines in the ring are
+         * written. Exiting from the signal handler could deadlock in
+         * alogClose() if the signal interrupted alogWrite(). */
+        atexit(srvCloseAccessLog);
+        Signal(SIGTERM,srvExitHandler);
+        Signal(SIGINT,srvExitHandler);
+    }
+    while(!srvexit) {
+        time_t now;
+
+        /* Paused clients need a finer resolution than the cron */
+        evProcessEvents(conf.el,conf.paused ? WBOX_TIMER_MS : WBOX_CRON_MS);
+        twRun(&conf.timers,milliseconds()/WBOX_TIMER_MS,srvTimerProc);
+        twRun(&conf.wakes,milliseconds()/WBOX_TIMER_MS,srvWakeProc);
+        if ((now = time(NULL)) != lastcron) {
+            lastcron = now;
+            updateHttpDate(now);
+            if (conf.servertest) srvRefreshPages();
+            srvCron(now);
+        }
+    }
+    /* A single worker is also the process reporting the stats */
+    if (srvexit == SIGINT && conf.workers == 1) sigHandler(SIGINT);
+    exit(WBOX_EXIT_SUCCESS);
+}
+
+/* ---------------------------- Server statistics --------------------------- */
+
+/* Status codes counted one by one, the last slot counts all the others */
+static int srvstatus[WBOX_SRV_STATUS] =
+    {200,206,304,403,404,416,429,503,0};
+
+/* Append the access log line of the request of 'c', in the Common Log
+ * Format (the size includes the header) plus the service time in
+ * microseconds. The line is only copied in the ring buffer of the log
+ * writer thread, and dropped if the ring is full, so a slow disk never
+ * blocks the event loop. */
+static void srvLogRequest(srvclient *c, long long svctime) {
+    static char date[32];
+    static time_t datetime = -1;
+    time_t now = c->lastio/1000;
+    char line[WBOX_ALOG_LINE], *req = c->querybuf+c->qpos;
+    size_t reqlen, j;
+    int len;
+
+    if (now != datetime) {
+        struct tm tm;
+
+        gmtime_r(&now,&tm);
+        strftime(date,sizeof(date),"%d/%b/%Y:%H:%M:%S +0000",&tm);
+        datetime = now;
+    }
+    /* The request line, with the characters that would break the log
+     * format replaced. The parser terminated the fields in place, so
+     * null bytes were spaces. */
+    for (reqlen = 0; reqlen < c->reqlen && req[reqlen] != '\n'; reqlen++);
+    while(reqlen && (req[reqlen-1] == '\r' || req[reqlen-1] == '\0'))
+        reqlen--;
+    if (reqlen > WBOX_ALOG_LINE/2) reqlen = WBOX_ALOG_LINE/2;
+    len = snprintf(line,sizeof(line),"%s - - [%s] \"",c->ip,date);
+    for (j = 0; j < reqlen; j++) {
+        if (req[j] == '\0')
+            line[len++] = ' ';
+        else if (req[j] < 32 || req[j] > 126 || req[j] == '"')
+            line[len++] = '?';
+        else
+            line[len++] = req[j];
+    }
+    len += snprintf(line+len,sizeof(line)-len,"\" %d %lld %lld\n",
+        c->status, c->sent, svctime);
+    if (len >= (int)sizeof(line)) len = sizeof(line)-1;
+    if (alogWrite(conf.alog,line,len) == -1)
+        conf.wstats->logdropped++;
+    else
+        conf.wstats->loglines++;
+}
+
+/* Account the reply just sent completely */
+static void srvReplySent(srvclient *c) {
+    long long svctime = microseconds()-c->reqparsed;
+    int j;
+
+    for (j = 0; j < WBOX_SRV_STATUS-1 && srvstatus[j] != c->status; j++);
+    conf.wstats->status[j]++;
+    histAdd(&conf.wstats->svctime,svctime);
+    if (conf.alog) srvLogRequest(c,svctime);
+}
+
+/* Add the statistics of a worker to 'tot'. The slots are updated by the
+ * workers without any lock, so a snapshot may be slightly inconsistent. */
+static void srvAddStats(srvstats *tot, srvstats *st) {
+    int j;
+
+    tot->connections += st->connections;
+    tot->rejected += st->rejected;
+    tot->requests += st->requests;
+    tot->bytes += st->bytes;
+    tot->active += st->active;
+    tot->timedout += st->timedout;
+    tot->tohdr += st->tohdr;
+    tot->tobody += st->tobody;
+    tot->tosend += st->tosend;
+    tot->notmodified += st->notmodified;
+    tot->fchits += st->fchits;
+    tot->fcmisses += st->fcmisses;
+    tot->fcinvalidated += st->fcinvalidated;
+    tot->gzhits += st->gzhits;
+    tot->gzcompressed += st->gzcompressed;
+    tot->dirhits += st->dirhits;
+    tot->dirrendered += st->dirrendered;
+    tot->bindhits += st->bindhits;
+    tot->bindexecs += st->bindexecs;
+    tot->loglines += st->loglines;
+    tot->logdropped += st->logdropped;
+    tot->iprejected += st->iprejected;
+    tot->iplimited += st->iplimited;
+    for (j = 0; j < WBOX_SRV_STATUS; j++) tot->status[j] += st->status[j];
+    histMerge(&tot->svctime,&st->svctime);
+}
+
+/* Append the statistics 'st' in the plain text format, every line is
+ * "<prefix><name> <value>". */
+static char *srvCatStatsText(char *r, char *prefix, srvstats *st) {
+    int j;
+
+    r = sdscatprintf(r,"%sconnections %lld\n%sactive %lld\n"
+                       "%srejected %lld\n%stimedout %lld\n"
+                       "%srequests %lld\n%sbytes %lld\n",
+        prefix, st->connections, prefix, st->active, prefix, st->rejected,
+        prefix, st->timedout, prefix, st->requests, prefix, st->bytes);
+    for (j = 0; j < WBOX_SRV_STATUS; j++) {
+        if (srvstatus[j])
+            r = sdscatprintf(r,"%sstatus_%d %lld\n", prefix, srvstatus[j],
+                st->status[j]);
+        else
+            r = sdscatprintf(r,"%sstatus_other %lld\n", prefix,
+                st->status[j]);
+    }
+    r = sdscatprintf(r,"%ssvctime_count %lld\n%ssvctime_sum_us %lld\n"
+                       "%ssvctime_min_us %lld\n%ssvctime_max_us %lld\n"
+                       "%ssvctime_p50_us %lld\n%ssvctime_p90_us %lld\n"
+                       "%ssvctime_p99_us %lld\n%ssvctime_p999_us %lld\n",
+        prefix, st->svctime.count, prefix, st->svctime.sum,
+        prefix, st->svctime.min, prefix, st->svctime.max,
+        prefix, histPercentile(&st->svctime,50),
+        prefix, histPercentile(&st->svctime,90),
+        prefix, histPercentile(&st->svctime,99),
+        prefix, histPercentile(&st->svctime,99.9));
+    if (conf.accesslog)
+        r = sdscatprintf(r,"%slog_lines %lld\n%slog_dropped %lld\n",
+            prefix, st->loglines, prefix, st->logdropped);
+    if (conf.ipconnmax || conf.iprate)
+        r = sdscatprintf(r,"%sip_rejected %lld\n%sip_limited %lld\n",
+            prefix, st->iprejected, prefix, st->iplimited);
+    return r;
+}
+
+/* Same as srvCatStatsText() as a JSON object. The histogram is reported
+ * as [<lower bound us>,<count>] pairs of the non empty buckets. */
+static char *srvCatStatsJSON(char *r, srvstats *st) {
+    int j, first = 1;
+
+    r = sdscatprintf(r,"{\"connections\":%lld,\"active\":%lld,"
+                       "\"rejected\":%lld,\"timedout\":%lld,"
+                       "\"requests\":%lld,\"bytes\":%lld,",
+        st->connections, st->active, st->rejected, st->timedout,
+        st->requests, st->bytes);
+    if (conf.accesslog)
+        r = sdscatprintf(r,"\"log_lines\":%lld,\"log_dropped\":%lld,",
+            st->loglines, st->logdropped);
+    if (conf.ipconnmax || conf.iprate)
+        r = sdscatprintf(r,"\"ip_rejected\":%lld,\"ip_limited\":%lld,",
+            st->iprejected, st->iplimited);
+    r = sdscat(r,"\"status\":{");
+    for (j = 0; j < WBOX_SRV_STATUS; j++) {
+        if (srvstatus[j])
+            r = sdscatprintf(r,"\"%d\":%lld,", srvstatus[j], st->status[j]);
+        else
+            r = sdscatprintf(r,"\"other\":%lld", st->status[j]);
+    }
+    r = sdscatprintf(r,"},\"svctime\":{\"count\":%lld,\"sum\":%lld,"
+                       "\"min\":%lld,\"max\":%lld,\"p50\":%lld,"
+                       "\"p90\":%lld,\"p99\":%lld,\"p999\":%lld,"
+                       "\"buckets\":[",
+        st->svctime.count, st->svctime.sum, st->svctime.min,
+        st->svctime.max, histPercentile(&st->svctime,50),
+        histPercentile(&st->svctime,90), histPercentile(&st->svctime,99),
+        histPercentile(&st->svctime,99.9));
+    for (j = 0; j < WBOX_HIST_BUCKETS; j++) {
+        if (st->svctime.bucket[j] == 0) continue;
+        r = sdscatprintf(r,"%s[%lld,%u]", first ? "" : ",",
+            histBucketValue(j), st->svctime.bucket[j]);
+        first = 0;
+    }
+    return sdscat(r,"]}}");
+}
+
+/* Reply with the live statistics of all the workers if the request is
+ * for the statistics URL: plain text, or JSON if ".json" is appended to
+ * the URL. Returns 0 if the request is for something else. */
+static int srvReplyStats(srvclient *c) {
+    reqinfo *ri = &c->ri;
+    size_t len = strlen(conf.statsurl);
+    char *p = ri->file+len, *body;
+    int json, j;
+    srvstats tot;
+
+    if (strncmp(ri->file,conf.statsurl,len)) return 0;
+    if ((json = !strncmp(p,".json",5)) != 0) p += 5;
+    if (*p != '\0' && *p != '?') return 0;
+
+    memset(&tot,0,sizeof(tot));
+    for (j = 0; j < conf.workers; j++) srvAddStats(&tot,&conf.stats[j]);
+    if (json) {
+        body = sdscatprintf(sdsnew(""),"{\"uptime_ms\":%lld,"
+                                       "\"engine\":\"%s\",\"total\":",
+            milliseconds()-conf.starttime, evGetApiName());
+        body = srvCatStatsJSON(body,&tot);
+        body = sdscat(body,",\"workers\":[");
+        for (j = 0; j < conf.workers; j++) {
+            if (j) body = sdscatlen(body,",",1);
+            body = srvCatStatsJSON(body,&conf.stats[j]);
+        }
+        body = sdscat(body,"]}\n");
+    } else {
+        body = sdscatprintf(sdsnew(""),"uptime_ms %lld\nworkers %d\n"
+                                       "engine %s\n",
+            milliseconds()-conf.starttime, conf.workers, evGetApiName());
+        body = srvCatStatsText(body,"",&tot);
+        if (conf.workers > 1) {
+            for (j = 0; j < conf.workers; j++) {
+                char prefix[32];
+
+                snprintf(prefix,sizeof(prefix),"worker%d_",j);
+                body = srvCatStatsText(body,prefix,&conf.stats[j]);
+            }
+        }
+    }
+    c->reply = createHttpReplyStatus(c->reply,ri,"200","OK");
+    c->reply = sdscat(c->reply,"Cache-Control: no-store\r\n");
+    c->reply = catHttpReplyContent(c->reply,
+        json ? "application/json" : "text/plain",sdslen(body));
+    if (ri->method != WBOX_REQ_METHOD_HEAD)
+        c->reply = sdscatlen(c->reply,body,sdslen(body));
+    sdsfree(body);
+    return 1;
+}
+
+static void printServerStats(void) {
+    long long elapsed = milliseconds()-conf.starttime;
+    srvstats tot;
+    int j;
+
+    memset(&tot,0,sizeof(tot));
+    for (j = 0; j < conf.workers; j++) {
+        srvstats *st = &conf.stats[j];
+
+        if (conf.workers > 1)
+            printf("--- worker %d: %lld connections, %lld requests, "
+                   "%lld bytes sent ---\n", j, st->connections,
+                   st->requests, st->bytes);
+        srvAddStats(&tot,st);
+    }
+    printf("--- %lld connections (%lld rejected, %lld timed out, "
+           "%lld active), %lld requests (%lld not modified), "
+           "%lld bytes sent ---\n",
+        tot.connections, tot.rejected, tot.timedout, tot.active,
+        tot.requests, tot.notmodified, tot.bytes);
+    if (tot.timedout)
+        printf("--- timeouts: %lld idle, %lld header, %lld body, "
+               "%lld send ---\n",
+            tot.timedout-tot.tohdr-tot.tobody-tot.tosend, tot.tohdr,
+            tot.tobody, tot.tosend);
+    if (elapsed > 0)
+        printf("--- %.2f requests/s, %.2f MB/s in %.2f seconds ---\n",
+            (double)tot.requests*1000/elapsed,
+            (double)tot.bytes*1000/elapsed/(1024*1024),
+            (double)elapsed/1000);
+    if (conf.fcachemax)
+        printf("--- file cache: %lld hits, %lld misses, "
+               "%lld invalidated ---\n",
+            tot.fchits, tot.fcmisses, tot.fcinvalidated);
+    if (conf.gzip)
+        printf("--- gzip cache: %lld hits, %lld files compressed ---\n",
+            tot.gzhits, tot.gzcompressed);
+    if (conf.dircachemax)
+        printf("--- directory listings: %lld cached, %lld rendered ---\n",
+            tot.dirhits, tot.dirrendered);
+    if (conf.nbinds)
+        printf("--- bound URLs: %lld cached replies, %lld commands run ---\n",
+            tot.bindhits, tot.bindexecs);
+    if (conf.accesslog)
+        printf("--- access log: %lld lines, %lld dropped ---\n",
+            tot.loglines, tot.logdropped);
+    if (conf.ipconnmax || conf.iprate)
+        printf("--- client IP limits: %lld connections refused, "
+               "%lld requests limited ---\n",
+            tot.iprejected, tot.iplimited);
+    if (tot.svctime.count)
+        printf("--- service time: avg %.3f, p50 %.3f, p99 %.3f, "
+               "max %.3f ms ---\n",
+            (double)tot.svctime.sum/tot.svctime.count/1000,
+            (double)histPercentile(&tot.svctime,50)/1000,
+            (double)histPercentile(&tot.svctime,99)/1000,
+            (double)tot.svctime.max/1000);
+}
+
+static void serverMode(wconfig *conf) {
+    char err[ANET_ERR_LEN];
+    int maxfd, j, *fds;
+
+    if (conf->servertest) {
+        /* Nothing is read from the filesystem */
+        int npages = srvCreatePages();
+
+        conf->fcachemax = 0;
+        conf->gzip = 0;
+        conf->dircachemax = 0;
+        printf("WBOX starting in server test mode, port %d, %d page size%s",
+            conf->serverport, npages, npages > 1 ? "s" : "");
+    } else {
+        if (!conf->webroot) {
+            fprintf(stderr,
+                "Sorry, you must specify 'webroot <path>' in server mode.\n");
+            exit(WBOX_EXIT_BADARGS);
+        }
+        /* Make sure the webroot does not end with a slash */
+        {
+            int wblen = strlen(conf->webroot);
+            while (wblen && conf->webroot[wblen-1] == '/') {
+                conf->webroot[wblen-1] = '\0';
+                wblen--;
+            }
+        }
+        printf("WBOX starting in server mode, port %d, webroot %s",
+            conf->serverport, conf->webroot);
+    }
+    if (conf->workers > 1) printf(", %d workers",conf->workers);
+    printf("\n");
+    /* Every client uses a file descriptor for the socket, and may use
+     * another one for the file being served. The file cache keeps up to
+     * 'fcachemax' more files open, and every running bound command uses
+     * a pipe. */
+    maxfd = adjustOpenFilesLimit(conf->maxclients*2+conf->fcachemax+
+                                 conf->bindmax+32);
+    if (maxfd < conf->maxclients*2+conf->fcachemax+conf->bindmax+32) {
+        if (conf->fcachemax > maxfd/4) conf->fcachemax = maxfd/4;
+        conf->maxclients = (maxfd-conf->fcachemax-conf->bindmax-32)/2;
+        fprintf(stderr,"Warning: only %d file descriptors available, "
+                       "maxclients set to %d\n", maxfd, conf->maxclients);
+        if (conf->maxclients < 1) exit(WBOX_EXIT_BADARGS);
+    }
+    /* Configure the TCP server. With multiple workers every worker has
+     * its own listening socket, and the kernel balances the connections
+     * among them, so there is no thundering herd on a single socket. */
+    conf->stats = mmap(NULL,sizeof(srvstats)*conf->workers,
+        PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANON,-1,0);
+    fds = malloc(sizeof(int)*conf->workers);
+    conf->workerpids = malloc(sizeof(pid_t)*conf->workers);
+    if (conf->stats == MAP_FAILED || !fds || !conf->workerpids) {
+        fprintf(stderr, "Out of memory starting the server\n");
+        exit(WBOX_EXIT_IO);
+    }
+    memset(conf->stats,0,sizeof(srvstats)*conf->workers);
+    /* All the workers append to the same access log. Lines are written
+     * in batches with a single write each, of whole lines and atomic
+     * on pipes too (see alogCreate()), so lines of different workers
+     * are not mixed unless a write is cut short (disk full). */
+    if (conf->accesslog) {
+        conf->alogfd = open(conf->accesslog,O_WRONLY|O_CREAT|O_APPEND,0644);
+        if (conf->alogfd == -1) {
+            fprintf(stderr, "Opening the access log %s: %s\n",
+                conf->accesslog, strerror(errno));
+            exit(WBOX_EXIT_IO);
+        }
+    }
+    conf->starttime = milliseconds();
+    for (j = 0; j < conf->workers; j++) {
+        if (conf->workers == 1)
+            fds[j] = anetTcpServer(err,conf->serverport,NULL);
+        else
+            fds[j] = anetTcpReusePortServer(err,conf->serverport,NULL);
+        if (fds[j] == ANET_ERR) {
+            fprintf(stderr, "Starting in server mode (port %d): %s\n",
+                conf->serverport, err);
+            exit(WBOX_EXIT_IO);
+        }
+    }
+    if (conf->workers == 1) {
+        conf->workerpids[0] = 0;
+        Signal(SIGINT,sigHandler);
+        srvWorker(0,fds[0]);
+    }
+    for (j = 0; j < conf->workers; j++) {
+        pid_t pid = fork();
+
+        if (pid == -1) {
+            perror("fork");
+            exit(WBOX_EXIT_IO);
+        } else if (pid == 0) {
+            int k;
+
+            for (k = 0; k < conf->workers; k++)
+                if (k != j) close(fds[k]);
+            free(conf->workerpids);
+            conf->workerpids = NULL;
+            Signal(SIGINT,SIG_DFL);
+            srvWorker(j,fds[j]);
+        }
+        conf->workerpids[j] = pid;
+    }
+    for (j = 0; j < conf->workers; j++) close(fds[j]);
+    free(fds);
+    /* The parent just waits for Ctrl+C, then reports the merged stats */
+    Signal(SIGINT,sigHandler);
+    while(1) pause();
+}
+
+/* ------------------------------ Server test mode -------------------------- */
+/* In servertest mode no file is served: pages of the configured sizes are
+ * rendered once in memory, and every request gets one of them, sent with
+ * a single writev() of the header and the body. This is a known fast
+ * target to measure the limits of the network stack and of the clients.
+ * Only the Date field changes, and it is patched in place every second. */
+
+typedef struct srvpage {
+    size_t len; /* body length */
+    int weight; /* probability of being chosen, relative to the others */
+    char *body;
+    /* Header variants by protocol and keep alive, see srvPageVariant() */
+    char *hdr[4];
+} srvpage;
+
+static srvpage srvpages[WBOX_MAX_PAGES];
+static int srvnpages, srvweights;
+
+static int srvPageVariant(reqinfo *ri) {
+    return (ri->protover == 11)*2+(ri->keepalive != 0);
+}
+
+/* Render the pages listed in conf.pagesize, returning how many they are.
+ * Exits on syntax errors. */
+static int srvCreatePages(void) {
+    char *p = conf.pagesize ? conf.pagesize : WBOX_STR(WBOX_DEFAULT_PAGESIZE);
+    static char line[] = "WBox servertest page, every request gets the same "
+                         "bytes.......\n";
 
-    /* Entities conversion step */
-    {
-        char *new = sdsnew("");
-        new = sdscatentities(new,s);
-        s = new;
-    }
-    len = strlen(s);
-    for(i = 0; i < len; i++) {
-        switch(s[i]) {
-        case '#':
-            t = (unsigned) s[i];
-            d = sdscatlen(d,"%",1);
-            d = sdscatlen(d,hexset+((t & 0xF0) >> 4),1);
-            d = sdscatlen(d,hexset+((t & 0x0F) >> 4),1);
-            break;
-        default:
-            d = sdscatlen(d,s+i,1);
-            break;
+    while(*p) {
+        srvpage *pg = &srvpages[srvnpages];
+        long long len = parseSize(p,&p);
+        size_t j;
+        int v;
+
+        if (len == -1 || srvnpages == WBOX_MAX_PAGES) goto badsize;
+        pg->len = len;
+        pg->weight = 1;
+        if (*p == ':') {
+            pg->weight = strtol(p+1,&p,10);
+            if (pg->weight < 1) goto badsize;
+        }
+        if (*p == ',') p++; else if (*p) goto badsize;
+        if ((pg->body = malloc(pg->len+1)) == NULL) {
+            fprintf(stderr,"Out of memory creating the test pages\n");
+            exit(WBOX_EXIT_IO);
+        }
+        for (j = 0; j < pg->len; j++) pg->body[j] = line[j%(sizeof(line)-1)];
+        for (v = 0; v < 4; v++) {
+            reqinfo ri;
+
+            ri.protover = (v & 2) ? 11 : 10;
+            ri.keepalive = v & 1;
+            pg->hdr[v] = createHttpReply(sdsnew(""),&ri,"200","OK",
+                "text/plain",pg->len);
         }
+        srvweights += pg->weight;
+        srvnpages++;
     }
-    sdsfree(s);
-    return d;
+    if (srvnpages) return srvnpages;
+badsize:
+    fprintf(stderr,"Bad pagesize, use <bytes>[:<weight>],... as in "
+                   "1k:90,64k:10\n");
+    exit(WBOX_EXIT_BADARGS);
 }
 
-static char *createDirListing(char *path, char *webpath) {
-    DIR *d;
-    struct dirent *de;
-    struct stat sbuf;
-    char *b;
-    int onlydirs;
-
-    d = opendir(path);
-    if (d == NULL)
-        return sdsnew("Can't open the directory...");
-
-    b = sdsnew(htmlheader);
-    b = sdscat(b,"<h1>Index of ");
-    b = sdscatentities(b,webpath);
-    b = sdscat(b,"</h1>\n<table class=\"dirindex\">");
-    for (onlydirs = 1; onlydirs >= 0; onlydirs--) {
-        while((de = readdir(d))) {
-            char *filepath, *trname;
-            int retval, isdir;
-            char unitchar;
-            float size;
-
-            filepath = sdsdup(path);
-            filepath = sdscatlen(filepath,"/",1);
-            filepath = sdscat(filepath,de->d_name);
-            retval = stat(filepath,&sbuf);
-            if (retval == -1) {
-                sdsfree(filepath);
-                continue;
-            }
-            if (access(filepath,R_OK) == -1) {
-                sdsfree(filepath);
-                continue;
-            }
-            sdsfree(filepath);
-            isdir = S_ISDIR(sbuf.st_mode);
-            if (onlydirs != isdir) continue;
-            if (isdir && de->d_name[0] == '.' && de->d_name[1] == '\0')
-                continue;
-            /* File name */
-            b = sdscat(b,"<tr><td><a href=\"");
-            trname = sdsnew(de->d_name);
-            if (sdslen(trname) > 30) {
-                trname = sdsrange(trname,0,30);
-                trname = sdscat(trname,"...>");
-            }
-            b = sdscaturl(b,de->d_name);
-            if (isdir) {
-                b = sdscatlen(b,"/",1);
-                b = sdscat(b,"\" class=\"dir\">[DIR] ");
-            } else
-                b = sdscat(b,"\">");
-            b = sdscatentities(b,trname);
-            b = sdscat(b,"</a></td>\n");
-            sdsfree(trname);
-            /* File size */
-            size = sbuf.st_size;
-            if (size > 1024*1024*1024) {
-                size /= 1024*1024*1024;
-                unitchar='G';
-            } else if (size > 1024*1024) {
-                size /= 1024*1024;
-                unitchar='M';
-            } else if (size > 1024) {
-                size /= 1024;
-                unitchar='k';
-            } else {
-                unitchar='b';
-            }
-            b = sdscat(b,"<td>");
-            if (size-(int)size)
-                b = sdscatprintf(b,"%.1f%c",size,unitchar);
-            else
-                b = sdscatprintf(b,"%d%c",(int)size,unitchar);
-            b = sdscat(b,"</td></tr>\n");
+/* Update the Date field of the rendered headers, of fixed length */
+static void srvRefreshPages(void) {
+    int j, v;
+
+    for (j = 0; j < srvnpages; j++) {
+        for (v = 0; v < 4; v++) {
+            char *d = strstr(srvpages[j].hdr[v],"Date: ");
+
+            if (d) memcpy(d+6,httpdate,strlen(httpdate));
         }
-        rewinddir(d);
     }
-    closedir(d);
-    b = sdscat(b,"</table>\n");
-    b = sdscat(b,htmlfooter);
-    return b;
 }
 
-static char *guessContentType(char *filename) {
-    char *p;
+/* Choose the page for the current request: "/<bytes>" asks for a given
+ * size, if configured, otherwise the page is chosen according to the
+ * weights. */
+static void srvPreparePage(srvclient *c) {
+    reqinfo *ri = &c->ri;
+    srvpage *pg = NULL;
+    int j;
 
-    p = strrchr(filename,'.');
-    if (!p) return "text/plain";
-    p++;
-    if (!strcmpNC(p,"jpg") || !strcmpNC(p,"jpeg")) return "image/jpeg";
-    if (!strcmpNC(p,"css")) return "text/css";
-    if (!strcmpNC(p,"js")) return "text/javascript";
-    if (!strcmpNC(p,"ico")) return "image/x-icon";
-    if (!strcmpNC(p,"png")) return "image/png";
-    if (!strcmpNC(p,"gif")) return "image/gif";
-    if (!strcmpNC(p,"html")) return "text/html";
-    if (!strcmpNC(p,"htm")) return "text/html";
-    if (!strcmpNC(p,"xml")) return "text/plain";
-    if (!strcmpNC(p,"txt")) return "text/plain";
-    if (!strcmpNC(p,"c")) return "text/plain";
-    if (!strcmpNC(p,"rb")) return "text/plain";
-    if (!strcmpNC(p,"py")) return "text/plain";
-    if (!strcmpNC(p,"cpp")) return "text/plain";
-    if (!strcmpNC(p,"c++")) return "text/plain";
-    if (!strcmpNC(p,"tcl")) return "text/plain";
-    if (!strcmpNC(p,"pl")) return "text/plain";
-    if (!strcmpNC(p,"lua")) return "text/plain";
-    if (!strcmpNC(p,"csv")) return "text/plain";
-    if (!strcmpNC(p,"pdf")) return "application/pdf";
-    if (!strcmpNC(p,"mp3")) return "audio/mpeg";
-    if (!strcmpNC(p,"mpg")) return "video/mpeg";
-    /* All the rest is binary data... */
-    return "text/plain";
+    if (isdigit((unsigned char)ri->file[1])) {
+        char *end;
+        long long len = parseSize(ri->file+1,&end);
+
+        for (j = 0; j < srvnpages && *end == '\0'; j++)
+            if ((long long)srvpages[j].len == len) pg = &srvpages[j];
+    }
+    if (pg == NULL) {
+        int r = srvnpages > 1 ? rand() % srvweights : 0;
+
+        for (j = 0; r >= srvpages[j].weight; j++) r -= srvpages[j].weight;
+        pg = &srvpages[j];
+    }
+    c->page = pg;
+    c->pagehdr = pg->hdr[srvPageVariant(ri)];
+    c->pagehdrlen = sdslen(c->pagehdr);
+    c->replypos = 0;
 }
 
-static void serverModeChild(int s, char *ip, int port, wconfig *conf) {
-    char *req = sdsnew("");
-    char buf[WBOX_RECV_BUF];
-    char *fullpath, *reply = NULL;
-    char *document = NULL;
-    struct stat sbuf;
-    reqinfo ri;
+/* Send what we can of the page, with the same return values of
+ * srvWriteReply(). */
+static int srvWritePage(srvclient *c) {
+    srvpage *pg = c->page;
+    size_t len = c->pagehdrlen;
+    ssize_t nwritten;
 
-    /* Read the request */
-    while(1) {
-        int nread, len;
-        nread = read(s,buf,WBOX_RECV_BUF);
-        if (nread == 0) {
-            printf("%s:%d EOF from client\n",ip,port);
-            exit(WBOX_EXIT_IO);
-        } else if (nread == -1) {
-            printf("%s:%d reading: %s\n", ip, port, strerror(errno));
-            exit(WBOX_EXIT_IO);
+    if (c->ri.method != WBOX_REQ_METHOD_HEAD) len += pg->len;
+    while(c->replypos < len) {
+        struct iovec iov[2];
+        size_t max = len-c->replypos;
+        int n = 0;
+
+        if (conf.shaping && (max = srvShape(c,max)) == 0) return 0;
+        if (c->replypos < c->pagehdrlen) {
+            iov[n].iov_base = c->pagehdr+c->replypos;
+            iov[n++].iov_len = c->pagehdrlen-c->replypos;
+            iov[n].iov_base = pg->body;
+            iov[n++].iov_len = len-c->pagehdrlen;
+        } else {
+            iov[n].iov_base = pg->body+(c->replypos-c->pagehdrlen);
+            iov[n++].iov_len = len-c->replypos;
         }
-        req = sdscatlen(req,buf,nread);
-        len = sdslen(req);
-        if (len > 4) {
-            if (!memcmp(req+(len-2),"\n\n",2) ||
-                !memcmp(req+(len-4),"\r\n\r\n",4)) break;
+        if (iov[0].iov_len >= max) {
+            iov[0].iov_len = max;
+            n = 1;
+        } else if (n == 2 && iov[0].iov_len+iov[1].iov_len > max) {
+            iov[1].iov_len = max-iov[0].iov_len;
         }
+        nwritten = writev(c->fd,iov,n);
+        if (nwritten == -1) {
+            if (errno == EAGAIN || errno == EINTR) return 0;
+            if (!conf.silent)
+                printf("%s:%d write error\n", c->ip, c->port);
+            srvFreeClient(c);
+            return -1;
+        }
+        if (conf.shaping) srvShapeSent(c,nwritten);
+        c->lastio = milliseconds();
+        c->replypos += nwritten;
+        c->sent += nwritten;
+        conf.wstats->bytes += nwritten;
     }
-    /* Parse it */
-    if (parseRequest(req,&ri)) {
-        printf("%s:%d bad request:\n%s\n", ip, port, req);
-        sdsfree(req);
-        exit(WBOX_EXIT_PROTO);
+    srvReplySent(c);
+    return 1;
+}
+
+/* Show the requests per second served by all the workers. Called every
+ * second by the first worker, that can read the stats of all of them. */
+static void srvShowRate(void) {
+    static long long lastrequests = -1;
+    long long requests = 0, active = 0;
+    int j;
+
+    for (j = 0; j < conf.workers; j++) {
+        requests += conf.stats[j].requests;
+        active += conf.stats[j].active;
     }
-    sdsfree(req);
-    /* Create the full path of the resource */
-    fullpath = createFullPath(conf->webroot, ri.file);
-    /*
-    printf("Method: %d, file: %s, protover: %d\n",
-        ri.method, fullpath, ri.protover);
-    */
-    /* Generate the reply */
-    if (access(fullpath,R_OK) == -1) {
-        /* 404 */
-        if (!conf->silent)
-            printf("%s:%d 404: %s\n", ip, port, fullpath);
-        reply = createHttpReply(&ri,"404","Not Found","text/html",-1);
-        reply = sdscat(reply, htmlheader);
-        reply = sdscat(reply, "<h1>404 Not Found</h1>");
-        reply = sdscatprintf(reply, "<h2>");
-        reply = sdscatentities(reply,ri.file);
-        reply = sdscat(reply," was not found on this server</h2>");
-        reply = sdscat(reply, htmlfooter);
-        anetWrite(s,reply,sdslen(reply));
-        goto cleanup;
-    }
-    if (stat(fullpath,&sbuf) == -1) goto cleanup;
-    if (S_ISDIR(sbuf.st_mode)) {
-        /* Directory listing */
-        document = createDirListing(fullpath,ri.file);
-        reply = createHttpReply(&ri,"200","OK","text/html",sdslen(document));
-        anetWrite(s,reply,sdslen(reply));
-        anetWrite(s,document,sdslen(document));
-        goto cleanup;
-    } else {
-        /* Regular file */
-        char *ctype = guessContentType(ri.file);
-        char buf[WBOX_RECV_BUF];
-        int fd;
-        reply = createHttpReply(&ri,"200","OK",ctype,sbuf.st_size);
-        anetWrite(s,reply,sdslen(reply));
-        if ((fd = open(fullpath,O_RDONLY)) == -1) goto cleanup;
-        while(1) {
-            int nread;
-            nread = read(fd,buf,WBOX_RECV_BUF);
-            if (nread == 0 || nread == -1) break;
-            if (anetWrite(s,buf,nread) == -1) {
-                if (!conf->silent)
-                    printf("%s:%d write error\n", ip, port);
-                break;
-            }
-        }
+    if (lastrequests != -1)
+        printf("%lld requests/s, %lld active connections\n",
+            requests-lastrequests, active);
+    lastrequests = requests;
+}
+
+/* ------------------------------- URL bindings ----------------------------- */
+/* "bindurl <url> <command>" serves the output of a command. Running it at
+ * every request would be too expensive, so the output is cached for
+ * 'bindttl' seconds, the clients requesting a URL while its command runs
+ * share the same execution, and no more than 'bindmax' commands run at
+ * the same time: the others wait for a free slot. Output not yet cached
+ * is streamed as it arrives, with the chunked encoding for HTTP/1.1. */
+
+static srvbind *srvLookupBind(char *path) {
+    size_t len = strcspn(path,"?");
+    int j;
+
+    for (j = 0; j < conf.nbinds; j++) {
+        srvbind *b = &conf.bind[j];
+
+        if (strlen(b->url) == len && !memcmp(b->url,path,len)) return b;
     }
-cleanup:
-    sdsfree(document);
-    sdsfree(reply);
-    sdsfree(fullpath);
-    freeReqInfo(&ri);
-    close(s);
-    if (!conf->silent)
-        printf("%s:%d served with success\n", ip, port);
+    return NULL;
 }
 
-static void serverMode(wconfig *conf) {
-    int server, clientport;
-    char err[ANET_ERR_LEN], clientip[32];
-    if (!conf->webroot) {
-        fprintf(stderr,
-            "Sorry, you must specify 'webroot <path>' in server mode.\n");
-        exit(WBOX_EXIT_BADARGS);
+/* Append the command output 'p' of length 'len' to the reply of the
+ * client, and wait for the socket to be writable to send it. A 'len' of
+ * zero marks the end of the output. */
+static void srvBindAppend(srvclient *c, char *p, size_t len) {
+    if (c->replypos == sdslen(c->reply)) {
+        sdsclear(c->reply);
+        c->replypos = 0;
+    }
+    if (c->chunked) {
+        char size[32];
+
+        c->reply = sdscatlen(c->reply,size,snprintf(size,sizeof(size),
+            "%lx\r\n",(unsigned long)len));
+    }
+    c->reply = sdscatlen(c->reply,p,len);
+    if (c->chunked) c->reply = sdscatlen(c->reply,"\r\n",2);
+    evCreateFileEvent(conf.el,c->fd,EV_WRITABLE,srvWriteHandler,c);
+}
+
+static void srvBindRemoveWaiter(srvclient *c) {
+    srvclient **p = &c->bind->waiters;
+
+    while(*p && *p != c) p = &(*p)->bindnext;
+    if (*p) *p = c->bindnext;
+    c->bind = NULL;
+}
+
+static void srvBindReadHandler(evLoop *el, int fd, void *privdata, int mask);
+
+/* Close all the file descriptors starting from 'lowfd' */
+static void closeFrom(int lowfd) {
+    int fd;
+
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range,lowfd,~0U,0) == 0) return;
+#endif
+    for (fd = sysconf(_SC_OPEN_MAX)-1; fd >= lowfd; fd--) close(fd);
+}
+
+/* Run the command of 'b', or mark it as pending if too many commands are
+ * running. Returns -1 on error. */
+static int srvBindRun(srvbind *b) {
+    int pipefd[2];
+    pid_t pid;
+
+    if (conf.bindrunning >= conf.bindmax) {
+        b->pending = 1;
+        return 0;
+    }
+    b->pending = 0;
+    if (pipe(pipefd) == -1) return -1;
+    if ((pid = fork()) == -1) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    } else if (pid == 0) {
+        int devnull = open("/dev/null",O_RDONLY);
+
+        /* Own process group, so that the command and its children can be
+         * killed at once. The client sockets must not be inherited. */
+        setpgid(0,0);
+        if (devnull != -1) dup2(devnull,0);
+        dup2(pipefd[1],1);
+        dup2(pipefd[1],2);
+        closeFrom(3);
+        execl("/bin/sh","sh","-c",b->cmd,(char*)NULL);
+        _exit(127);
     }
-    /* Make sure the webroot does not end with a slash */
+    /* Also here, or a kill before the child runs setpgid() would fail */
+    setpgid(pid,pid);
+    close(pipefd[1]);
+    anetNonBlock(NULL,pipefd[0]);
+    if (evCreateFileEvent(conf.el,pipefd[0],EV_READABLE,srvBindReadHandler,
+            b) == EV_ERR)
     {
-        int wblen = strlen(conf->webroot);
-        while (wblen && conf->webroot[wblen-1] == '/') {
-            conf->webroot[wblen-1] = '\0';
-            wblen--;
-        }
-    }
-    printf("WBOX starting in server mode, port %d, webroot %s\n",
-        conf->serverport, conf->webroot);
-    /* Configure the TCP server */
-    server = anetTcpServer(err,conf->serverport,NULL);
-    if (server == ANET_ERR) {
-        fprintf(stderr, "Starting in server mode (port %d): %s\n",
-            conf->serverport, err);
-        exit(WBOX_EXIT_IO);
+        kill(-pid,SIGKILL);
+        close(pipefd[0]);
+        return -1;
     }
-    while(1) {
-        pid_t pid;
-        int fd = anetAccept(err, server, clientip, &clientport);
-        if (fd == ANET_ERR) {
-            fprintf(stderr, "Warning, accepting client: %s\n", err);
-            continue;
+    b->pid = pid;
+    b->fd = pipefd[0];
+    b->started = time(NULL);
+    b->truncated = 0;
+    b->outtime = 0;
+    sdsclear(b->out);
+    conf.bindrunning++;
+    conf.wstats->bindexecs++;
+    return 0;
+}
+
+/* The command of 'b' terminated, or could not be started: complete the
+ * replies of the waiting clients, then run the pending commands. */
+static void srvBindDone(srvbind *b) {
+    srvclient *c = b->waiters;
+    int j;
+
+    if (b->fd != -1) {
+        evDeleteFileEvent(conf.el,b->fd,EV_READABLE);
+        close(b->fd);
+        b->fd = -1;
+        b->pid = -1; /* reaped by the SIGCHLD handler */
+        conf.bindrunning--;
+        if (conf.bindttl) b->outtime = time(NULL);
+    }
+    b->waiters = NULL;
+    while(c) {
+        srvclient *next = c->bindnext;
+
+        c->bind = NULL;
+        /* HTTP/1.0 clients just see the connection closed */
+        srvBindAppend(c,NULL,0);
+        c = next;
+    }
+    for (j = 0; j < conf.nbinds && conf.bindrunning < conf.bindmax; j++) {
+        srvbind *p = &conf.bind[j];
+
+        if (p->pending && srvBindRun(p) == -1) {
+            p->pending = 0;
+            srvBindDone(p);
         }
-        if (conf->activeclients == conf->maxclients) {
-            printf("%s:%d closing connection! max number of clients reached (tune this using the maxclients <number> option)\n",clientip,clientport);
-            close(fd);
-            continue;
+    }
+}
+
+static void srvBindReadHandler(evLoop *el, int fd, void *privdata, int mask) {
+    srvbind *b = privdata;
+    char buf[WBOX_DIRLIST_CHUNK];
+    srvclient *c;
+    ssize_t nread;
+    WBOX_NOTUSED(el);
+    WBOX_NOTUSED(mask);
+
+    nread = read(fd,buf,sizeof(buf));
+    if (nread == -1 && (errno == EAGAIN || errno == EINTR)) return;
+    if (nread <= 0) {
+        srvBindDone(b);
+        return;
+    }
+    if (b->truncated) return;
+    if (sdslen(b->out)+nread > WBOX_BIND_MAX_OUTPUT) {
+        nread = WBOX_BIND_MAX_OUTPUT-sdslen(b->out);
+        b->truncated = 1;
+        kill(-b->pid,SIGKILL);
+    }
+    b->out = sdscatlen(b->out,buf,nread);
+    for (c = b->waiters; c; c = c->bindnext) srvBindAppend(c,buf,nread);
+}
+
+/* Reply with the cached output of 'b', or wait for the output of a new
+ * or already running execution. */
+static void srvReplyBind(srvclient *c, srvbind *b) {
+    reqinfo *ri = &c->ri;
+
+    if (b->outtime && time(NULL)-b->outtime < conf.bindttl) {
+        conf.wstats->bindhits++;
+        c->reply = createHttpReply(c->reply,ri,"200","OK","text/plain",
+            sdslen(b->out));
+        if (ri->method != WBOX_REQ_METHOD_HEAD)
+            c->reply = sdscatlen(c->reply,b->out,sdslen(b->out));
+        return;
+    }
+    if (ri->method != WBOX_REQ_METHOD_HEAD && b->pid == -1 && !b->pending &&
+        srvBindRun(b) == -1)
+    {
+        c->reply = createHttpReply(c->reply,ri,"503","Service Unavailable",
+            "text/plain",0);
+        return;
+    }
+    /* The length is not known in advance */
+    if (ri->protover == 11) c->chunked = 1; else ri->keepalive = 0;
+    c->reply = createHttpReplyStatus(c->reply,ri,"200","OK");
+    if (c->chunked)
+        c->reply = sdscat(c->reply,"Transfer-Encoding: chunked\r\n");
+    c->reply = catHttpReplyContent(c->reply,"text/plain",-1);
+    if (ri->method == WBOX_REQ_METHOD_HEAD) return;
+    /* Send what the command already produced, then the rest as it
+     * arrives. If the run is still pending the output is the one of the
+     * previous run, that is cleared when the command starts. */
+    c->bind = b;
+    c->bindnext = b->waiters;
+    b->waiters = c;
+    if (b->pid != -1 && sdslen(b->out))
+        srvBindAppend(c,b->out,sdslen(b->out));
+}
+
+/* Kill the commands running for too long */
+static void srvBindCron(time_t now) {
+    int j;
+
+    for (j = 0; j < conf.nbinds; j++) {
+        srvbind *b = &conf.bind[j];
+
+        if (b->pid != -1 && now-b->started > WBOX_BIND_TIMEOUT)
+            kill(-b->pid,SIGKILL);
+    }
+}
+
+/* ------------------------------ io_uring engine --------------------------- */
+/* When the loop supports the ring ops (the "uring" option on Linux 6.3 or
+ * newer) the common requests are served without readiness events: a
+ * multishot accept creates the clients, a multishot receive per client
+ * feeds srvInput(), and a reply that fits in a send buffer is sent by a
+ * single op, the file content read in the buffer by a read linked to the
+ * send. The ops of an iteration are submitted, and their completions
+ * reaped, by the same io_uring_enter() call. Bigger files are still sent
+ * with sendfile(), that does not copy them, and listings, streams, bound
+ * commands, multipart ranges and shaped replies use srvWriteReply(), the
+ * ring polling the socket for them. */
+
+typedef struct ringbuf {
+    struct ringbuf *next; /* next free buffer */
+    char data[WBOX_RING_BUF];
+} ringbuf;
+
+static ringbuf *ringfree; /* free send buffers */
+static int ringbufs; /* send buffers allocated */
+
+static void srvRingSent(evLoop *el, void *privdata, int res, char *buf,
+                        int flags);
+static void srvRingRecv(evLoop *el, void *privdata, int res, char *buf,
+                        int flags);
+
+/* Return a send buffer, NULL if WBOX_RING_BUFS are already in use */
+static ringbuf *srvRingGetBuf(void) {
+    ringbuf *rb = ringfree;
+
+    if (rb) {
+        ringfree = rb->next;
+        return rb;
+    }
+    if (ringbufs == WBOX_RING_BUFS || (rb = malloc(sizeof(*rb))) == NULL)
+        return NULL;
+    ringbufs++;
+    return rb;
+}
+
+static void srvRingPutBuf(srvclient *c) {
+    if (c->rb == NULL) return;
+    c->rb->next = ringfree;
+    ringfree = c->rb;
+    c->rb = NULL;
+}
+
+static void srvRingAccept(evLoop *el, void *privdata, int res, char *buf,
+                          int flags)
+{
+    char clientip[32];
+    int clientport;
+    WBOX_NOTUSED(el);
+    WBOX_NOTUSED(privdata);
+    WBOX_NOTUSED(buf);
+
+    if (res >= 0) {
+        anetPeerToString(res,clientip,&clientport);
+        srvNewClient(res,clientip,clientport);
+    } else if (res != -ECANCELED) {
+        fprintf(stderr, "Warning, accepting client: %s\n", strerror(-res));
+    }
+    /* After an error the cron starts it again, not to spin on EMFILE */
+    if (!(flags & EV_OP_MORE)) {
+        conf.acceptop = -1;
+        if (res >= 0) srvRingListen();
+    }
+}
+
+/* Accept the clients with the ring. Returns -1 on error. */
+static int srvRingListen(void) {
+    conf.acceptop = evAcceptOp(conf.el,conf.serverfd,srvRingAccept,NULL);
+    return (conf.acceptop == -1) ? -1 : 0;
+}
+
+/* Make sure a receive is active, unless the client closed its side or
+ * already sent too much while we reply. Returns -1 on error. */
+static int srvRingRecvArm(srvclient *c) {
+    if (c->recvop != -1 || c->recveof) return 0;
+    if (c->state != WBOX_SRV_READREQ && sdslen(c->ringin) > WBOX_RING_PENDING)
+        return 0;
+    c->recvop = evRecvOp(conf.el,c->fd,srvRingRecv,c);
+    return (c->recvop == -1) ? -1 : 0;
+}
+
+static void srvRingRecv(evLoop *el, void *privdata, int res, char *buf,
+                        int flags)
+{
+    srvclient *c = privdata;
+    WBOX_NOTUSED(el);
+
+    if (!(flags & EV_OP_MORE)) c->recvop = -1;
+    if (c->closing) {
+        if (c->recvop == -1 && c->sendop == -1) srvDestroyClient(c);
+        return;
+    }
+    if (res == 0) {
+        if (c->state != WBOX_SRV_READREQ) {
+            /* Serve what was received first, see srvProcessInput() */
+            c->recveof = 1;
+            return;
         }
-        if (!conf->silent)
-            printf("%s:%d connected\n",clientip,clientport);
-        conf->activeclients++;
-        pid = fork();
-        if (pid == -1) {
-            conf->activeclients--;
-            perror("fork");
-            close(fd);
-            continue;
+        if (!conf.silent) printf("%s:%d EOF from client\n",c->ip,c->port);
+        srvFreeClient(c);
+        return;
+    }
+    /* -ENOBUFS: all the receive buffers were in use. -ECANCELED: see
+     * below. In both cases the receive just needs to be started again. */
+    if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        if (!conf.silent)
+            printf("%s:%d reading: %s\n", c->ip, c->port, strerror(-res));
+        srvFreeClient(c);
+        return;
+    }
+    if (res > 0 && c->state != WBOX_SRV_READREQ) {
+        /* The query buffer holds the request being served, the data
+         * received meanwhile is taken by srvResetClient(). Stop reading
+         * if the client sends too much. */
+        c->lastio = milliseconds();
+        c->ringin = sdscatlen(c->ringin,buf,res);
+        if (c->recvop != -1 && sdslen(c->ringin) > WBOX_RING_PENDING &&
+            sdslen(c->ringin)-res <= WBOX_RING_PENDING)
+            evCancelOp(conf.el,c->recvop);
+        return;
+    }
+    if (srvRingRecvArm(c) == -1) {
+        srvFreeClient(c);
+        return;
+    }
+    if (res > 0) srvInput(c,buf,res);
+}
+
+/* Send the whole reply with a single op if it fits in a send buffer, or
+ * from memory for the servertest pages. Returns 0 if the reply must be
+ * sent by srvWriteReply() instead. */
+static int srvRingReply(srvclient *c) {
+    struct iovec iov[2];
+    int n = 1, filefd = -1;
+
+    if (conf.shaping || c->dl || c->streamfd != -1 || c->bind ||
+        c->nranges) return 0;
+    if (c->page) {
+        size_t len = (c->ri.method == WBOX_REQ_METHOD_HEAD) ? 0 :
+                     c->page->len;
+
+        if (c->pagehdrlen+len > WBOX_RING_BUF) return 0;
+        iov[0].iov_base = c->pagehdr;
+        iov[0].iov_len = c->pagehdrlen;
+        iov[1].iov_base = c->page->body;
+        if ((iov[1].iov_len = len) != 0) n = 2;
+    } else {
+        size_t hdrlen = sdslen(c->reply);
+        off_t len = (c->filefd != -1) ? c->filelen-c->fileoff : 0;
+
+        if (hdrlen+len > WBOX_RING_BUF ||
+            (c->rb = srvRingGetBuf()) == NULL) return 0;
+        /* The header is copied too: the send buffer is only released
+         * on completion, even if the client is freed meanwhile. */
+        memcpy(c->rb->data,c->reply,hdrlen);
+        iov[0].iov_base = c->rb->data;
+        iov[0].iov_len = hdrlen;
+        if (len) {
+            iov[1].iov_base = c->rb->data+hdrlen;
+            iov[1].iov_len = len;
+            filefd = c->filefd;
+            n = 2;
         }
-        if (pid == 0) {
-            close(server);
-            serverModeChild(fd,clientip,clientport,conf);
-            exit(WBOX_EXIT_SUCCESS);
+    }
+    c->sendop = evSendOp(conf.el,c->fd,iov,n,filefd,c->fileoff,srvRingSent,
+        c);
+    if (c->sendop == -1) {
+        srvRingPutBuf(c);
+        return 0;
+    }
+    srvUpdateTimer(c);
+    return 1;
+}
+
+static void srvRingSent(evLoop *el, void *privdata, int res, char *buf,
+                        int flags)
+{
+    srvclient *c = privdata;
+    size_t hdrlen = c->page ? c->pagehdrlen : sdslen(c->reply);
+    int left;
+    WBOX_NOTUSED(buf);
+    WBOX_NOTUSED(flags);
+
+    c->sendop = -1;
+    srvRingPutBuf(c);
+    if (c->closing) {
+        if (c->recvop == -1) srvDestroyClient(c);
+        return;
+    }
+    if (res == -ECANCELED) {
+        /* The linked read failed: file truncated or I/O error */
+        if (!conf.silent) printf("%s:%d read error\n", c->ip, c->port);
+        srvFreeClient(c);
+        return;
+    }
+    if (res < 0 && res != -EAGAIN && res != -EINTR) {
+        if (!conf.silent) printf("%s:%d write error\n", c->ip, c->port);
+        srvFreeClient(c);
+        return;
+    }
+    if (res > 0) {
+        c->lastio = milliseconds();
+        c->sent += res;
+        conf.wstats->bytes += res;
+        if (c->page || (size_t)res <= hdrlen) {
+            c->replypos = res;
         } else {
-            if (!conf->silent)
-                printf("%s:%d handled by process %d\n",clientip,clientport,pid);
-            close(fd);
+            c->replypos = hdrlen;
+            c->fileoff += res-hdrlen;
         }
     }
+    if (c->page)
+        left = c->replypos < hdrlen+
+               (c->ri.method == WBOX_REQ_METHOD_HEAD ? 0 : c->page->len);
+    else
+        left = c->replypos < hdrlen ||
+               (c->filefd != -1 && c->fileoff < c->filelen);
+    if (left) {
+        /* Sent in part, srvWriteReply() continues from there */
+        if (evCreateFileEvent(el,c->fd,EV_WRITABLE,srvWriteHandler,c)
+            == EV_ERR)
+            srvFreeClient(c);
+        else
+            srvUpdateTimer(c);
+        return;
+    }
+    srvReplySent(c);
+    if (!c->page && !conf.silent)
+        printf("%s:%d served with success\n", c->ip, c->port);
+    srvNextRequest(c);
 }
 
 /* --------------------------------- Main() & co ---------------------------- */
@@ -964,29 +5335,110 @@ static void wboxHelp(void) {
 "close                - close the connection after reading few bytes\n"
 "host    <hostname>   - use <hostname> as Host: field in HTTP request\n"
 "timesplit            - show transfer times for different data chunks\n"
+"segsize <bytes>      - timesplit segment size. Default: one every read().\n"
+"stall   <ms>         - timesplit: flag waits for data longer than <ms>.\n"
 "wait    <number>     - wait <number> seconds between requests. Default 1.\n"
 "clients <number>     - spawn <number> concurrent clients (via fork()).\n"
 "referer <url>        - Send the specified referer header.\n"
 "cookie  <name> <val> - Set cookie name=val, can be used multiple times.\n"
+"post    <file>       - use the POST method, sending <file> as body.\n"
+"put     <file>       - use the PUT method, sending <file> as body.\n"
+"ctype   <type>       - Content-Type of the POST/PUT body.\n"
+"noresume             - https: don't resume TLS sessions, full handshakes.\n"
+"noticket             - https: resume via session ID instead of tickets.\n"
+"alpn    <protos>     - https: ALPN protocols list, default http/1.1.\n"
+"cps                  - connection rate mode, just open and close connections.\n"
+"conns   <number>     - cps: number of parallel connections (default 100).\n"
+"cpsreq               - cps: send a minimal request and wait for the reply.\n"
+"rst                  - cps: close connections with RST to avoid TIME_WAIT.\n"
+"hold    <number>     - hold <number> idle connections while requesting.\n"
+"holdrate <number>    - hold: open at max <number> connections per second.\n"
+"trickle <seconds>    - hold: send a request every <seconds> on held conns.\n"
 "-h or --help         - show this help.\n"
 "-v                   - show version.\n"
 "\nSERVER MODE\n\n"
 "Usage: wbox servermode webroot <path> [serverport <portnumber> (def 8081)]\n\n"
 "options:\n\n"
-"maxclients <number>  - Max concurrent clients in server mode (default 20).\n"
+"maxclients <number>  - Max concurrent clients per worker (default 10000).\n"
+"workers <number>     - Number of server processes, each one pinned to a\n"
+"                       CPU and with its own SO_REUSEPORT socket.\n"
+"nopin                - Don't pin workers to CPUs.\n"
+"uring                - Accept, receive and send with io_uring instead of\n"
+"                       epoll, if the kernel supports it (Linux 6.3 or\n"
+"                       newer).\n"
+"keepalive <seconds>  - Close connections idle for more than <seconds>\n"
+"                       (default 5).\n"
+"keepalivemax <number> - Max requests per connection (default 100, 1\n"
+"                       disables keep alive).\n"
+"headertimeout <seconds> - Max time to send a request header (default 10).\n"
+"iotimeout <seconds>  - Close clients not sending the request body or not\n"
+"                       reading the reply for <seconds> (default 30).\n"
+"fcache <number>      - Max files kept open in the file cache (default 1024,\n"
+"                       0 disables the cache).\n"
+"gzip                 - Compress text files on the fly for clients that\n"
+"                       accept gzip, up to 128k. Precompressed <file>.gz\n"
+"                       siblings are always used when present.\n"
+"gzipcache <MB>       - Memory for compressed variants (default 64).\n"
+"dircache <MB>        - Memory for directory listings, cached until the\n"
+"                       directory mtime changes (default 64, 0 disables).\n"
+"bindurl <url> <cmd>  - Serve the output of the shell command <cmd> at\n"
+"                       <url>. Can be used multiple times.\n"
+"bindttl <seconds>    - Cache the command output for <seconds> (default 1,\n"
+"                       0 disables). Concurrent requests share one run.\n"
+"bindmax <number>     - Max commands running at the same time per worker\n"
+"                       (default 4).\n"
+"statsurl <url>       - Live statistics URL (default /__wbox/stats, add\n"
+"                       .json for JSON). \"none\" disables it.\n"
+"accesslog <file>     - Append a line per request to <file>: Common Log\n"
+"                       Format plus the service time in microseconds.\n"
+"                       Written in background, lines are dropped (and\n"
+"                       counted) if the disk can't keep up. Use with\n"
+"                       'silent' to avoid the per connection messages.\n"
+"bwconn <rate>        - Max bytes/s sent to every connection, with optional\n"
+"                       k or m suffix (KB/s, MB/s).\n"
+"bwtotal <rate>       - Max bytes/s sent by the whole server.\n"
+"delay <prefix> <ms>[:<jitter>] - Wait <ms> milliseconds, plus a random\n"
+"                       time up to <jitter>, before replying to URLs\n"
+"                       starting with <prefix>. Can be used multiple times.\n"
+"ipconnmax <number>   - Max connections per client IP and worker, the\n"
+"                       ones over the limit get a 503 and are closed.\n"
+"iprate <req/s>[:<burst>] - Max requests/s per client IP and worker, with\n"
+"                       bursts of <burst> requests (default <req/s>).\n"
+"                       Requests over the limit get a 429.\n"
+"\nSERVER TEST MODE\n\n"
+"Usage: wbox servertest [pagesize <sizes>] [server mode options]\n\n"
+"Serves generated pages from memory, showing the requests per second.\n"
+"pagesize <sizes>     - Comma separated page sizes in bytes, with optional\n"
+"                       k/m suffix and :<weight>, like 1k:90,64k:10. A\n"
+"                       page is chosen at random per request, or by size\n"
+"                       requesting /<size> (default 1024).\n"
 "\nEXAMPLES\n\n"
 "wbox wikipedia.org                  (simplest, basic usage)\n"
 "wbox wikipedia.org 3 compr wait 0   (three requests, compression, no delay)\n"
 "wbox wikipedia.org 1 showhdr silent (just show the HTTP reply header)\n"
 "wbox wikipedia.org timesplit        (show splitted time information)\n"
+"wbox wikipedia.org segsize 65536 stall 100 (64k segments, flag 100ms waits)\n"
 "wbox 1.2.3.4 host example.domain    (test a virtual domain at 1.2.3.4)\n"
+"wbox example.org/api post data.json ctype application/json\n"
+"wbox https://127.0.0.1:4433 wait 0 (TLS, full vs resumed handshakes)\n"
+"wbox 127.0.0.1:8080 cps conns 500 rst 100000 (connection rate benchmark)\n"
+"wbox 127.0.0.1:8080 hold 100000 holdrate 5000 (latency vs open conns)\n"
 "wbox servermode webroot /tmp/mydocuments  (Try it with http://127.0.0.1:8081)\n"
+"wbox servertest pagesize 100,4k workers 4 (in memory pages benchmark target)\n"
 "\n"
 "More docs? there is a tutorial at http://hping.org/wbox\n"
     );
 }
 
 static void printStats(void) {
+    if (conf.servermode) {
+        printServerStats();
+        return;
+    }
+    if (conf.cps) {
+        printCpsStats();
+        return;
+    }
     printf("--- %d replies received",conf.timesum_samples);
     if (conf.timesum_samples) {
         printf(", time min/avg/max = %d/%.2f/%d",
@@ -995,6 +5447,29 @@ static void printStats(void) {
             conf.maxtime);
     }
     printf(" ---\n");
+    if (conf.holdstats) {
+        printf("--- %ld connections held, %ld failed (%ld locally), "
+               "%ld closed by the server ---\n",
+            conf.holdstats->held, conf.holdstats->failed,
+            conf.holdstats->localfail, conf.holdstats->closed);
+    }
+    if (conf.tlsfull+conf.tlsresumed) {
+        float elapsed = (float)(milliseconds()-conf.starttime)/1000;
+        int tot = conf.tlsfull+conf.tlsresumed;
+
+        printf("--- TLS handshakes: %d full", conf.tlsfull);
+        if (conf.tlsfull)
+            printf(" (avg %.3f ms)",(float)conf.tlsfulltime/conf.tlsfull/1000);
+        printf(", %d resumed", conf.tlsresumed);
+        if (conf.tlsresumed)
+            printf(" (avg %.3f ms)",
+                (float)conf.tlsresumedtime/conf.tlsresumed/1000);
+        printf(", %.1f%% resumed", (float)conf.tlsresumed*100/tot);
+        if (elapsed > 0)
+            printf(", %.2f full/s, %.2f resumed/s",
+                conf.tlsfull/elapsed, conf.tlsresumed/elapsed);
+        printf(" ---\n");
+    }
 }
 
 static void sigHandler(int signum)
@@ -1006,13 +5481,21 @@ static void sigHandler(int signum)
             printStats();
             printf("\n");
         }
+        if (conf.holdpid > 0) kill(conf.holdpid,SIGTERM);
+        if (conf.workerpids) {
+            int j;
+
+            for (j = 0; j < conf.workers; j++)
+                if (conf.workerpids[j] > 0) kill(conf.workerpids[j],SIGTERM);
+        }
         exit(WBOX_EXIT_SUCCESS);
     } else if (signum == SIGCHLD) {
-        int status;
-        while (waitpid(-1,&status,WNOHANG) > 0)
-            conf.activeclients--;
-        if (!conf.silent && conf.servermode)
-            printf("%d active clients\n", conf.activeclients);
+        /* waitpid() ends with ECHILD: don't clobber the errno of the
+         * call the signal interrupted, that may be checked for EAGAIN. */
+        int status, olderrno = errno;
+
+        while (waitpid(-1,&status,WNOHANG) > 0);
+        errno = olderrno;
     }
 }
 
@@ -1024,6 +5507,29 @@ static void parseArgs(char **argv, int argc, wconfig *conf) {
     conf->maxreq = -1;
     conf->serverport = WBOX_DEFAULT_SERVER_PORT;
     conf->maxclients = WBOX_DEFAULT_MAX_CLIENTS;
+    conf->keepalive = WBOX_DEFAULT_KEEPALIVE;
+    conf->keepalivemax = WBOX_DEFAULT_KEEPALIVE_MAX;
+    conf->headertimeout = WBOX_DEFAULT_HEADER_TIMEOUT;
+    conf->iotimeout = WBOX_DEFAULT_IO_TIMEOUT;
+    conf->fcachemax = WBOX_DEFAULT_FCACHE_MAX;
+    conf->gzcachemax = (long long)WBOX_DEFAULT_GZCACHE_MB*1024*1024;
+    conf->dircachemax = (long long)WBOX_DEFAULT_DIRCACHE_MB*1024*1024;
+    conf->workers = 1;
+    conf->bindttl = WBOX_DEFAULT_BINDTTL;
+    conf->bindmax = WBOX_DEFAULT_BINDMAX;
+    conf->statsurl = WBOX_DEFAULT_STATSURL;
+    conf->accesslog = NULL;
+    conf->bwconn = conf->bwtotal = 0;
+    conf->shaping = 0;
+    conf->ndelays = 0;
+    conf->ipconnmax = conf->iprate = conf->ipburst = 0;
+    conf->alogfd = -1;
+    conf->alog = NULL;
+    conf->bodyctype = WBOX_DEFAULT_BODY_CTYPE;
+    conf->stallms = WBOX_DEFAULT_STALL_MS;
+    conf->alpn = WBOX_DEFAULT_ALPN;
+    conf->conns = WBOX_DEFAULT_CPS_CONNS;
+    conf->body.fd = -1;
 
     if (argc < 2) {
         wboxHelp();
@@ -1039,6 +5545,7 @@ static void parseArgs(char **argv, int argc, wconfig *conf) {
     }
     /* Server mode option must be at argv[1] ... */
     if (!strcmp(argv[1],"servermode")) conf->servermode = 1;
+    if (!strcmp(argv[1],"servertest")) conf->servermode = conf->servertest = 1;
 
     /* Make sure it's possible to call wbox with every kind
      * of argument as url including "-h", using:
@@ -1076,6 +5583,32 @@ static void parseArgs(char **argv, int argc, wconfig *conf) {
             conf->http10=1;
         } else if (!strcmp(argv[j],"close")) {
             conf->close=1;
+        } else if (!strcmp(argv[j],"cps")) {
+            conf->cps=1;
+        } else if (!strcmp(argv[j],"cpsreq")) {
+            conf->cpsreq=1;
+        } else if (!strcmp(argv[j],"rst")) {
+            conf->rst=1;
+        } else if (next && !strcmp(argv[j],"conns")) {
+            j++;
+            conf->conns = atoi(argv[j]);
+            if (conf->conns < 1) conf->conns = 1;
+        } else if (next && !strcmp(argv[j],"hold")) {
+            j++;
+            conf->hold = atoi(argv[j]);
+        } else if (next && !strcmp(argv[j],"holdrate")) {
+            j++;
+            conf->holdrate = atoi(argv[j]);
+        } else if (next && !strcmp(argv[j],"trickle")) {
+            j++;
+            conf->trickle = atoi(argv[j]);
+        } else if (!strcmp(argv[j],"noresume")) {
+            conf->noresume=1;
+        } else if (!strcmp(argv[j],"noticket")) {
+            conf->noticket=1;
+        } else if (next && !strcmp(argv[j],"alpn")) {
+            j++;
+            conf->alpn = argv[j];
         } else if (next && !strcmp(argv[j],"host")) {
             j++;
             conf->host = argv[j];
@@ -1085,6 +5618,24 @@ static void parseArgs(char **argv, int argc, wconfig *conf) {
         } else if (next && !strcmp(argv[j],"clients")) {
             j++;
             conf->clients = atoi(argv[j]);
+        } else if (next && (!strcmp(argv[j],"post") ||
+                            !strcmp(argv[j],"put"))) {
+            conf->bodyflags = (argv[j][1] == 'o') ? WBOX_USE_POST :
+                                                    WBOX_USE_PUT;
+            j++;
+            conf->bodyfile = argv[j];
+        } else if (next && !strcmp(argv[j],"segsize")) {
+            j++;
+            conf->segsize = atoi(argv[j]);
+            if (conf->segsize < 0) conf->segsize = 0;
+            conf->timesplit = 1;
+        } else if (next && !strcmp(argv[j],"stall")) {
+            j++;
+            conf->stallms = atoi(argv[j]);
+            conf->timesplit = 1;
+        } else if (next && !strcmp(argv[j],"ctype")) {
+            j++;
+            conf->bodyctype = argv[j];
         } else if (next && !strcmp(argv[j],"referer")) {
             j++;
             conf->referer = argv[j];
@@ -1104,6 +5655,119 @@ static void parseArgs(char **argv, int argc, wconfig *conf) {
         } else if (next && !strcmp(argv[j],"maxclients")) {
             j++;
             conf->maxclients = atoi(argv[j]);
+        } else if (next && !strcmp(argv[j],"workers")) {
+            j++;
+            conf->workers = atoi(argv[j]);
+            if (conf->workers < 1) conf->workers = 1;
+        } else if (!strcmp(argv[j],"nopin")) {
+            conf->nopin = 1;
+        } else if (!strcmp(argv[j],"uring")) {
+            conf->uring = 1;
+        } else if (next && !strcmp(argv[j],"keepalive")) {
+            j++;
+            conf->keepalive = atoi(argv[j]);
+            if (conf->keepalive < 1) conf->keepalive = 1;
+        } else if (next && !strcmp(argv[j],"keepalivemax")) {
+            j++;
+            conf->keepalivemax = atoi(argv[j]);
+            if (conf->keepalivemax < 1) conf->keepalivemax = 1;
+        } else if (next && !strcmp(argv[j],"headertimeout")) {
+            j++;
+            conf->headertimeout = atoi(argv[j]);
+            if (conf->headertimeout < 1) conf->headertimeout = 1;
+        } else if (next && !strcmp(argv[j],"iotimeout")) {
+            j++;
+            conf->iotimeout = atoi(argv[j]);
+            if (conf->iotimeout < 1) conf->iotimeout = 1;
+        } else if (next && !strcmp(argv[j],"fcache")) {
+            j++;
+            conf->fcachemax = atoi(argv[j]);
+            if (conf->fcachemax < 0) conf->fcachemax = 0;
+        } else if (!strcmp(argv[j],"gzip")) {
+#ifdef WBOX_ZLIB
+            conf->gzip = 1;
+#else
+            fprintf(stderr,"Sorry, wbox was compiled without zlib support.\n");
+            exit(WBOX_EXIT_BADARGS);
+#endif
+        } else if (next && !strcmp(argv[j],"gzipcache")) {
+            j++;
+            conf->gzcachemax = (long long)atoi(argv[j])*1024*1024;
+        } else if (next && !strcmp(argv[j],"dircache")) {
+            j++;
+            conf->dircachemax = (long long)atoi(argv[j])*1024*1024;
+        } else if (next && !strcmp(argv[j],"pagesize")) {
+            j++;
+            conf->pagesize = argv[j];
+        } else if (leftargs >= 2 && !strcmp(argv[j],"bindurl")) {
+            srvbind *b;
+
+            if (conf->nbinds == WBOX_BINDS_MAX) {
+                fprintf(stderr, "Too many bindurl options, max %d\n",
+                    WBOX_BINDS_MAX);
+                exit(WBOX_EXIT_BADARGS);
+            }
+            b = &conf->bind[conf->nbinds++];
+            b->url = argv[j+1];
+            b->cmd = argv[j+2];
+            b->out = sdsnew("");
+            b->pid = -1;
+            b->fd = -1;
+            j += 2;
+        } else if (next && !strcmp(argv[j],"bindttl")) {
+            j++;
+            conf->bindttl = atoi(argv[j]);
+            if (conf->bindttl < 0) conf->bindttl = 0;
+        } else if (next && !strcmp(argv[j],"bindmax")) {
+            j++;
+            conf->bindmax = atoi(argv[j]);
+            if (conf->bindmax < 1) conf->bindmax = 1;
+        } else if (next && !strcmp(argv[j],"statsurl")) {
+            j++;
+            conf->statsurl = !strcmp(argv[j],"none") ? NULL : argv[j];
+        } else if (next && !strcmp(argv[j],"accesslog")) {
+            j++;
+            conf->accesslog = argv[j];
+        } else if (next && (!strcmp(argv[j],"bwconn") ||
+                            !strcmp(argv[j],"bwtotal")))
+        {
+            char *end;
+            long long rate = parseSize(argv[j+1],&end);
+
+            if (rate == -1 || *end != '\0') {
+                fprintf(stderr, "Invalid rate '%s'\n", argv[j+1]);
+                exit(WBOX_EXIT_BADARGS);
+            }
+            if (!strcmp(argv[j],"bwconn"))
+                conf->bwconn = rate;
+            else
+                conf->bwtotal = rate;
+            conf->shaping = conf->bwconn || conf->bwtotal;
+            j++;
+        } else if (leftargs >= 2 && !strcmp(argv[j],"delay")) {
+            if (conf->ndelays < WBOX_DELAYS_MAX) {
+                srvdelay *d = &conf->delay[conf->ndelays++];
+                char *jitter = strchr(argv[j+2],':');
+
+                d->prefix = argv[j+1];
+                d->ms = atoi(argv[j+2]);
+                d->jitter = jitter ? atoi(jitter+1) : 0;
+                if (d->ms < 0) d->ms = 0;
+                if (d->jitter < 0) d->jitter = 0;
+            }
+            j += 2;
+        } else if (next && !strcmp(argv[j],"ipconnmax")) {
+            j++;
+            conf->ipconnmax = atoi(argv[j]);
+            if (conf->ipconnmax < 0) conf->ipconnmax = 0;
+        } else if (next && !strcmp(argv[j],"iprate")) {
+            char *burst = strchr(argv[j+1],':');
+
+            j++;
+            conf->iprate = atoi(argv[j]);
+            if (conf->iprate < 0) conf->iprate = 0;
+            conf->ipburst = burst ? atoi(burst+1) : conf->iprate;
+            if (conf->ipburst < 1) conf->ipburst = 1;
         } else if (!strcmp(argv[j],"-h") ||
                    !strcmp(argv[j],"--help")) {
             wboxHelp();
@@ -1131,7 +5795,11 @@ static void printReplyStatus(int reqid, replyinfo *oldri, replyinfo *ri) {
     printf(" bytes");
     /* request time */
     printf("    %d ms",ri->time);
+    if (ri->tlstime)
+        printf("    tls %.3f ms%s",(float)ri->tlstime/1000,
+            ri->tlsresumed ? " resumed" : "");
     if (ri->compr) printf("    compr");
+    if (conf.holdstats) printf("    held %ld",conf.holdstats->held);
     printf("\n");
 }
 
@@ -1162,17 +5830,55 @@ int main(int argc, char **argv)
         ui.domain=sdsnew(conf.host);
     }
 
+    if (ui.tls) {
+#ifdef WBOX_TLS
+        tlsInit(&conf);
+#else
+        fprintf(stderr,"Sorry, wbox was compiled without TLS support.\n");
+        exit(WBOX_EXIT_BADARGS);
+#endif
+    }
+
+    errno = 0;
+    if (conf.bodyfile &&
+        openReqBody(&conf.body,conf.bodyfile,ui.tls) == -1)
+    {
+        fprintf(stderr,"Opening the request body %s: %s\n", conf.bodyfile,
+            errno ? strerror(errno) : "not a regular file");
+        exit(WBOX_EXIT_BADARGS);
+    }
+
+    /* The request is always the same, create it only once */
+    {
+        int reqflags = conf.bodyflags;
+        if (conf.compr) reqflags |= WBOX_ACCEPT_COMPR;
+        if (conf.head) reqflags |= WBOX_USE_HEAD;
+        if (conf.http10) reqflags |= WBOX_USE_HTTP10;
+        conf.reqtemplate = createHttpReq(&ui,reqflags,conf.cookie,
+            conf.cookies,conf.referer,&conf.body,conf.bodyctype);
+    }
+
     if (!conf.silent) {
         printf("WBOX %s (%s) port %d",ui.domain,ip,ui.port);
+        if (ui.tls) printf(" [tls]");
+        if (conf.cps) printf(" [cps %d conns]",conf.conns);
+        if (conf.hold) printf(" [hold %d]",conf.hold);
         if (conf.compr) printf(" [compr]");
-        if (conf.head) printf(" [head]");
+        if (conf.bodyflags)
+            printf(" [%s %lld bytes]",
+                (conf.bodyflags & WBOX_USE_POST) ? "post" : "put",
+                (long long) conf.body.len);
+        else if (conf.head) printf(" [head]");
         if (conf.wait != 1) printf(" [wait %d]",conf.wait);
         printf("\n");
     }
 
+    if (conf.hold > 0 && !conf.cps) startHoldProcess(ip,&ui,&conf);
+
     if (conf.clients > 1) {
         if (spawnChilds(conf.clients-1)) {
             /* Childs specific code */
+            conf.holdpid = 0; /* the holding process is not our child */
         } else {
             /* Parent specific code */
             Signal(SIGINT,sigHandler);
@@ -1181,16 +5887,24 @@ int main(int argc, char **argv)
         Signal(SIGINT,sigHandler);
     }
 
+    conf.starttime = milliseconds();
+    if (conf.cps) cpsMode(ip,&ui,&conf);
+
     initReplyInfo(&oldri);
     while(1) {
-        int flags = WBOX_NONE;
-        if (conf.compr) flags |= WBOX_ACCEPT_COMPR;
-        if (conf.head) flags |= WBOX_USE_HEAD;
-
         /* Request */
         httpRequest(&ri,ip,&ui,&conf);
         conf.timesum += ri.time;
         conf.timesum_samples++;
+        if (ri.tlstime) {
+            if (ri.tlsresumed) {
+                conf.tlsresumed++;
+                conf.tlsresumedtime += ri.tlstime;
+            } else {
+                conf.tlsfull++;
+                conf.tlsfulltime += ri.tlstime;
+            }
+        }
         if (reqid == 0) {
             conf.mintime = conf.maxtime = ri.time;
         } else {
@@ -1199,7 +5913,7 @@ int main(int argc, char **argv)
         }
         if (!conf.silent) {
             printReplyStatus(reqid,&oldri,&ri);
-            if (conf.timesplit) printTimesplit(&ri);
+            if (conf.timesplit) printTimesplit(&ri,&conf);
         }
         reqid++;
         freeReplyInfo(&oldri);
@@ -1208,7 +5922,9 @@ int main(int argc, char **argv)
         if (reqid == conf.maxreq) break;
         sleep(conf.wait);
     }
+    if (conf.holdpid > 0) kill(conf.holdpid,SIGTERM);
     freeUrl(&ui);
+    sdsfree(conf.reqtemplate);
     freeReplyInfo(&oldri);
     if (!conf.silent) printStats();
     return 0;
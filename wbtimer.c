@@ -0,0 +1,152 @@
+/* wbtimer.c -- hierarchical timer wheel
+ * Copyright (C) 2007 Salvatore Sanfilippo, antirez@gmail.com
+ * This softare is released under the following BSD license:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may 
+ *    be used to endorse or promote products derived from this software 
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stddef.h>
+
+#include "wbtimer.h"
+
+static void twListInit(twTimer *head) {
+    head->prev = head->next = head;
+}
+
+void twInit(twWheel *tw, long long now) {
+    int j, l;
+
+    tw->now = now;
+    for (j = 0; j < TW_ROOT_SIZE; j++) twListInit(&tw->root[j]);
+    for (l = 0; l < TW_LEVELS; l++)
+        for (j = 0; j < TW_LEVEL_SIZE; j++) twListInit(&tw->level[l][j]);
+}
+
+void twInitTimer(twTimer *t) {
+    t->prev = t->next = NULL;
+}
+
+int twPending(twTimer *t) {
+    return t->next != NULL;
+}
+
+void twDel(twTimer *t) {
+    if (!t->next) return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+/* Link 't' in the slot covering its expire time */
+static void twLink(twWheel *tw, twTimer *t) {
+    long long expire = t->expire, delta = expire-tw->now;
+    twTimer *head;
+    int l;
+
+    if (delta < 0) {
+        /* Already expired: process it at the next tick */
+        head = &tw->root[tw->now & (TW_ROOT_SIZE-1)];
+    } else if (delta < TW_ROOT_SIZE) {
+        head = &tw->root[expire & (TW_ROOT_SIZE-1)];
+    } else {
+        for (l = 0; l < TW_LEVELS-1; l++)
+            if (delta < 1LL << (TW_ROOT_BITS+(l+1)*TW_LEVEL_BITS)) break;
+        if (delta >= 1LL << (TW_ROOT_BITS+TW_LEVELS*TW_LEVEL_BITS)) {
+            /* Too far in the future, the timer will be moved down and
+             * rescheduled when its slot is reached. */
+            expire = tw->now+(1LL << (TW_ROOT_BITS+TW_LEVELS*TW_LEVEL_BITS))-1;
+        }
+        head = &tw->level[l][(expire >> (TW_ROOT_BITS+l*TW_LEVEL_BITS)) &
+                             (TW_LEVEL_SIZE-1)];
+    }
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/* Schedule 't' to expire at tick 'expire', rescheduling it if pending */
+void twAdd(twWheel *tw, twTimer *t, long long expire) {
+    twDel(t);
+    t->expire = expire;
+    twLink(tw,t);
+}
+
+/* Move the timers of slot 'idx' of level 'l' to the lower levels. Returns
+ * the slot index, so that the caller knows if the upper level must be
+ * cascaded too (index 0 means a whole turn was completed). */
+static int twCascade(twWheel *tw, int l, int idx) {
+    twTimer *head = &tw->level[l][idx], list;
+
+    /* Detach the list first: timers may be linked again in this slot */
+    if (head->next == head) return idx;
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    twListInit(head);
+    while(list.next != &list) {
+        twTimer *t = list.next;
+
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        twLink(tw,t);
+    }
+    return idx;
+}
+
+/* Process all the ticks up to 'now' included, calling 'proc' for every
+ * expired timer, already removed from the wheel, so that 'proc' can add
+ * it again or free it. Returns the number of expired timers. */
+int twRun(twWheel *tw, long long now, twTimerProc *proc) {
+    int expired = 0;
+
+    while(tw->now <= now) {
+        int idx = tw->now & (TW_ROOT_SIZE-1), l;
+        twTimer *head = &tw->root[idx];
+
+        if (idx == 0) {
+            for (l = 0; l < TW_LEVELS; l++) {
+                int lidx = (tw->now >> (TW_ROOT_BITS+l*TW_LEVEL_BITS)) &
+                           (TW_LEVEL_SIZE-1);
+
+                if (twCascade(tw,l,lidx) != 0) break;
+            }
+        }
+        while(head->next != head) {
+            twTimer *t = head->next;
+
+            twDel(t);
+            if (t->expire > tw->now) {
+                /* Clamped timer that is still in the future */
+                twLink(tw,t);
+                continue;
+            }
+            proc(tw,t);
+            expired++;
+        }
+        tw->now++;
+    }
+    return expired;
+}
@@ -0,0 +1,65 @@
+/* Copyright (C) 2007 Salvatore Sanfilippo, antirez@gmail.com
+ * This softare is released under the following BSD license:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors may 
+ *    be used to endorse or promote products derived from this software 
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef WBOX_TIMER_H
+#define WBOX_TIMER_H
+
+/* Hierarchical timer wheel. Time is measured in ticks, the unit is up to
+ * the caller. The first level has a slot for each of the next
+ * TW_ROOT_SIZE ticks, every other level has TW_LEVEL_SIZE slots, each
+ * one covering a whole turn of the previous level. Adding and removing a
+ * timer is O(1), and advancing the wheel is O(1) per tick plus the work
+ * to move timers down one level now and then. */
+#define TW_ROOT_BITS 8
+#define TW_LEVEL_BITS 6
+#define TW_ROOT_SIZE (1<<TW_ROOT_BITS)
+#define TW_LEVEL_SIZE (1<<TW_LEVEL_BITS)
+#define TW_LEVELS 3 /* besides the first, so up to 2^26 ticks ahead */
+
+/* A timer is embedded in the structure it refers to. Slots are circular
+ * lists with the head as sentinel, so timers can unlink themselves. */
+typedef struct twTimer {
+    long long expire; /* tick */
+    struct twTimer *prev, *next; /* NULL if not pending */
+} twTimer;
+
+typedef struct twWheel {
+    long long now; /* next tick to process */
+    twTimer root[TW_ROOT_SIZE];
+    twTimer level[TW_LEVELS][TW_LEVEL_SIZE];
+} twWheel;
+
+typedef void twTimerProc(twWheel *tw, twTimer *t);
+
+void twInit(twWheel *tw, long long now);
+void twInitTimer(twTimer *t);
+void twAdd(twWheel *tw, twTimer *t, long long expire);
+void twDel(twTimer *t);
+int twPending(twTimer *t);
+int twRun(twWheel *tw, long long now, twTimerProc *proc);
+
+#endif